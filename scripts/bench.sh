@@ -1,5 +1,8 @@
 #!/bin/bash
 
+# Benchmark over loopback shaped to the bandwidth set in up.sh, e.g.
+#   ./scripts/bench.sh --output results.json
 sudo ./scripts/down.sh
-python ./scripts/get_perf_plot.py
 sudo ./scripts/up.sh
+python ./scripts/benchmark.py "$@"
+sudo ./scripts/down.sh
@@ -0,0 +1,385 @@
+"""End to end benchmarks of the serving and fetching hot paths.
+
+A server runs in a separate process and the scenarios are fetched from it into
+preallocated tensors, like a recovering rank would:
+
+- link:       raw TCP between the two processes, the ceiling for everything else
+- small:      many small tensors in one batch
+- large:      a single huge tensor
+- ttypes:     a medium state dict in every transfer type
+- concurrent: several clients fetching the same state dict at once
+
+each for every combination of --servers, --devices (where the source tensors
+live) and --transports. Every result reports p50 and p99 latency of a fetch,
+throughput, and the CPU seconds the client and the server spent per GB moved.
+Results go to --output as JSON, and with --baseline the run fails if any result
+got slower than a previous one by more than --tolerance.
+
+    python scripts/benchmark.py --output results.json
+    python scripts/benchmark.py --devices cpu,cuda --transports tcp,shm --baseline results.json
+"""
+from typing import Any, Callable, Dict, List, NamedTuple, Optional, Tuple
+import argparse
+import json
+import math
+import multiprocessing
+import os
+import platform
+import socket
+import subprocess
+import sys
+import threading
+import time
+
+# Per request logging costs more than some of the requests being measured
+os.environ.setdefault("TORCHSTATE_LOG_LEVEL", "WARNING")
+
+import torch
+from torchstate.client import connect
+from torchstate.ttype_consts import TransferType
+
+PREFIX = "[bench]"
+
+class Workload(NamedTuple):
+    """Tensors of a scenario: count tensors of numel fp32 elements each."""
+    count: int
+    numel: int
+
+    @property
+    def nbytes(self) -> int:
+        return self.count * self.numel * 4
+
+WORKLOADS = {
+    "small": Workload(4096, 4096),
+    "large": Workload(1, 1 << 28),
+    "ttypes": Workload(16, 1 << 22),
+    "concurrent": Workload(64, 1 << 18),
+}
+
+# Sizes of the link scenario, in bytes
+LINK_SIZES = [1 << 10, 1 << 16, 1 << 20, 1 << 24, 1 << 28]
+
+SERVER_OPTIONS = {
+    "python": {},
+    "native": {"native": True},
+    "io_uring": {"native": True, "io_uring": True},
+}
+
+def _scaled(workload: Workload, scale: float) -> Workload:
+    # Small tensors stay small, there are just fewer of them
+    if workload.count > 1:
+        return Workload(max(1, int(workload.count * scale)), workload.numel)
+    return Workload(1, max(1, int(workload.numel * scale)))
+
+def _free_port() -> int:
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+def _percentile(values: List[float], q: float) -> float:
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, max(0, math.ceil(q * len(ordered)) - 1))]
+
+def _serve(pipe, workload: Workload, device: str, port: int, options: Dict[str, Any], share_memory: bool):
+    """Server process: serve the workload until told to stop, reporting its CPU time on request."""
+    from torchstate.server import StateServer
+
+    torch.manual_seed(0)
+    tensors = {f"t{i}": torch.randn(workload.numel, device=device) for i in range(workload.count)}
+    if share_memory and device == "cpu":
+        # So that shm clients can map the live tensors
+        for tensor in tensors.values():
+            tensor.share_memory_()
+    server = StateServer({"bench": tensors}, host="127.0.0.1", port=port, **options)
+    server.start()
+    pipe.send("ready")
+    while pipe.recv() == "cpu":
+        pipe.send(time.process_time())
+    server.stop()
+
+def _serve_link(pipe, port: int):
+    """Server process of the link scenario: answer every 'q' size with that many bytes."""
+    payload = bytearray(max(LINK_SIZES))
+    listen_socket = socket.create_server(("127.0.0.1", port))
+    pipe.send("ready")
+
+    def handle(conn: socket.socket):
+        with conn:
+            conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            view = memoryview(payload)
+            while True:
+                request = conn.recv(8, socket.MSG_WAITALL)
+                if len(request) != 8:
+                    return
+                conn.sendall(view[:int.from_bytes(request, "little")])
+
+    def accept():
+        while True:
+            try:
+                conn, _ = listen_socket.accept()
+            except OSError:
+                return
+            threading.Thread(target=handle, args=(conn,), daemon=True).start()
+
+    threading.Thread(target=accept, daemon=True).start()
+    while pipe.recv() == "cpu":
+        pipe.send(time.process_time())
+    listen_socket.close()
+
+class ServerProcess:
+    """A server in a child process, started on enter and stopped on exit."""
+
+    def __init__(self, target: Callable, *args):
+        context = multiprocessing.get_context("spawn")
+        self._pipe, child_pipe = context.Pipe()
+        self._process = context.Process(target=target, args=(child_pipe,) + args, daemon=True)
+
+    def __enter__(self) -> "ServerProcess":
+        self.start()
+        return self
+
+    def __exit__(self, *exc) -> None:
+        self.stop()
+
+    def start(self) -> None:
+        self._process.start()
+        try:
+            ready = self._pipe.poll(600) and self._pipe.recv() == "ready"
+        except EOFError:
+            ready = False
+        if not ready:
+            self._process.kill()
+            raise RuntimeError("Server process didn't start")
+
+    def stop(self) -> None:
+        self._pipe.send("stop")
+        self._process.join(60)
+        if self._process.is_alive():
+            self._process.kill()
+
+    def cpu_time(self) -> float:
+        self._pipe.send("cpu")
+        return self._pipe.recv()
+
+def _measure(
+    server: ServerProcess,
+    fetches: List[Callable[[], None]],
+    nbytes: int,
+    iterations: int,
+) -> Dict[str, float]:
+    """Run every fetch concurrently, iterations times after a warmup round.
+
+    Latency is that of single fetches, throughput that of all of them together.
+    """
+    def run_round(latencies: List[float]) -> float:
+        def timed(fetch: Callable[[], None]) -> None:
+            begin = time.perf_counter()
+            fetch()
+            latencies.append(time.perf_counter() - begin)
+
+        begin = time.perf_counter()
+        if len(fetches) == 1:
+            timed(fetches[0])
+        else:
+            threads = [threading.Thread(target=timed, args=(fetch,)) for fetch in fetches]
+            for thread in threads:
+                thread.start()
+            for thread in threads:
+                thread.join()
+        return time.perf_counter() - begin
+
+    run_round([])
+    latencies: List[float] = []
+    client_cpu = time.process_time()
+    server_cpu = server.cpu_time()
+    elapsed = sum(run_round(latencies) for _ in range(iterations))
+    server_cpu = server.cpu_time() - server_cpu
+    client_cpu = time.process_time() - client_cpu
+
+    gigabytes = nbytes * len(fetches) * iterations / 1e9
+    return {
+        "p50_ms": _percentile(latencies, 0.5) * 1e3,
+        "p99_ms": _percentile(latencies, 0.99) * 1e3,
+        "gb_per_s": gigabytes / elapsed,
+        "client_cpu_s_per_gb": client_cpu / gigabytes,
+        "server_cpu_s_per_gb": server_cpu / gigabytes,
+    }
+
+def _client(transport: str, port: int, rdma_device: str):
+    if transport == "tcp":
+        return connect(f"zbserver://127.0.0.1:{port}", persistent=True)
+    if transport == "shm":
+        return connect(f"shm://127.0.0.1:{port}")
+    return connect(f"rdma://127.0.0.1:{port}", device=rdma_device)
+
+def run_link(args) -> List[Dict[str, Any]]:
+    results = []
+    port = _free_port()
+    with ServerProcess(_serve_link, port) as server:
+        sizes = [size for size in LINK_SIZES if size <= max(LINK_SIZES) * args.scale] or LINK_SIZES[:1]
+        for size in sizes:
+            sock = socket.create_connection(("127.0.0.1", port))
+            sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            buffer = memoryview(bytearray(size))
+
+            def fetch():
+                sock.sendall(size.to_bytes(8, "little"))
+                received = 0
+                while received < size:
+                    n = sock.recv_into(buffer[received:])
+                    if n == 0:
+                        raise ConnectionError("Link server closed the connection")
+                    received += n
+
+            metrics = _measure(server, [fetch], size, args.iterations)
+            sock.close()
+            results.append({"scenario": "link", "server": "socket", "device": "cpu", "transport": "tcp",
+                             "transfer_type": None, "clients": 1, "tensors": 0, "bytes": size, **metrics})
+    return results
+
+def run_scenario(args, scenario: str, server_name: str, device: str) -> List[Dict[str, Any]]:
+    workload = _scaled(WORKLOADS[scenario], args.scale)
+    options = dict(SERVER_OPTIONS[server_name])
+    if "shm" in args.transports:
+        options["shm"] = True
+    if "rdma" in args.transports:
+        options["rdma_device"] = args.rdma_device
+
+    transfer_types: List[Optional[TransferType]] = [None]
+    if scenario == "ttypes":
+        transfer_types += list(TransferType)
+    client_counts = args.clients if scenario == "concurrent" else [1]
+
+    results = []
+    port = _free_port()
+    server = ServerProcess(_serve, workload, device, port, options, "shm" in args.transports)
+    try:
+        server.start()
+    except RuntimeError as e:
+        return [{"scenario": scenario, "server": server_name, "device": device, "transport": ",".join(args.transports),
+                 "transfer_type": None, "clients": 1, "tensors": workload.count, "bytes": workload.nbytes,
+                 "skipped": str(e)}]
+    try:
+        for transport in args.transports:
+            for transfer_type in transfer_types:
+                for clients in client_counts:
+                    record = {"scenario": scenario, "server": server_name, "device": device, "transport": transport,
+                              "transfer_type": transfer_type.name if transfer_type else None,
+                              "clients": clients, "tensors": workload.count, "bytes": workload.nbytes}
+                    try:
+                        connections = [_client(transport, port, args.rdma_device) for _ in range(clients)]
+                    except Exception as e:
+                        results.append({**record, "skipped": str(e)})
+                        continue
+
+                    def fetcher(client):
+                        inplace = {f"t{i}": torch.empty(workload.numel) for i in range(workload.count)}
+                        return lambda: client.get_state_dict(PREFIX, transfer_type=transfer_type, inplace=inplace)
+
+                    try:
+                        metrics = _measure(server, [fetcher(c) for c in connections], workload.nbytes,
+                                           args.iterations)
+                        results.append({**record, **metrics})
+                    except Exception as e:
+                        results.append({**record, "skipped": str(e)})
+                    finally:
+                        for client in connections:
+                            client.close()
+    finally:
+        server.stop()
+    return results
+
+def _key(record: Dict[str, Any]) -> Tuple:
+    return tuple(record[k] for k in ("scenario", "server", "device", "transport", "transfer_type", "clients",
+                                     "bytes"))
+
+def find_regressions(results: List[Dict[str, Any]], baseline: List[Dict[str, Any]], tolerance: float) -> List[str]:
+    """Describe every result slower than its baseline by more than tolerance."""
+    previous = {_key(r): r for r in baseline if "skipped" not in r}
+    regressions = []
+    for record in results:
+        old = previous.get(_key(record))
+        if old is None or "skipped" in record:
+            continue
+        if record["gb_per_s"] < old["gb_per_s"] * (1 - tolerance):
+            regressions.append(f"{_key(record)}: {old['gb_per_s']:.2f} -> {record['gb_per_s']:.2f} GB/s")
+        if record["p50_ms"] > old["p50_ms"] * (1 + tolerance):
+            regressions.append(f"{_key(record)}: p50 {old['p50_ms']:.3f} -> {record['p50_ms']:.3f} ms")
+    return regressions
+
+def environment() -> Dict[str, Any]:
+    try:
+        commit = subprocess.run(["git", "rev-parse", "HEAD"], capture_output=True, text=True,
+                                cwd=os.path.dirname(os.path.abspath(__file__))).stdout.strip()
+    except OSError:
+        commit = ""
+    return {
+        "commit": commit,
+        "host": platform.node(),
+        "python": platform.python_version(),
+        "torch": torch.__version__,
+        "cpus": os.cpu_count(),
+        "cuda": torch.cuda.get_device_name() if torch.cuda.is_available() else None,
+    }
+
+def print_table(results: List[Dict[str, Any]]) -> None:
+    print(f"{'scenario':<11} {'server':<9} {'dev':<5} {'transport':<9} {'ttype':<13} {'cli':>3} {'MB':>9} "
+          f"{'p50 ms':>9} {'p99 ms':>9} {'GB/s':>7} {'cli s/GB':>8} {'srv s/GB':>8}")
+    for r in results:
+        head = (f"{r['scenario']:<11} {r['server']:<9} {r['device']:<5} {r['transport']:<9} "
+                f"{r['transfer_type'] or '-':<13} {r['clients']:>3} {r['bytes'] / 1e6:>9.2f}")
+        if "skipped" in r:
+            print(f"{head} skipped: {r['skipped']}")
+        else:
+            print(f"{head} {r['p50_ms']:>9.3f} {r['p99_ms']:>9.3f} {r['gb_per_s']:>7.2f} "
+                  f"{r['client_cpu_s_per_gb']:>8.3f} {r['server_cpu_s_per_gb']:>8.3f}")
+
+def main() -> int:
+    def names(value: str) -> List[str]:
+        return [v for v in value.split(",") if v]
+
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--scenarios", type=names, default=["link"] + list(WORKLOADS))
+    parser.add_argument("--servers", type=names, default=["python", "native"],
+                        help=f"Server modes, of {', '.join(SERVER_OPTIONS)}")
+    parser.add_argument("--devices", type=names, default=["cpu"], help="Devices of the served tensors")
+    parser.add_argument("--transports", type=names, default=["tcp"], help="Of tcp, shm and rdma")
+    parser.add_argument("--rdma-device", default="", help="RDMA device of both ends, the first one by default")
+    parser.add_argument("--clients", type=lambda v: [int(c) for c in names(v)], default=[1, 4, 16],
+                        help="Client counts of the concurrent scenario")
+    parser.add_argument("--iterations", type=int, default=20, help="Timed fetches per result")
+    parser.add_argument("--scale", type=float, default=1.0, help="Multiplier of the workload sizes")
+    parser.add_argument("--output", help="Write the results to this JSON file")
+    parser.add_argument("--baseline", help="Fail on regressions against the results in this JSON file")
+    parser.add_argument("--tolerance", type=float, default=0.1, help="Allowed slowdown against the baseline")
+    args = parser.parse_args()
+
+    results = []
+    if "link" in args.scenarios:
+        results += run_link(args)
+    for scenario in args.scenarios:
+        if scenario == "link":
+            continue
+        if scenario not in WORKLOADS:
+            parser.error(f"Unknown scenario: {scenario}")
+        for server_name in args.servers:
+            for device in args.devices:
+                if device.startswith("cuda") and not torch.cuda.is_available():
+                    continue
+                results += run_scenario(args, scenario, server_name, device)
+
+    print_table(results)
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump({"environment": environment(), "results": results}, f, indent=2)
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            regressions = find_regressions(results, json.load(f)["results"], args.tolerance)
+        for regression in regressions:
+            print(f"REGRESSION {regression}", file=sys.stderr)
+        return 1 if regressions else 0
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())
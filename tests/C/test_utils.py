@@ -1,5 +1,18 @@
+import pytest
+import socket
+import struct
+import threading
+import time
 import torch
-from torchstate.C.utils import copy_bytes_to_tensor
+from torchstate.C.utils import (
+    EncodingCache, Metrics, Scheduler, copy_bytes_to_tensor, encode_tensor, send_payload, send_tensor,
+    recv_into_tensor, block_hashes, encode_skeleton, decode_skeleton, skeleton_key_ids, WITH_CODECS
+)
+from torchstate.ttype_consts import TransferType
+
+needs_codecs = pytest.mark.skipif(not WITH_CODECS, reason="requires libzstd and liblz4")
+ZSTD = pytest.param(TransferType.SHUFFLE_ZSTD, marks=needs_codecs)
+LZ4 = pytest.param(TransferType.SHUFFLE_LZ4, marks=needs_codecs)
 
 def test_copy_bytes_to_tensor():
     tensor = torch.zeros(10)
@@ -8,3 +21,338 @@ def test_copy_bytes_to_tensor():
     copy_bytes_to_tensor(tensor, bytes_data)
 
     assert list(tensor.untyped_storage()) == [97, 98, 99, 100] * 10
+
+def test_send_tensor():
+    tensor = torch.arange(10, dtype=torch.float32)
+    header = b'head'
+    a, b = socket.socketpair()
+
+    send_tensor(a.fileno(), tensor, header, TransferType.FLOAT32.value, chunk_size=24)
+    a.close()
+
+    data = b.recv(1024, socket.MSG_WAITALL)
+    assert data[:4] == header
+    # Payload frames are ('qq' nbytes, numel) followed by at most chunk_size bytes
+    assert struct.unpack('qq', data[4:20]) == (24, 6)
+    assert struct.unpack('qq', data[44:60]) == (16, 4)
+    payload = bytearray(data[20:44] + data[60:])
+    assert torch.equal(torch.frombuffer(payload, dtype=torch.float32), tensor)
+
+def test_recv_into_tensor():
+    expected = torch.arange(10, dtype=torch.float32)
+    a, b = socket.socketpair()
+    send_tensor(a.fileno(), expected, b'', TransferType.FLOAT32.value, chunk_size=8)
+    a.close()
+
+    tensor = torch.empty(10)
+    recv_into_tensor(b.fileno(), tensor, TransferType.FLOAT32.value)
+
+    assert torch.equal(tensor, expected)
+
+def test_send_non_contiguous_tensor():
+    expected = torch.arange(12, dtype=torch.float32).reshape(3, 4).t()
+    a, b = socket.socketpair()
+    send_tensor(a.fileno(), expected, b'', TransferType.FLOAT32.value, chunk_size=16)
+    a.close()
+
+    tensor = torch.empty(4, 3)
+    recv_into_tensor(b.fileno(), tensor, TransferType.FLOAT32.value)
+
+    assert torch.equal(tensor, expected)
+
+def test_strided_round_trip():
+    # More than 6 dimensions, and layouts that can't be read as dim 0 slabs
+    source = torch.randn(2, 3, 2, 2, 3, 2, 5).permute(6, 5, 4, 3, 2, 1, 0)[:, ::2]
+    for ttype, dtype in [(TransferType.FLOAT32, torch.float32), (TransferType.BFLOAT16, torch.bfloat16)]:
+        a, b = socket.socketpair()
+        send_tensor(a.fileno(), source, b'', ttype.value, chunk_size=28)
+        a.close()
+
+        tensor = torch.zeros(source.shape[::-1], dtype=dtype).permute(*range(source.dim() - 1, -1, -1))
+        recv_into_tensor(b.fileno(), tensor, ttype.value)
+        b.close()
+
+        assert torch.equal(tensor, source.to(dtype))
+
+def test_element_range_round_trip():
+    source = torch.randn(6, 10)
+    for expected in [source, source.t()]:
+        tensor = torch.zeros_like(expected)
+        for start, count in [(0, 13), (13, 40), (53, 7)]:
+            a, b = socket.socketpair()
+            send_tensor(a.fileno(), expected, b'', TransferType.FLOAT32.value, chunk_size=32, start=start, count=count)
+            a.close()
+            recv_into_tensor(b.fileno(), tensor, TransferType.FLOAT32.value, start=start, count=count)
+            b.close()
+
+        assert torch.equal(tensor, expected)
+
+def test_send_tensor_with_cast():
+    expected = torch.randn(1000)
+    for transfer_type, dtype in [(TransferType.BFLOAT16, torch.bfloat16), (TransferType.FLOAT16, torch.float16)]:
+        a, b = socket.socketpair()
+        send_tensor(a.fileno(), expected, b'', transfer_type.value, chunk_size=256)
+        a.close()
+
+        tensor = torch.empty(1000)
+        recv_into_tensor(b.fileno(), tensor, transfer_type.value)
+
+        assert torch.equal(tensor, expected.to(dtype).float())
+
+def test_send_tensor_uniform_int8():
+    expected = torch.randn(1000)
+    a, b = socket.socketpair()
+    send_tensor(a.fileno(), expected, b'', TransferType.UNIFORM_INT8.value, chunk_size=1024)
+    a.close()
+
+    tensor = torch.empty(1000)
+    recv_into_tensor(b.fileno(), tensor, TransferType.UNIFORM_INT8.value)
+
+    # Every 256 element block is quantized against its own min/max
+    for block, expected_block in zip(tensor.split(256), expected.split(256)):
+        step = (expected_block.max() - expected_block.min()) / 255
+        assert (block - expected_block).abs().max() <= step / 2 + 1e-6
+
+@pytest.mark.parametrize("ttype", [ZSTD, LZ4])
+def test_compressed_round_trip(ttype):
+    sources = [torch.randn(1000), torch.randn(40, 25).bfloat16().t(), torch.arange(1000), torch.rand(1000) > 0.5]
+    for source in sources:
+        a, b = socket.socketpair()
+        send_tensor(a.fileno(), source, b'', ttype.value, chunk_size=1024)
+        a.close()
+
+        tensor = torch.empty(source.shape, dtype=source.dtype)
+        recv_into_tensor(b.fileno(), tensor, ttype.value)
+        b.close()
+
+        # Bit exact, whatever the dtype and layout
+        assert torch.equal(tensor, source)
+
+    # Frames carry their dtype, so they can be upcast on the way in
+    source = torch.randn(1000).bfloat16()
+    a, b = socket.socketpair()
+    send_tensor(a.fileno(), source, b'', ttype.value, chunk_size=512)
+    a.close()
+    tensor = torch.empty(1000)
+    recv_into_tensor(b.fileno(), tensor, ttype.value)
+    assert torch.equal(tensor, source.float())
+
+@pytest.mark.skipif(WITH_CODECS, reason="built with the codecs")
+@pytest.mark.parametrize("ttype", [TransferType.SHUFFLE_ZSTD, TransferType.SHUFFLE_LZ4])
+def test_compressed_without_codecs(ttype):
+    a, b = socket.socketpair()
+    with pytest.raises(RuntimeError, match=ttype.name):
+        send_tensor(a.fileno(), torch.randn(1000), b'', ttype.value)
+
+@pytest.mark.parametrize("ttype", [TransferType.BFLOAT16, TransferType.UNIFORM_INT8, LZ4])
+def test_encoded_payload_round_trip(ttype):
+    source = torch.randn(3000)
+    payload = encode_tensor(source, ttype.value, chunk_size=4096)
+
+    # One encoding sent twice, like to two subscribers
+    for _ in range(2):
+        a, b = socket.socketpair()
+        thread = threading.Thread(target=send_payload, args=(a.fileno(), payload, b'', ttype.value),
+                                  kwargs={"chunk_size": 1000})
+        thread.start()
+        expected = torch.empty(3000)
+        tensor = torch.empty(3000)
+        recv_into_tensor(b.fileno(), tensor, ttype.value)
+        thread.join()
+
+        c, d = socket.socketpair()
+        send_tensor(c.fileno(), source, b'', ttype.value, chunk_size=4096)
+        recv_into_tensor(d.fileno(), expected, ttype.value)
+        assert torch.equal(tensor, expected)
+
+@pytest.mark.skipif(not torch.cuda.is_available(), reason="requires CUDA")
+def test_cuda_round_trip():
+    source = torch.randn(100, 30, device="cuda")
+    for ttype, dtype in [(TransferType.FLOAT32, torch.float32), (TransferType.BFLOAT16, torch.bfloat16),
+                         (TransferType.UNIFORM_INT8, torch.float32)]:
+        a, b = socket.socketpair()
+        send_tensor(a.fileno(), source, b'', ttype.value, chunk_size=1000)
+        a.close()
+
+        tensor = torch.empty(30, 100, dtype=dtype, device="cuda").t()
+        recv_into_tensor(b.fileno(), tensor, ttype.value)
+        b.close()
+
+        expected = source.to(dtype)
+        if ttype == TransferType.UNIFORM_INT8:
+            assert torch.allclose(tensor, expected, atol=0.1)
+        else:
+            assert torch.equal(tensor, expected)
+
+def test_block_hashes():
+    tensor = torch.arange(10, dtype=torch.float32)
+    hashes = block_hashes(tensor, 4)
+    # The last block holds the remaining two elements
+    assert hashes.shape == (3,)
+    assert torch.equal(block_hashes(tensor.clone(), 4), hashes)
+
+    tensor[5] = -1
+    changed = block_hashes(tensor, 4) != hashes
+    assert changed.tolist() == [False, True, False]
+
+def _send_in_background(sock, tensor, chunk_size, scheduler):
+    thread = threading.Thread(target=send_tensor, args=(sock.fileno(), tensor, b'', TransferType.FLOAT32.value),
+                              kwargs={"chunk_size": chunk_size, "scheduler": scheduler, "client": "peer"})
+    thread.start()
+    return thread
+
+def test_scheduler_pause():
+    scheduler = Scheduler()
+    scheduler.pause()
+    source = torch.arange(1000, dtype=torch.float32)
+    a, b = socket.socketpair()
+    thread = _send_in_background(a, source, 1000, scheduler)
+
+    # Nothing goes out while paused
+    b.settimeout(0.2)
+    with pytest.raises(socket.timeout):
+        b.recv(1)
+    b.settimeout(None)
+
+    scheduler.resume()
+    tensor = torch.empty(1000)
+    recv_into_tensor(b.fileno(), tensor, TransferType.FLOAT32.value)
+    thread.join()
+    assert torch.equal(tensor, source)
+
+def test_scheduler_bandwidth():
+    scheduler = Scheduler()
+    scheduler.set_bandwidth(0, 400 * 1024)
+    source = torch.randn(64 * 1024)
+    a, b = socket.socketpair()
+    begin = time.monotonic()
+    thread = _send_in_background(a, source, 32 * 1024, scheduler)
+
+    tensor = torch.empty(source.shape)
+    recv_into_tensor(b.fileno(), tensor, TransferType.FLOAT32.value)
+    thread.join()
+    # 256KB at 400KB/s, the first frame going out right away
+    assert time.monotonic() - begin >= 0.5
+    assert torch.equal(tensor, source)
+
+def test_send_tensor_metrics():
+    metrics = Metrics()
+    source = torch.randn(1000)
+    a, b = socket.socketpair()
+    send_tensor(a.fileno(), source, b'', TransferType.BFLOAT16.value, chunk_size=1024,
+                metrics=metrics, received=time.monotonic_ns())
+    tensor = torch.empty(1000)
+    recv_into_tensor(b.fileno(), tensor, TransferType.BFLOAT16.value)
+
+    stats = metrics.as_dict()
+    assert stats["payload_bytes"]["BFLOAT16"] == 2000
+    assert stats["first_byte_seconds"]["count"] == 1
+    assert stats["encode_seconds"]["count"] == 1
+    assert 'torchstate_payload_bytes_total{transfer_type="BFLOAT16"} 2000' in metrics.prometheus()
+
+@pytest.mark.parametrize("ttype", [TransferType.UNIFORM_INT8, ZSTD])
+def test_send_tensor_encoding_cache(ttype):
+    metrics = Metrics()
+    cache = EncodingCache(1 << 20, metrics)
+    source = torch.randn(3000)
+
+    expected = torch.empty(3000)
+    a, b = socket.socketpair()
+    send_tensor(a.fileno(), source, b'', ttype.value, chunk_size=1024)
+    recv_into_tensor(b.fileno(), expected, ttype.value)
+
+    # The first send encodes, the others reuse its frames
+    for _ in range(3):
+        a, b = socket.socketpair()
+        thread = threading.Thread(target=send_tensor, args=(a.fileno(), source, b'', ttype.value),
+                                  kwargs={"chunk_size": 1024, "cache": cache, "version": 7})
+        thread.start()
+        tensor = torch.empty(3000)
+        recv_into_tensor(b.fileno(), tensor, ttype.value)
+        thread.join()
+        assert torch.equal(tensor, expected)
+
+    # Live tensors and ranges are never cached
+    a, b = socket.socketpair()
+    send_tensor(a.fileno(), source, b'', ttype.value, chunk_size=1024, cache=cache)
+    send_tensor(a.fileno(), source, b'', ttype.value, chunk_size=1024, start=10, count=100, cache=cache, version=7)
+    recv_into_tensor(b.fileno(), torch.empty(3000), ttype.value)
+    recv_into_tensor(b.fileno(), torch.empty(3000), ttype.value, start=10, count=100)
+
+    stats = metrics.as_dict()["encoding_cache"]
+    assert (stats["misses"], stats["hits"]) == (1, 2)
+
+    cache.retire(8)
+    assert cache.size == 0
+
+def test_encoding_cache_concurrent_budget():
+    # Either payload fits on its own, both together don't
+    cache = EncodingCache(10000)
+    sources = [torch.randn(3000), torch.randn(3000)]
+    sockets = [socket.socketpair() for _ in sources]
+    threads = [
+        threading.Thread(target=send_tensor, args=(a.fileno(), source, b'', TransferType.BFLOAT16.value),
+                         kwargs={"chunk_size": 256, "cache": cache, "version": 7})
+        for (a, _), source in zip(sockets, sources)
+    ]
+    for thread in threads:
+        thread.start()
+    largest = 0
+    tensors = [torch.empty(3000) for _ in sources]
+    receivers = [
+        threading.Thread(target=recv_into_tensor, args=(b.fileno(), tensor, TransferType.BFLOAT16.value))
+        for (_, b), tensor in zip(sockets, tensors)
+    ]
+    for receiver in receivers:
+        receiver.start()
+    while any(thread.is_alive() for thread in threads + receivers):
+        largest = max(largest, cache.size)
+    for thread in threads + receivers:
+        thread.join()
+
+    assert largest <= 10000 and cache.size <= 10000
+    for tensor, source in zip(tensors, sources):
+        assert torch.equal(tensor, source.bfloat16().float())
+
+@pytest.mark.parametrize("ttype", [TransferType.BFLOAT16, ZSTD])
+def test_encoding_cache_oversized_payload(ttype):
+    # Random floats don't compress, so neither payload fits 4KB
+    cache = EncodingCache(4096)
+    source = torch.randn(3000)
+    for _ in range(2):
+        a, b = socket.socketpair()
+        thread = threading.Thread(target=send_tensor, args=(a.fileno(), source, b'', ttype.value),
+                                  kwargs={"chunk_size": 1024, "cache": cache, "version": 7})
+        thread.start()
+        tensor = torch.empty(3000)
+        recv_into_tensor(b.fileno(), tensor, ttype.value)
+        thread.join()
+        assert torch.equal(tensor, source.bfloat16().float() if ttype == TransferType.BFLOAT16 else source)
+    assert cache.size == 0
+
+def test_skeleton_round_trip():
+    weight, exp_avg = torch.randn(4, 4), torch.randn(4, 4)
+    optimizer = {
+        "state": {0: {"step": torch.tensor(3.0), "exp_avg": exp_avg}},
+        "param_groups": [{"lr": 1e-3, "betas": (0.9, 0.999), "foreach": None, "amsgrad": False,
+                          "name": "décodé", "params": [0]}],
+    }
+    state_dict = {"model": {"weight": weight}, "optimizer": optimizer, "step": 2 ** 40}
+    index = {"[model][weight]": (0,), "[optimizer][state][0][step]": (1,), "[optimizer][state][0][exp_avg]": (2,)}
+
+    skeleton = encode_skeleton(state_dict, "", index, {})
+    assert skeleton_key_ids(skeleton) == [0, 1, 2]
+    tensors = {0: weight, 1: optimizer["state"][0]["step"], 2: exp_avg}
+    assert decode_skeleton(skeleton, tensors) == state_dict
+
+    # Scalars of a snapshot replace the live ones, key types are kept
+    skeleton = encode_skeleton(optimizer, "[optimizer]", index, {"[optimizer][param_groups][0][lr]": 5e-4})
+    decoded = decode_skeleton(skeleton, tensors)
+    assert decoded["param_groups"][0]["lr"] == 5e-4
+    assert decoded["state"][0]["exp_avg"] is exp_avg
+    assert isinstance(decoded["param_groups"][0]["betas"], tuple)
+
+    with pytest.raises(RuntimeError):
+        encode_skeleton({"dtype": torch.float32}, "", index, {})
+    with pytest.raises(RuntimeError):
+        decode_skeleton(skeleton[:-1], tensors)
@@ -0,0 +1,266 @@
+import pytest
+import socket
+import struct
+import time
+import torch
+from torchstate.async_client import AsyncStateClient
+from torchstate.client import ServerResponseError, StateClient, connect
+from torchstate.relay import RelayStateClient
+from torchstate.server import StateServer
+from torchstate.sharded_client import ShardedStateClient
+from torchstate.ttype_consts import RequestType
+
+# The Python server, the native core, and the native core on io_uring rings
+MODES = [{}, {"native": True}, {"native": True, "io_uring": True}]
+
+def free_port() -> int:
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+@pytest.fixture
+def serve():
+    """Start a StateServer on a loopback port, returning it and its URL. Stopped after the test."""
+    servers = []
+
+    def start(state_dict, **kwargs):
+        server = StateServer(state_dict, host="127.0.0.1", port=free_port(), **kwargs)
+        server.start()
+        servers.append(server)
+        return server, f"zbserver://127.0.0.1:{server.port}"
+
+    yield start
+    for server in servers:
+        server.stop()
+
+@pytest.mark.parametrize("mode", MODES)
+def test_stalled_body_frees_worker(serve, mode):
+    weight = torch.arange(10, dtype=torch.float32)
+    server, url = serve({"w": weight}, num_workers=1, body_timeout=0.5, **mode)
+
+    # A batch request whose body stops short, on the only worker
+    stalled = socket.create_connection(("127.0.0.1", server.port))
+    stalled.sendall(struct.pack('244siq', b'', RequestType.BATCH.value, 100) + b'\0' * 10)
+    time.sleep(0.1)
+
+    begin = time.monotonic()
+    assert torch.equal(StateClient(url).get_tensor('[w]'), weight)
+    assert time.monotonic() - begin < 5
+
+    # The stalled connection is closed rather than answered
+    stalled.settimeout(5)
+    assert stalled.recv(1) == b""
+    stalled.close()
+
+def test_shm_mapping_outlives_snapshots(serve):
+    weight = torch.zeros(1000)
+    server, _ = serve({"w": weight}, shm=True, snapshot_buffers=1)
+    server.snapshot(1)
+    client = connect(f"shm://localhost:{server.port}")
+    mapped = client.get_tensor('[w]')
+
+    # Later snapshots don't reuse the buffer the client still maps
+    for step in range(2, 5):
+        weight.fill_(step)
+        server.snapshot(step)
+        assert torch.equal(client.get_tensor('[w]'), torch.full((1000,), float(step)))
+    assert torch.equal(mapped, torch.zeros(1000))
+    client.close()
+
+@pytest.mark.parametrize("mode", MODES)
+def test_persistent_pipelining(serve, mode):
+    a, b = torch.arange(10, dtype=torch.float32), torch.ones(3, 4)
+    _, url = serve({"a": a, "b": b}, **mode)
+    client = StateClient(url, persistent=True)
+
+    # Responses echo the request IDs, whatever their range
+    client._next_request_id = 2 ** 40
+    fetched = client.get_tensors(['[a]', '[b]', '[a]', '[b]'], max_inflight=3)
+    assert all(torch.equal(x, y) for x, y in zip(fetched, [a, b, a, b]))
+
+    # An error response leaves the connection usable
+    sock = client.client_socket
+    with pytest.raises(ServerResponseError):
+        client.get_tensor('[missing]')
+    assert client.client_socket is sock
+    assert torch.equal(client.get_tensor('[b]'), b)
+    client.close()
+
+@pytest.mark.parametrize("mode", MODES)
+def test_batch_get(serve, mode):
+    state_dict = {"model": {"layers": [{"w": torch.randn(4, 4)}, {"w": torch.randn(2)}], "head": torch.randn(3)}}
+    _, url = serve(state_dict, **mode)
+    client = StateClient(url)
+
+    fetched = client.get_state_dict('[model]')
+    assert torch.equal(fetched["head"], state_dict["model"]["head"])
+    assert torch.equal(fetched["layers"][1]["w"], state_dict["model"]["layers"][1]["w"])
+
+    # Wildcards, and tensors filled in place
+    inplace = {"layers": [{"w": torch.zeros(4, 4)}]}
+    fetched = client.get_state_dict('[model][layers][*][w]', inplace=inplace)
+    assert fetched["layers"][0]["w"] is inplace["layers"][0]["w"]
+    assert torch.equal(inplace["layers"][0]["w"], state_dict["model"]["layers"][0]["w"])
+
+def test_list_and_key_ids(serve):
+    state_dict = {"w": torch.randn(2, 3), "b": torch.zeros(5, dtype=torch.bfloat16), "step": 7}
+    _, url = serve(state_dict)
+    client = StateClient(url)
+
+    infos = {info.path: info for info in client.list_tensors()}
+    assert set(infos) == {'[w]', '[b]'}
+    assert infos['[w]'].shape == (2, 3) and infos['[w]'].stride == (3, 1)
+    assert infos['[b]'].dtype == torch.bfloat16
+    assert [info.path for info in client.list_tensors('[w*')] == ['[w]']
+
+    # Key IDs stand in for the paths
+    assert client.key_ids['[w]'] == infos['[w]'].key_id
+    assert torch.equal(client.get_tensor(infos['[w]'].key_id), state_dict["w"])
+
+def test_ranges_and_partial_shards(serve):
+    weight = torch.randn(200000)
+    _, url = serve({"w": weight})
+    client = StateClient(url)
+    assert torch.equal(client.get_tensor('[w]', num_connections=3), weight)
+    # By key ID, sized from the listing of that one tensor
+    key_id, = client.key_ids.values()
+    assert [info.path for info in client.list_tensors(f"#{key_id}")] == ['[w]']
+    assert torch.equal(client.get_tensor(key_id, num_connections=3), weight)
+
+    # Rows 2 and 3 of a 6 row tensor, sharded over two servers by halves
+    full = torch.arange(12, dtype=torch.float32).reshape(6, 2)
+    urls = [serve({"w": shard.clone()})[1] for shard in full.chunk(2)]
+    sharded = ShardedStateClient(urls)
+    assert torch.equal(sharded.get_state_dict(local_shard=(1, 4))["w"], full[2:4])
+    sharded.close()
+
+def test_relay(serve):
+    state_dict = {"model": {"w": torch.randn(8), "b": torch.randn(2)}}
+    _, url = serve(state_dict)
+
+    relay = RelayStateClient(url, "127.0.0.1", free_port())
+    fetched = relay.get_state_dict('[model]')
+    assert torch.equal(fetched["w"], state_dict["model"]["w"])
+    try:
+        # The relay serves what it fetched under the same paths
+        assert torch.equal(StateClient(relay.url).get_tensor('[model][b]'), state_dict["model"]["b"])
+        later = RelayStateClient(url, "127.0.0.1", free_port())
+        assert torch.equal(later.get_state_dict('[model]')["b"], state_dict["model"]["b"])
+        later.close()
+    finally:
+        relay.close()
+
+def test_versioned_reads(serve):
+    weight = torch.zeros(10)
+    server, url = serve({"w": weight})
+    client = StateClient(url)
+    client.get_tensor('[w]')
+    assert client.last_version == -1
+
+    # Reads come from the snapshot, not from the live tensor
+    server.snapshot(1)
+    weight.fill_(1)
+    assert torch.equal(client.get_tensor('[w]'), torch.zeros(10))
+    assert client.last_version == 1
+    server.snapshot(2)
+    assert torch.equal(client.get_state_dict()["w"], torch.ones(10))
+    assert client.last_version == 2
+
+def test_delta(serve):
+    weight = torch.zeros(100000)
+    server, url = serve({"w": weight}, delta_versions=2)
+    server.snapshot(1)
+    client = StateClient(url)
+    held = client.get_tensor('[w]')
+
+    weight[50000] = 1
+    server.snapshot(2)
+    # Only the changed block is sent, the marker in the first one stays
+    held[0] = 7
+    assert client.get_tensor_delta('[w]', held, 1) == 2
+    assert held[50000] == 1 and held[0] == 7
+
+    # A version the server doesn't know is fetched whole
+    assert client.get_tensor_delta('[w]', held, 0) == 2
+    assert torch.equal(held, weight)
+
+def test_async_client_recovers_from_failed_connection(serve):
+    weight = torch.randn(100)
+    _, url = serve({"w": weight})
+    with AsyncStateClient(url, num_connections=1) as client:
+        assert torch.equal(client.get_tensor_async('[w]').result(timeout=5), weight)
+        # Server errors fail only their own request
+        with pytest.raises(ServerResponseError):
+            client.get_tensor_async('[missing]').result(timeout=5)
+
+        # A broken connection fails the request, and the next one reconnects
+        connection = client._connections[0]
+        connection.client.client_socket.shutdown(socket.SHUT_RDWR)
+        with pytest.raises(OSError):
+            client.get_tensor_async('[w]').result(timeout=5)
+        assert torch.equal(client.get_tensor_async('[w]').result(timeout=5), weight)
+    assert connection.pending == 0 and connection.pending_bytes == 0
+
+def test_async_state_dict(serve):
+    state_dict = {"model": {"w": torch.randn(4, 4), "b": torch.randn(4)}}
+    _, url = serve(state_dict)
+    inplace = {"w": torch.zeros(4, 4)}
+    with AsyncStateClient(url) as client:
+        pending = client.get_state_dict_async('[model]', inplace=inplace)
+        fetched = pending.result(timeout=5)
+    assert fetched["w"] is inplace["w"]
+    assert torch.equal(fetched["w"], state_dict["model"]["w"])
+    assert torch.equal(fetched["b"], state_dict["model"]["b"])
+    assert set(pending.futures) == {'[model][w]', '[model][b]'}
+
+def test_async_client_cancellation(serve):
+    weight = torch.randn(1 << 22)
+    _, url = serve({"w": weight})
+    with AsyncStateClient(url, num_connections=1, max_inflight=1) as client:
+        futures = [client.get_tensor_async('[w]') for _ in range(8)]
+        # Still queued behind the others, so it is never sent
+        assert futures[-1].cancel()
+        assert all(torch.equal(future.result(timeout=30), weight) for future in futures[:-1])
+    assert client._connections[0].pending == 0
+
+def test_subscribe(serve):
+    weight = torch.zeros(10)
+    server, url = serve({"w": weight})
+    server.snapshot(1)
+
+    with StateClient(url).subscribe(version=1) as subscription:
+        assert subscription.get(timeout=0.2) is None
+        weight.fill_(2)
+        server.snapshot(2)
+        pushed = subscription.get(timeout=5)
+        assert torch.equal(pushed["w"], torch.full((10,), 2.0))
+        assert subscription.version == 2
+
+        # Later pushes reuse the tensors of the first
+        weight.fill_(3)
+        server.snapshot(3)
+        assert subscription.get(timeout=5)["w"] is pushed["w"]
+        assert torch.equal(pushed["w"], torch.full((10,), 3.0))
+
+def test_get_object(serve):
+    weight, exp_avg = torch.randn(4), torch.randn(4)
+    optimizer = {
+        "state": {0: {"step": torch.tensor(3.0), "exp_avg": exp_avg}},
+        "param_groups": [{"lr": 0.1, "betas": (0.9, 0.999), "params": [0]}],
+    }
+    server, url = serve({"model": {"w": weight}, "optimizer": optimizer})
+    server.snapshot(1)
+    client = StateClient(url)
+
+    fetched = client.get_object('[optimizer]')
+    assert fetched["param_groups"] == optimizer["param_groups"]
+    assert torch.equal(fetched["state"][0]["exp_avg"], exp_avg)
+    assert client.last_version == 1
+
+    # Tensors are filled in place, scalars come from the snapshot
+    optimizer["param_groups"][0]["lr"] = 0.5
+    inplace = {"state": {0: {"exp_avg": torch.zeros(4)}}}
+    fetched = client.get_object('[optimizer]', inplace=inplace)
+    assert fetched["state"][0]["exp_avg"] is inplace["state"][0]["exp_avg"]
+    assert torch.equal(inplace["state"][0]["exp_avg"], exp_avg)
+    assert fetched["param_groups"][0]["lr"] == 0.1
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+
+// Vectorized conversions between fp32 and the 16-bit transfer types. Each kernel
+// picks the widest instruction set the CPU supports at runtime, so the extension
+// doesn't need to be built with -march flags.
+
+inline uint16_t fp32_to_bf16_scalar(float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    if ((bits & 0x7fffffff) > 0x7f800000) {
+        // Keep NaNs quiet instead of letting rounding turn them into infinities
+        return static_cast<uint16_t>((bits >> 16) | 0x40);
+    }
+    // Round to nearest even
+    bits += 0x7fff + ((bits >> 16) & 1);
+    return static_cast<uint16_t>(bits >> 16);
+}
+
+inline float bf16_to_fp32_scalar(uint16_t value) {
+    uint32_t bits = static_cast<uint32_t>(value) << 16;
+    float result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+__attribute__((target("avx512f,avx512bf16")))
+inline int64_t fp32_to_bf16_avx512(const float* src, uint16_t* dst, int64_t n) {
+    int64_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256bh converted = _mm512_cvtneps_pbh(_mm512_loadu_ps(src + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), (__m256i)converted);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+inline int64_t fp32_to_bf16_avx2(const float* src, uint16_t* dst, int64_t n) {
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i bias = _mm256_set1_epi32(0x7fff);
+    const __m256i quiet = _mm256_set1_epi32(0x400000);
+    int64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 values = _mm256_loadu_ps(src + i);
+        __m256i bits = _mm256_castps_si256(values);
+        __m256i lsb = _mm256_and_si256(_mm256_srli_epi32(bits, 16), one);
+        __m256i rounded = _mm256_add_epi32(bits, _mm256_add_epi32(bias, lsb));
+        __m256i nan_mask = _mm256_castps_si256(_mm256_cmp_ps(values, values, _CMP_UNORD_Q));
+        rounded = _mm256_blendv_epi8(rounded, _mm256_or_si256(bits, quiet), nan_mask);
+        __m256i shifted = _mm256_srli_epi32(rounded, 16);
+        // packus works per 128 bit lane, so gather the two low quadwords afterwards
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(shifted, shifted), 0xd8);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm256_castsi256_si128(packed));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+inline int64_t bf16_to_fp32_avx2(const uint16_t* src, float* dst, int64_t n) {
+    int64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i widened = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)));
+        _mm256_storeu_ps(dst + i, _mm256_castsi256_ps(_mm256_slli_epi32(widened, 16)));
+    }
+    return i;
+}
+
+// The fp16 kernels need F16C (there is no scalar fallback here), callers check
+// cpu_features().f16c first.
+__attribute__((target("avx,f16c")))
+inline void fp32_to_fp16_f16c(const float* src, uint16_t* dst, int64_t n) {
+    int64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i converted = _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), converted);
+    }
+    for (; i < n; ++i) {
+        dst[i] = _cvtss_sh(src[i], _MM_FROUND_TO_NEAREST_INT);
+    }
+}
+
+__attribute__((target("avx,f16c")))
+inline void fp16_to_fp32_f16c(const uint16_t* src, float* dst, int64_t n) {
+    int64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(values));
+    }
+    for (; i < n; ++i) {
+        dst[i] = _cvtsh_ss(src[i]);
+    }
+}
+
+struct CpuFeatures {
+    bool avx2;
+    bool f16c;
+    bool avx512bf16;
+
+    CpuFeatures() {
+        __builtin_cpu_init();
+        avx2 = __builtin_cpu_supports("avx2");
+        f16c = __builtin_cpu_supports("f16c") && __builtin_cpu_supports("avx");
+        avx512bf16 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bf16");
+    }
+};
+
+inline const CpuFeatures& cpu_features() {
+    static const CpuFeatures features;
+    return features;
+}
+
+inline void fp32_to_bf16(const float* src, uint16_t* dst, int64_t n) {
+    int64_t i = 0;
+    if (cpu_features().avx512bf16) {
+        i = fp32_to_bf16_avx512(src, dst, n);
+    } else if (cpu_features().avx2) {
+        i = fp32_to_bf16_avx2(src, dst, n);
+    }
+    for (; i < n; ++i) {
+        dst[i] = fp32_to_bf16_scalar(src[i]);
+    }
+}
+
+inline void bf16_to_fp32(const uint16_t* src, float* dst, int64_t n) {
+    int64_t i = cpu_features().avx2 ? bf16_to_fp32_avx2(src, dst, n) : 0;
+    for (; i < n; ++i) {
+        dst[i] = bf16_to_fp32_scalar(src[i]);
+    }
+}
@@ -0,0 +1,191 @@
+#pragma once
+
+#include <torch/extension.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+#include <thread>
+#ifdef WITH_CODECS
+#include <lz4.h>
+#include <zstd.h>
+#endif
+#include "cast.h"
+
+// Lossless compression of payload frames. Elements are byte-shuffled first, like
+// blosc does, so that the n-th byte of every element ends up in one run: the sign
+// and exponent bytes of floats are highly repetitive across a tensor, and the
+// compressor sees them as long runs instead of noise interleaved with mantissas.
+
+enum class Codec { ZSTD, LZ4 };
+
+// Whether the extension was built against libzstd and liblz4 (WITH_CODECS). Without
+// them the lossless transfer types are rejected, and everything else still works.
+#ifdef WITH_CODECS
+constexpr bool CODECS_AVAILABLE = true;
+#else
+constexpr bool CODECS_AVAILABLE = false;
+#endif
+
+// zstd level used for frames. Level 1 already gets most of the gain on shuffled
+// weights and keeps up with a few Gbit/s per core.
+constexpr int ZSTD_FRAME_LEVEL = 1;
+
+// Most frames compressed (or decompressed) at once per transfer
+constexpr int MAX_CODEC_SLOTS = 8;
+
+// Number of frames compressed or decompressed concurrently, so a link is fed by
+// several cores rather than by the speed of one compressor
+inline int codec_slots() {
+    int threads = static_cast<int>(std::thread::hardware_concurrency());
+    return std::clamp(threads, 2, MAX_CODEC_SLOTS);
+}
+
+template <int ElemSize>
+inline void byte_shuffle_scalar(const uint8_t* src, int64_t n, uint8_t* dst, int64_t begin) {
+    for (int64_t i = begin; i < n; ++i) {
+        for (int b = 0; b < ElemSize; ++b) {
+            dst[b * n + i] = src[i * ElemSize + b];
+        }
+    }
+}
+
+template <int ElemSize>
+inline void byte_unshuffle_scalar(const uint8_t* src, int64_t n, uint8_t* dst, int64_t begin) {
+    for (int64_t i = begin; i < n; ++i) {
+        for (int b = 0; b < ElemSize; ++b) {
+            dst[i * ElemSize + b] = src[b * n + i];
+        }
+    }
+}
+
+// 4x4 byte transpose within each 128-bit lane, its own inverse
+#define SHUFFLE4_BYTES _mm256_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15, \
+                                        0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15)
+
+// Shuffles 8 elements of 4 bytes per iteration. Returns the number of elements done.
+__attribute__((target("avx2")))
+inline int64_t byte_shuffle4_avx2(const uint8_t* src, int64_t n, uint8_t* dst) {
+    const __m256i bytes = SHUFFLE4_BYTES;
+    const __m256i dwords = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    int64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * 4));
+        // Byte b of the 8 elements ends up in 64-bit lane b
+        v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, bytes), dwords);
+        __m128i lo = _mm256_castsi256_si128(v);
+        __m128i hi = _mm256_extracti128_si256(v, 1);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + i), lo);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + n + i), _mm_unpackhi_epi64(lo, lo));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + 2 * n + i), hi);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + 3 * n + i), _mm_unpackhi_epi64(hi, hi));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+inline int64_t byte_unshuffle4_avx2(const uint8_t* src, int64_t n, uint8_t* dst) {
+    const __m256i bytes = SHUFFLE4_BYTES;
+    const __m256i dwords = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    int64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i lo = _mm_unpacklo_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + i)),
+                                        _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + n + i)));
+        __m128i hi = _mm_unpacklo_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + 2 * n + i)),
+                                        _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + 3 * n + i)));
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+        v = _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(v, dwords), bytes);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i * 4), v);
+    }
+    return i;
+}
+
+#undef SHUFFLE4_BYTES
+
+// Write byte b of each of the n elements of src at dst[b * n + i]
+inline void byte_shuffle(const void* src, int64_t n, int64_t elem_size, void* dst) {
+    const uint8_t* s = static_cast<const uint8_t*>(src);
+    uint8_t* d = static_cast<uint8_t*>(dst);
+    switch (elem_size) {
+        case 2: byte_shuffle_scalar<2>(s, n, d, 0); break;
+        case 4: byte_shuffle_scalar<4>(s, n, d, cpu_features().avx2 ? byte_shuffle4_avx2(s, n, d) : 0); break;
+        case 8: byte_shuffle_scalar<8>(s, n, d, 0); break;
+        default: std::memcpy(d, s, n * elem_size);
+    }
+}
+
+// Inverse of byte_shuffle
+inline void byte_unshuffle(const void* src, int64_t n, int64_t elem_size, void* dst) {
+    const uint8_t* s = static_cast<const uint8_t*>(src);
+    uint8_t* d = static_cast<uint8_t*>(dst);
+    switch (elem_size) {
+        case 2: byte_unshuffle_scalar<2>(s, n, d, 0); break;
+        case 4: byte_unshuffle_scalar<4>(s, n, d, cpu_features().avx2 ? byte_unshuffle4_avx2(s, n, d) : 0); break;
+        case 8: byte_unshuffle_scalar<8>(s, n, d, 0); break;
+        default: std::memcpy(d, s, n * elem_size);
+    }
+}
+
+// Whether byte_shuffle rearranges elements of this size
+inline bool is_shuffled(int64_t elem_size) {
+    return elem_size == 2 || elem_size == 4 || elem_size == 8;
+}
+
+#ifdef WITH_CODECS
+
+// Largest compressed size of nbytes of input
+inline int64_t compress_bound(Codec codec, int64_t nbytes) {
+    if (codec == Codec::LZ4) {
+        return LZ4_compressBound(static_cast<int>(nbytes));
+    }
+    return ZSTD_compressBound(nbytes);
+}
+
+// Compress nbytes of src into dst, which holds at least compress_bound(nbytes).
+// Returns the compressed size.
+inline int64_t compress(Codec codec, const void* src, int64_t nbytes, void* dst, int64_t capacity) {
+    if (codec == Codec::LZ4) {
+        int size = LZ4_compress_default(static_cast<const char*>(src), static_cast<char*>(dst),
+                                        static_cast<int>(nbytes), static_cast<int>(capacity));
+        TORCH_CHECK(size > 0, "lz4 compression failed");
+        return size;
+    }
+    size_t size = ZSTD_compress(dst, capacity, src, nbytes, ZSTD_FRAME_LEVEL);
+    TORCH_CHECK(!ZSTD_isError(size), "zstd compression failed: ", ZSTD_getErrorName(size));
+    return static_cast<int64_t>(size);
+}
+
+// Decompress nbytes of src into exactly expected bytes at dst
+inline void decompress(Codec codec, const void* src, int64_t nbytes, void* dst, int64_t expected) {
+    int64_t size;
+    if (codec == Codec::LZ4) {
+        size = LZ4_decompress_safe(static_cast<const char*>(src), static_cast<char*>(dst),
+                                   static_cast<int>(nbytes), static_cast<int>(expected));
+    } else {
+        size_t result = ZSTD_decompress(dst, expected, src, nbytes);
+        TORCH_CHECK(!ZSTD_isError(result), "zstd decompression failed: ", ZSTD_getErrorName(result));
+        size = static_cast<int64_t>(result);
+    }
+    TORCH_CHECK(size == expected, "Compressed frame holds ", size, " bytes, expected ", expected);
+}
+
+#else
+
+[[noreturn]] inline void codecs_unavailable(Codec codec) {
+    TORCH_CHECK(false, codec == Codec::LZ4 ? "SHUFFLE_LZ4" : "SHUFFLE_ZSTD",
+                " needs torchstate to be built with libzstd and liblz4 installed");
+}
+
+inline int64_t compress_bound(Codec codec, int64_t) {
+    codecs_unavailable(codec);
+}
+
+inline int64_t compress(Codec codec, const void*, int64_t, void*, int64_t) {
+    codecs_unavailable(codec);
+}
+
+inline void decompress(Codec codec, const void*, int64_t, void*, int64_t) {
+    codecs_unavailable(codec);
+}
+
+#endif
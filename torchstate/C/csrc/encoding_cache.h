@@ -0,0 +1,344 @@
+#pragma once
+
+#include <torch/extension.h>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include "helper_pool.h"
+#include "metrics.h"
+#include "tensor_io.h"
+
+// Encoded payloads of snapshot tensors, shared by every response sending the same
+// tensor of the same snapshot in the same transfer type. The first request starts
+// encoding the payload on a thread of the encoding pool and streams its frames as
+// they come out, like every request arriving meanwhile, and later requests send
+// the frames straight from the cache. Casting, quantizing or compressing a tensor
+// then costs once per snapshot however many clients fetch it, and slow clients
+// don't hold back the encoding for the others. Frames are charged against a memory
+// budget as they are encoded, evicting the least recently used finished payloads
+// first. A payload that can't fit the budget, or that finds every thread of the
+// pool busy, isn't cached, and its responses encode it themselves.
+
+// Name of the capsules the cache is passed between extensions in
+constexpr const char* ENCODING_CACHE_CAPSULE = "torchstate.EncodingCache";
+
+// The threads encoding cached payloads, shared by every cache of the process. Kept
+// apart from helper_pool(), whose threads compress the frames of these payloads.
+// Never destroyed, like helper_pool().
+inline HelperPool& encoding_pool() {
+    static HelperPool* pool = new HelperPool(codec_slots());
+    return *pool;
+}
+
+// Whether sending tensor as transfer_type encodes it, rather than sending its
+// elements as they are
+inline bool encodes(const torch::Tensor& tensor, int32_t transfer_type) {
+    return is_compressed(transfer_type) || frame_codebook_bytes(transfer_type) > 0
+        || wire_scalar_type(transfer_type) != tensor.scalar_type();
+}
+
+// Fewest bytes the payload of tensor takes as transfer_type, 0 if compressed
+inline int64_t min_payload_bytes(const torch::Tensor& tensor, int32_t transfer_type) {
+    if (is_compressed(transfer_type)) {
+        return 0;
+    }
+    return tensor.numel() * static_cast<int64_t>(c10::elementSize(wire_scalar_type(transfer_type)));
+}
+
+// The frames of a payload, appended while it is being encoded
+class EncodedPayload {
+public:
+    void append(const EncodedChunk& chunk) {
+        FrameHeader frame{chunk.nbytes, chunk.numel};
+        std::string data(sizeof(frame) + chunk.nbytes, '\0');
+        std::memcpy(&data[0], &frame, sizeof(frame));
+        std::memcpy(&data[sizeof(frame)], chunk.data, chunk.nbytes);
+        std::lock_guard<std::mutex> lock(mutex_);
+        frames_.push_back(std::move(data));
+        cv_.notify_all();
+    }
+
+    void finish(bool failed) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        done_ = true;
+        failed_ = failed;
+        cv_.notify_all();
+    }
+
+    // Frame k with its header, waiting for it to be encoded. Null past the last
+    // frame, and once encoding failed.
+    const std::string* frame(size_t k) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [&] { return k < frames_.size() || done_; });
+        // Frames never move once appended
+        return k < frames_.size() ? &frames_[k] : nullptr;
+    }
+
+    bool failed() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return failed_;
+    }
+
+private:
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::string> frames_;
+    bool done_ = false;
+    bool failed_ = false;
+};
+
+class EncodingCache : public std::enable_shared_from_this<EncodingCache> {
+public:
+    // Keep up to capacity bytes of payloads, 0 for none. Hits, misses and
+    // the bytes kept are recorded in metrics if given.
+    explicit EncodingCache(int64_t capacity, std::shared_ptr<Metrics> metrics = nullptr)
+        : capacity_(capacity), metrics_(std::move(metrics)) {
+        TORCH_CHECK(capacity >= 0, "The encoding cache capacity can't be negative");
+    }
+
+    void set_capacity(int64_t capacity) {
+        TORCH_CHECK(capacity >= 0, "The encoding cache capacity can't be negative");
+        std::lock_guard<std::mutex> lock(mutex_);
+        capacity_ = capacity;
+        evict();
+    }
+
+    int64_t capacity() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return capacity_;
+    }
+
+    // Bytes of the payloads kept, finished or being encoded
+    int64_t size() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return size_;
+    }
+
+    // Drop the payloads of the snapshots before version, which are no longer
+    // served, and don't cache them again. Responses still sending one keep it.
+    void retire(int64_t version) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        oldest_ = std::max(oldest_, version);
+        for (auto it = entries_.begin(); it != entries_.end() && std::get<0>(it->first) < oldest_;) {
+            it = erase(it);
+        }
+        update_size();
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        while (!entries_.empty()) {
+            erase(entries_.begin());
+        }
+        update_size();
+    }
+
+    // The payload of tensor, of the snapshot at version, encoded as transfer_type
+    // in chunk_size frames, starting to encode it if nobody has. Null if it isn't
+    // worth caching: live tensors (version -1), tensors sent as they are, payloads
+    // larger than the capacity, and anything while the capacity is 0 or while the
+    // encoding pool has no idle thread.
+    std::shared_ptr<EncodedPayload> acquire(
+        int64_t version, const torch::Tensor& tensor, int32_t transfer_type, int64_t chunk_size
+    ) {
+        if (version < 0 || !encodes(tensor, transfer_type)) {
+            return nullptr;
+        }
+        // Snapshot tensors never change, and the entry keeps its tensor alive, so
+        // its TensorImpl identifies it whatever path it was requested by
+        Key key{version, tensor.unsafeGetTensorImpl(), transfer_type, chunk_size};
+        std::shared_ptr<EncodedPayload> payload;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (capacity_ == 0 || version < oldest_ || min_payload_bytes(tensor, transfer_type) > capacity_) {
+                return nullptr;
+            }
+            auto it = entries_.find(key);
+            if (it != entries_.end()) {
+                lru_.splice(lru_.begin(), lru_, it->second.lru);
+                if (metrics_) {
+                    metrics_->count_encoding_cache(true);
+                }
+                return it->second.payload;
+            }
+            if (metrics_) {
+                metrics_->count_encoding_cache(false);
+            }
+            payload = std::make_shared<EncodedPayload>();
+            // The task charges frames under mutex_, so it can't get ahead of the entry
+            bool started = encoding_pool().try_post([self = shared_from_this(), key, payload, tensor,
+                                                     transfer_type, chunk_size] {
+                self->encode(key, payload, tensor, transfer_type, chunk_size);
+            });
+            if (!started) {
+                return nullptr;
+            }
+            lru_.push_front(key);
+            entries_.emplace(key, Entry{payload, tensor, lru_.begin(), 0, false});
+        }
+        return payload;
+    }
+
+private:
+    // Snapshot version, tensor, transfer type and chunk size
+    using Key = std::tuple<int64_t, const void*, int32_t, int64_t>;
+
+    struct Entry {
+        std::shared_ptr<EncodedPayload> payload;
+        torch::Tensor tensor;
+        std::list<Key>::iterator lru;
+        // Bytes of the frames encoded so far, all charged against the capacity
+        int64_t nbytes;
+        // Whether the whole payload was encoded, only finished ones are evicted
+        bool finished;
+    };
+
+    // Thrown out of encoding a payload that won't be cached after all
+    struct Uncached {};
+
+    // Encode the payload of an entry on a thread of the encoding pool
+    void encode(const Key& key, const std::shared_ptr<EncodedPayload>& payload, const torch::Tensor& tensor,
+                int32_t transfer_type, int64_t chunk_size) {
+        SendStats stats;
+        bool failed = false;
+        try {
+            encode_tensor_frames(tensor, transfer_type, chunk_size, 0, -1, [&](const EncodedChunk& chunk) {
+                if (!charge(key, payload, static_cast<int64_t>(sizeof(FrameHeader)) + chunk.nbytes)) {
+                    throw Uncached{};
+                }
+                payload->append(chunk);
+            }, &stats);
+        } catch (...) {
+            // Responses waiting for the payload encode the rest themselves
+            failed = true;
+        }
+        payload->finish(failed);
+        finished(key, payload, failed);
+        if (metrics_ && stats.encoded) {
+            metrics_->encode.record(stats.encode_ns);
+        }
+    }
+
+    // Charge nbytes more of a payload being encoded, evicting finished payloads to
+    // make room for them. Returns false if they still don't fit, next to the other
+    // payloads being encoded, after dropping the payload. Payloads retired or
+    // cleared meanwhile are still encoded for the responses waiting on them.
+    bool charge(const Key& key, const std::shared_ptr<EncodedPayload>& payload, int64_t nbytes) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(key);
+        if (it == entries_.end() || it->second.payload != payload) {
+            return true;
+        }
+        it->second.nbytes += nbytes;
+        size_ += nbytes;
+        evict();
+        if (size_ > capacity_) {
+            erase(it);
+            update_size();
+            return false;
+        }
+        return true;
+    }
+
+    void finished(const Key& key, const std::shared_ptr<EncodedPayload>& payload, bool failed) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(key);
+        if (it == entries_.end() || it->second.payload != payload) {
+            return;  // Retired, cleared or dropped meanwhile
+        }
+        if (failed) {
+            erase(it);
+        } else {
+            it->second.finished = true;
+            evict();
+        }
+        update_size();
+    }
+
+    // Evict finished payloads, least recently used first, until everything
+    // charged fits. Called with mutex_ held.
+    void evict() {
+        auto key = lru_.end();
+        while (size_ > capacity_ && key != lru_.begin()) {
+            auto it = entries_.find(*--key);
+            if (it->second.finished) {
+                // Erasing invalidates key, carry on from the entry after it
+                key = std::next(key);
+                erase(it);
+            }
+        }
+        update_size();
+    }
+
+    std::map<Key, Entry>::iterator erase(std::map<Key, Entry>::iterator it) {
+        size_ -= it->second.nbytes;
+        lru_.erase(it->second.lru);
+        return entries_.erase(it);
+    }
+
+    void update_size() {
+        if (metrics_) {
+            metrics_->set_encoding_cache_bytes(size_);
+        }
+    }
+
+    mutable std::mutex mutex_;
+    int64_t capacity_;
+    int64_t size_ = 0;
+    int64_t oldest_ = 0;
+    std::shared_ptr<Metrics> metrics_;
+    std::map<Key, Entry> entries_;
+    // Keys of the entries, most recently used first
+    std::list<Key> lru_;
+};
+
+// Send header followed by the framed payload of elements [start, start + count) of
+// the tensor, like send_tensor_frames, from the cached payload of the snapshot at
+// version when the response covers the whole tensor. If encoding the payload
+// failed, the rest is encoded for this response alone.
+inline void send_cached_tensor_frames(
+    EncodingCache* cache, int64_t version, int fd, const torch::Tensor& tensor, const std::string& header,
+    int32_t transfer_type, int64_t chunk_size, int64_t start = 0, int64_t count = -1,
+    const Pacer& pacer = Pacer{}, SendStats* stats = nullptr
+) {
+    bool whole = start == 0 && (count == -1 || count == tensor.numel());
+    std::shared_ptr<EncodedPayload> payload =
+        cache != nullptr && whole ? cache->acquire(version, tensor, transfer_type, chunk_size) : nullptr;
+    if (payload == nullptr) {
+        send_tensor_frames(fd, tensor, header, transfer_type, chunk_size, start, count, pacer, stats);
+        return;
+    }
+
+    std::string pending = header;
+    int64_t sent = 0;
+    for (size_t k = 0; const std::string* frame = payload->frame(k); ++k) {
+        FrameHeader frame_header;
+        std::memcpy(&frame_header, frame->data(), sizeof(frame_header));
+        pace(pacer, frame_header.nbytes, stats);
+        iovec iov[2] = {
+            {const_cast<char*>(pending.data()), pending.size()},
+            {const_cast<char*>(frame->data()), frame->size()},
+        };
+        sendmsg_all(fd, iov, 2, stats);
+        pending.clear();
+        sent += frame_header.numel;
+        if (stats != nullptr) {
+            stats->nbytes += frame_header.nbytes;
+        }
+    }
+
+    if (payload->failed()) {
+        send_tensor_frames(fd, tensor, pending, transfer_type, chunk_size, sent, tensor.numel() - sent, pacer, stats);
+    } else if (!pending.empty()) {
+        iovec iov = {const_cast<char*>(pending.data()), pending.size()};
+        sendmsg_all(fd, &iov, 1, stats);
+    }
+}
@@ -0,0 +1,1151 @@
+#include <torch/extension.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "encoding_cache.h"
+#include "metrics.h"
+#include "tensor_io.h"
+#include "uring.h"
+
+// Wire format of a request ('244siq')
+struct RequestHeader {
+    char path[244];
+    int32_t transfer_type;
+    int64_t size;
+};
+static_assert(sizeof(RequestHeader) == 256, "Request header must be 256 bytes");
+
+// Wire format of a response header ('iiq')
+struct ResponseHeader {
+    int32_t succ;
+    int32_t transfer_type;
+    int64_t size;
+};
+static_assert(sizeof(ResponseHeader) == 16, "Response header must be 16 bytes");
+
+// Tensor metadata following a response header ('iiq'), then ndim shape and ndim
+// stride entries ('q' each)
+struct TensorMetadata {
+    int32_t dtype_code;
+    int32_t ndim;
+    int64_t version;
+};
+static_assert(sizeof(TensorMetadata) == 16, "Tensor metadata must be 16 bytes");
+
+// Control request that switches a connection to persistent mode. Afterwards every
+// request and response is prefixed with an 8 byte request ID.
+constexpr int32_t REQUEST_PERSISTENT = -2;
+
+// Request for a range of elements of one tensor, with a '=iqq' body holding the
+// transfer type, first element and element count
+constexpr int32_t REQUEST_RANGE = -5;
+constexpr int64_t RANGE_BODY_SIZE = sizeof(int32_t) + 2 * sizeof(int64_t);
+
+// Control request that sets the priority class of the responses on a connection
+// to the size field
+constexpr int32_t REQUEST_PRIORITY = -13;
+
+// Control requests whose size field is the length of a body following the header,
+// mirroring the request handler in server.py
+inline bool has_request_body(int32_t transfer_type) {
+    switch (transfer_type) {
+        case -3:   // BATCH
+        case -5:   // RANGE
+        case -6:   // RELAY_SOURCE
+        case -7:   // RELAY_ANNOUNCE
+        case -8:   // DELTA
+        case -9:   // RDMA_CONNECT
+        case -10:  // RDMA_REGIONS
+        case -11:  // RDMA_DISCONNECT
+        case -15:  // SUBSCRIBE
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Longest a worker waits for the body of a request by default, in seconds
+constexpr double DEFAULT_BODY_TIMEOUT = 30.0;
+
+// What the core knows about a connection beyond its socket
+struct ConnectionState {
+    // Every request and response is prefixed with its ID
+    bool persistent = false;
+    int32_t priority = PRIORITY_NORMAL;
+    // Budget of the peer host when a scheduler is set
+    std::shared_ptr<Scheduler::Client> client;
+    // What arrived so far of the next request: prefix, header and range body
+    std::string request;
+};
+
+struct TensorEntry {
+    torch::Tensor tensor;
+    int32_t transfer_type;
+    // Snapshot the tensor belongs to, -1 for the live tensor
+    int64_t version;
+    // Registered buffer slot of the tensor in the rings, -1 if it has none
+    int32_t buffer_index;
+    // Whether the tensor is a snapshot copy, whose encodings can be cached
+    bool cacheable;
+};
+
+// A tensor response the core serves by itself: elements [start, start + count) of
+// the tensor (all of it if count is -1), with the metadata for full responses to
+// requests that didn't pass a destination size
+struct TensorResponse {
+    torch::Tensor tensor;
+    int32_t transfer_type;
+    int64_t version;
+    int64_t start;
+    int64_t count;
+    bool range;
+    bool with_metadata;
+    int32_t buffer_index;
+    bool cacheable;
+};
+
+// Entries per ring, bounding the SQEs batched into one submission
+constexpr unsigned RING_ENTRIES = 1024;
+
+// Registered buffer slots reserved per ring. The kernel limits a registered
+// buffer to 1GB, larger tensors are sent from unregistered memory.
+constexpr int32_t MAX_BUFFER_SLOTS = 4096;
+constexpr size_t MAX_REGISTERED_BUFFER_SIZE = size_t(1) << 30;
+
+// Frames smaller than this are copied into the socket rather than sent zero-copy,
+// which only pays for itself once page pinning and the completion notification
+// are amortized
+constexpr int64_t ZERO_COPY_MIN_BYTES = 64 * 1024;
+
+// Epoll based server core. One thread accepts connections and reads their requests
+// without blocking, a fixed pool of workers serves every complete request and
+// streams registered tensors without touching the GIL, so clients that stall
+// mid-request never hold a worker. Requests the core can't serve on its own
+// (scalars, unregistered paths, invalid requests) are handed to the Python fallback.
+//
+// With io_uring, connections are spread over num_workers rings instead, each run
+// by one thread (see RingWorker). The worker pool then only serves the requests
+// the rings pass on. If the kernel doesn't allow io_uring, the core warns and
+// falls back to epoll.
+class NativeServer {
+public:
+    NativeServer(std::string host, int port, int num_workers, int64_t chunk_size, py::object fallback,
+                 bool io_uring = false)
+        : host_(std::move(host)), port_(port), num_workers_(num_workers), chunk_size_(chunk_size),
+          fallback_(std::move(fallback)) {
+        TORCH_CHECK(num_workers_ > 0, "num_workers must be positive");
+        TORCH_CHECK(chunk_size_ > 0, "chunk_size must be positive");
+        if (io_uring) {
+            try {
+                for (int i = 0; i < num_workers_; ++i) {
+                    rings_.push_back(std::make_unique<RingWorker>(*this));
+                }
+                for (int32_t slot = MAX_BUFFER_SLOTS - 1; slot >= 0; --slot) {
+                    free_buffer_slots_.push_back(slot);
+                }
+            } catch (const std::exception& e) {
+                rings_.clear();
+                TORCH_WARN("io_uring is unavailable, using epoll instead: ", e.what());
+            }
+        }
+    }
+
+    ~NativeServer() {
+        py::gil_scoped_release no_gil;
+        stop();
+    }
+
+    void register_tensor(const std::string& path, torch::Tensor tensor, int32_t transfer_type, int64_t version,
+                         bool cacheable) {
+        std::unique_lock<std::shared_mutex> lock(tensors_mutex_);
+        tensors_[path] = TensorEntry{tensor, transfer_type, version, buffer_slot(tensor), cacheable};
+    }
+
+    void clear() {
+        std::unique_lock<std::shared_mutex> lock(tensors_mutex_);
+        tensors_.clear();
+        // Slots not registered again since the last clear are free now. The rest
+        // stay registered until the next one, while responses may still use them.
+        for (const auto& slot : stale_buffer_slots_) {
+            free_buffer_slots_.push_back(slot.second.index);
+        }
+        stale_buffer_slots_ = std::move(buffer_slots_);
+        buffer_slots_.clear();
+    }
+
+    bool uses_io_uring() const {
+        return !rings_.empty();
+    }
+
+    // Schedule the sends of the core with the scheduler of a capsule from
+    // Scheduler.capsule(), shared with the Python handler
+    void set_scheduler(py::object capsule) {
+        TORCH_CHECK(!running_, "The scheduler must be set before starting the server");
+        scheduler_ = from_capsule<Scheduler>(capsule, SCHEDULER_CAPSULE);
+    }
+
+    // Record into the metrics of a capsule from Metrics.capsule(), shared with
+    // the Python handler
+    void set_metrics(py::object capsule) {
+        TORCH_CHECK(!running_, "The metrics must be set before starting the server");
+        metrics_ = from_capsule<Metrics>(capsule, METRICS_CAPSULE);
+    }
+
+    // Share the encodings of snapshot tensors through the cache of a capsule from
+    // EncodingCache.capsule(), shared with the Python handler
+    void set_encoding_cache(py::object capsule) {
+        TORCH_CHECK(!running_, "The encoding cache must be set before starting the server");
+        encoding_cache_ = from_capsule<EncodingCache>(capsule, ENCODING_CACHE_CAPSULE);
+    }
+
+    // Close connections whose request body takes longer than seconds to arrive
+    void set_body_timeout(double seconds) {
+        TORCH_CHECK(seconds > 0, "The body timeout must be positive");
+        body_timeout_ns_ = static_cast<int64_t>(seconds * 1e9);
+    }
+
+    void start() {
+        TORCH_CHECK(!running_, "Server is already running");
+        open_listen_socket();
+
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        TORCH_CHECK(epoll_fd_ >= 0, "epoll_create1 failed: ", std::strerror(errno));
+        wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        TORCH_CHECK(wake_fd_ >= 0, "eventfd failed: ", std::strerror(errno));
+
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = listen_fd_;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev);
+        ev.data.fd = wake_fd_;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev);
+
+        running_ = true;
+        event_thread_ = std::thread(&NativeServer::event_loop, this);
+        for (int i = 0; i < num_workers_; ++i) {
+            workers_.emplace_back(&NativeServer::worker_loop, this);
+        }
+        for (auto& ring : rings_) {
+            ring->start();
+        }
+    }
+
+    void stop() {
+        if (!running_.exchange(false)) {
+            return;
+        }
+
+        // Wake up the event loop and all idle workers
+        uint64_t one = 1;
+        ssize_t unused = write(wake_fd_, &one, sizeof(one));
+        (void)unused;
+        queue_cv_.notify_all();
+
+        event_thread_.join();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+        workers_.clear();
+        // Only once no worker is serving one of their connections any more
+        for (auto& ring : rings_) {
+            ring->join();
+        }
+
+        // Queued or idle connections are never going to be served now
+        for (const auto& connection : connections_) {
+            close(connection.first);
+            metrics_->connection_closed();
+        }
+        connections_.clear();
+        tasks_.clear();
+        close(listen_fd_);
+        close(epoll_fd_);
+        close(wake_fd_);
+        listen_fd_ = epoll_fd_ = wake_fd_ = -1;
+    }
+
+private:
+    template <typename T>
+    static std::shared_ptr<T> from_capsule(py::object capsule, const char* name) {
+        auto* object = static_cast<std::shared_ptr<T>*>(PyCapsule_GetPointer(capsule.ptr(), name));
+        if (object == nullptr) {
+            throw py::error_already_set();
+        }
+        return *object;
+    }
+
+    void open_listen_socket() {
+        addrinfo hints{};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        addrinfo* result = nullptr;
+        std::string port = std::to_string(port_);
+        int rc = getaddrinfo(host_.c_str(), port.c_str(), &hints, &result);
+        TORCH_CHECK(rc == 0, "Failed to resolve ", host_, ": ", gai_strerror(rc));
+
+        listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listen_fd_ < 0) {
+            freeaddrinfo(result);
+            TORCH_CHECK(false, "Server socket creation failed: ", std::strerror(errno));
+        }
+        optimize_socket(listen_fd_);
+
+        int opt = 1;
+        setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+        rc = bind(listen_fd_, result->ai_addr, result->ai_addrlen);
+        freeaddrinfo(result);
+        if (rc < 0 || listen(listen_fd_, SOMAXCONN) < 0) {
+            int err = errno;
+            close(listen_fd_);
+            listen_fd_ = -1;
+            TORCH_CHECK(false, "Server bind/listen failed: ", std::strerror(err));
+        }
+    }
+
+    void event_loop() {
+        std::vector<epoll_event> events(64);
+        while (running_) {
+            int n = epoll_wait(epoll_fd_, events.data(), events.size(), -1);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            for (int i = 0; i < n; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == wake_fd_) {
+                    continue;
+                } else if (fd == listen_fd_) {
+                    accept_connections();
+                } else {
+                    read_request(fd);
+                }
+            }
+        }
+    }
+
+    void accept_connections() {
+        while (true) {
+            int client_fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client_fd < 0) {
+                // EAGAIN means the backlog is drained
+                return;
+            }
+            optimize_socket(client_fd);
+            metrics_->connection_opened();
+            ConnectionState state;
+            if (scheduler_ != nullptr) {
+                state.client = scheduler_->client(peer_host(client_fd));
+            }
+            if (!rings_.empty()) {
+                rings_[next_ring_++ % rings_.size()]->adopt(client_fd, std::move(state));
+                continue;
+            }
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex_);
+                connections_[client_fd] = std::move(state);
+            }
+            if (!wait_readable(client_fd, EPOLL_CTL_ADD)) {
+                close_connection(client_fd);
+            }
+        }
+    }
+
+    // Wait for the next bytes of a request on a connection. Connections are
+    // registered one-shot, so only one thread handles each request.
+    bool wait_readable(int fd, int op) {
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        ev.data.fd = fd;
+        return epoll_ctl(epoll_fd_, op, fd, &ev) == 0;
+    }
+
+    // Address of the host at the other end of a connection
+    static std::string peer_host(int fd) {
+        sockaddr_storage addr{};
+        socklen_t len = sizeof(addr);
+        char host[INET6_ADDRSTRLEN] = "";
+        if (getpeername(fd, reinterpret_cast<sockaddr*>(&addr), &len) == 0) {
+            getnameinfo(reinterpret_cast<sockaddr*>(&addr), len, host, sizeof(host), nullptr, 0, NI_NUMERICHOST);
+        }
+        return host;
+    }
+
+    void push_task(std::function<void()> task) {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        tasks_.push_back(std::move(task));
+        queue_cv_.notify_one();
+    }
+
+    void worker_loop() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex_);
+                queue_cv_.wait(lock, [this] { return !running_ || !tasks_.empty(); });
+                if (!running_) {
+                    return;
+                }
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            task();
+        }
+    }
+
+    // Read what arrived of the next request on a readable connection, on the event
+    // thread. Once all of it is in, it is handed to a worker.
+    void read_request(int fd) {
+        std::string buffer;
+        bool persistent;
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            auto it = connections_.find(fd);
+            if (it == connections_.end()) {
+                return;
+            }
+            buffer = std::move(it->second.request);
+            persistent = it->second.persistent;
+        }
+
+        size_t prefix_size = persistent ? sizeof(int64_t) : 0;
+        size_t header_end = prefix_size + sizeof(RequestHeader);
+        RequestHeader request;
+        while (true) {
+            size_t expected = header_end;
+            if (buffer.size() >= header_end) {
+                std::memcpy(&request, buffer.data() + prefix_size, sizeof(request));
+                if (request.transfer_type == REQUEST_RANGE && request.size == RANGE_BODY_SIZE) {
+                    expected += RANGE_BODY_SIZE;
+                }
+                if (buffer.size() == expected) {
+                    break;
+                }
+            }
+
+            size_t offset = buffer.size();
+            buffer.resize(expected);
+            ssize_t received = recv(fd, &buffer[offset], expected - offset, MSG_DONTWAIT);
+            buffer.resize(offset + std::max<ssize_t>(received, 0));
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                // The rest of the request hasn't arrived yet
+                {
+                    std::lock_guard<std::mutex> lock(queue_mutex_);
+                    connections_[fd].request = std::move(buffer);
+                }
+                if (!wait_readable(fd, EPOLL_CTL_MOD)) {
+                    close_connection(fd);
+                }
+                return;
+            }
+            if (received <= 0) {
+                // Closed by the client, or failed
+                close_connection(fd);
+                return;
+            }
+        }
+
+        std::string prefix = buffer.substr(0, prefix_size);
+        std::string body = buffer.substr(header_end);
+        int64_t received_ns = monotonic_ns();
+        push_task([this, fd, request, body, prefix, received_ns] {
+            serve_request(fd, request, body, prefix, received_ns);
+        });
+    }
+
+    void serve_request(int fd, const RequestHeader& request, const std::string& body, const std::string& prefix,
+                       int64_t received_ns) {
+        ConnectionState state;
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            state = connections_[fd];
+        }
+
+        try {
+            bool usable = dispatch(fd, request, body, prefix, state, received_ns);
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex_);
+                connections_[fd] = state;
+            }
+
+            // Wait for the next request on this connection
+            if (usable && state.persistent && wait_readable(fd, EPOLL_CTL_MOD)) {
+                return;
+            }
+        } catch (const std::exception&) {
+            // The client went away or stalled mid-request, nothing left to report to it
+        }
+        close_connection(fd);
+    }
+
+    void close_connection(int fd) {
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            connections_.erase(fd);
+        }
+        close(fd);
+        metrics_->connection_closed();
+    }
+
+    // Serve a request read off a connection at received_ns, updating its state for
+    // the control requests that change it. Returns false if the connection can't
+    // carry another request.
+    bool dispatch(int fd, const RequestHeader& request, const std::string& body, const std::string& prefix,
+                  ConnectionState& state, int64_t received_ns) {
+        if (!state.persistent && request.transfer_type == REQUEST_PERSISTENT) {
+            metrics_->count_request(true);
+            ResponseHeader ack{0, REQUEST_PERSISTENT, 0};
+            iovec iov = {&ack, sizeof(ack)};
+            sendmsg_all(fd, &iov, 1);
+            state.persistent = true;
+            return true;
+        }
+        // Invalid classes are reported by the Python handler
+        if (request.transfer_type == REQUEST_PRIORITY && request.size >= 0 && request.size < NUM_PRIORITIES) {
+            metrics_->count_request(true);
+            state.priority = static_cast<int32_t>(request.size);
+            ResponseHeader ack{0, REQUEST_PRIORITY, 0};
+            std::string response = prefix;
+            response.append(reinterpret_cast<const char*>(&ack), sizeof(ack));
+            iovec iov = {&response[0], response.size()};
+            sendmsg_all(fd, &iov, 1);
+            return true;
+        }
+        if (serve_tensor(fd, request, body, prefix, state, received_ns)) {
+            return true;
+        }
+        // Bodies are read here rather than by Python, so that a client stalling
+        // mid-body holds the worker for body_timeout at most. Throws once it passes.
+        std::string full_body = body;
+        if (full_body.empty() && has_request_body(request.transfer_type) && request.size > 0) {
+            full_body.resize(request.size);
+            recv_all(fd, &full_body[0], full_body.size(), received_ns + body_timeout_ns_);
+        }
+        return call_fallback(fd, request, full_body, prefix, state.priority);
+    }
+
+    // Serve the request natively if possible. Returns false if it has to go to Python.
+    bool serve_tensor(int fd, const RequestHeader& request, const std::string& body, const std::string& prefix,
+                      const ConnectionState& state, int64_t received_ns) {
+        std::optional<TensorResponse> response = resolve_tensor_request(request, body);
+        if (!response) {
+            return false;
+        }
+        metrics_->count_request(true);
+        SendStats stats;
+        send_cached_tensor_frames(response->cacheable ? encoding_cache_.get() : nullptr, response->version, fd,
+                                  response->tensor, response_header(prefix, *response), response->transfer_type,
+                                  chunk_size_, response->start, response->count,
+                                  Pacer{scheduler_.get(), state.client.get(), state.priority}, &stats);
+        metrics_->record_send(response->transfer_type, received_ns, stats);
+        return true;
+    }
+
+    // Whether sends may currently have to wait for the scheduler
+    bool scheduled() const {
+        return scheduler_ != nullptr && scheduler_->active();
+    }
+
+    // The response to a tensor request, if the core can serve it
+    std::optional<TensorResponse> resolve_tensor_request(const RequestHeader& request, const std::string& body) {
+        std::string path(request.path, strnlen(request.path, sizeof(request.path)));
+
+        bool range = request.transfer_type == REQUEST_RANGE;
+        int32_t requested_type = request.transfer_type;
+        int64_t start = 0;
+        int64_t count = -1;
+        if (range) {
+            if (static_cast<int64_t>(body.size()) != RANGE_BODY_SIZE) {
+                return std::nullopt;
+            }
+            std::memcpy(&requested_type, body.data(), sizeof(requested_type));
+            std::memcpy(&start, body.data() + sizeof(int32_t), sizeof(start));
+            std::memcpy(&count, body.data() + sizeof(int32_t) + sizeof(int64_t), sizeof(count));
+        }
+
+        TensorEntry entry;
+        {
+            int64_t begin = monotonic_ns();
+            std::shared_lock<std::shared_mutex> lock(tensors_mutex_);
+            auto it = tensors_.find(path);
+            if (it == tensors_.end()) {
+                return std::nullopt;
+            }
+            entry = it->second;
+            metrics_->lookup.record(monotonic_ns() - begin);
+        }
+        const torch::Tensor& tensor = entry.tensor;
+        int32_t transfer_type = entry.transfer_type;
+
+        if (requested_type != -1) {
+            // Casts, quantization and compression are done natively, anything else is reported by the Python handler
+            if (!is_transfer_type(requested_type)) {
+                return std::nullopt;
+            }
+            transfer_type = requested_type;
+        }
+        if (range) {
+            if (start < 0 || count < 0 || start + count > tensor.numel()) {
+                return std::nullopt;
+            }
+        } else if (request.size != -1 && request.size != tensor.numel()) {
+            return std::nullopt;
+        }
+        if (!is_streamable_device(tensor.device()) || dtype_code(tensor.scalar_type()) < 0) {
+            return std::nullopt;
+        }
+        return TensorResponse{tensor, transfer_type, entry.version, start, count, range,
+                              !range && request.size == -1, entry.buffer_index, entry.cacheable};
+    }
+
+    // The response header of a tensor response, with its metadata if needed
+    static std::string response_header(const std::string& prefix, const TensorResponse& r) {
+        const torch::Tensor& tensor = r.tensor;
+        ResponseHeader response{0, r.transfer_type, r.range ? r.count : tensor.numel()};
+        std::string header = prefix;
+        header.append(reinterpret_cast<const char*>(&response), sizeof(response));
+        if (r.with_metadata) {
+            TensorMetadata meta{dtype_code(tensor.scalar_type()), static_cast<int32_t>(tensor.dim()), r.version};
+            header.append(reinterpret_cast<const char*>(&meta), sizeof(meta));
+            header.append(reinterpret_cast<const char*>(tensor.sizes().data()), tensor.dim() * sizeof(int64_t));
+            header.append(reinterpret_cast<const char*>(tensor.strides().data()), tensor.dim() * sizeof(int64_t));
+        }
+        return header;
+    }
+
+    // Registered buffer slot for a contiguous CPU tensor, or -1. Called with
+    // tensors_mutex_ held.
+    int32_t buffer_slot(const torch::Tensor& tensor) {
+        if (rings_.empty() || !tensor.device().is_cpu() || !tensor.is_contiguous() || tensor.nbytes() == 0
+            || static_cast<size_t>(tensor.nbytes()) > MAX_REGISTERED_BUFFER_SIZE) {
+            return -1;
+        }
+        void* addr = tensor.data_ptr();
+        size_t nbytes = tensor.nbytes();
+        auto it = buffer_slots_.find(addr);
+        if (it != buffer_slots_.end()) {
+            return it->second.nbytes == nbytes ? it->second.index : -1;
+        }
+        auto stale = stale_buffer_slots_.find(addr);
+        if (stale != stale_buffer_slots_.end() && stale->second.nbytes == nbytes) {
+            int32_t index = stale->second.index;
+            buffer_slots_.emplace(addr, std::move(stale->second));
+            stale_buffer_slots_.erase(stale);
+            return index;
+        }
+        if (free_buffer_slots_.empty()) {
+            return -1;
+        }
+
+        // Registration pins the pages, and fails once RLIMIT_MEMLOCK is reached
+        int32_t index = free_buffer_slots_.back();
+        for (auto& ring : rings_) {
+            if (!ring->register_buffer(index, addr, nbytes)) {
+                return -1;
+            }
+        }
+        free_buffer_slots_.pop_back();
+        buffer_slots_.emplace(addr, BufferSlot{index, nbytes, tensor});
+        return index;
+    }
+
+    // Hand the request to Python, along with its body if it was already read and
+    // the priority class of the connection. Returns false if the connection can't
+    // carry another request, e.g. because Python gave up on reading from it.
+    bool call_fallback(int fd, const RequestHeader& request, const std::string& body, const std::string& prefix,
+                       int32_t priority) {
+        py::gil_scoped_acquire gil;
+        try {
+            py::object usable = fallback_(fd, py::bytes(reinterpret_cast<const char*>(&request), sizeof(request)),
+                                          py::bytes(prefix), py::bytes(body), priority);
+            return usable.is_none() || usable.cast<bool>();
+        } catch (py::error_already_set& e) {
+            e.discard_as_unraisable(__func__);
+            return false;
+        }
+    }
+
+    // One io_uring and the thread driving it. The ring receives the requests of
+    // its connections, and streams the responses that need no conversion (CPU
+    // tensors that are contiguous and already in the wire dtype) straight from
+    // tensor storage. Large frames are sent zero-copy from the registered buffer
+    // of the tensor when there is one. Every loop submits the SQEs of all its
+    // connections in one system call. Anything else is passed to the worker pool,
+    // which streams it with blocking sends like in the epoll model and hands the
+    // connection back afterwards. So are all responses while the scheduler may
+    // hold frames back, since the ring never blocks.
+    class RingWorker {
+    public:
+        explicit RingWorker(NativeServer& server) : server_(server), ring_(RING_ENTRIES) {
+            zero_copy_ = ring_.supports(IORING_OP_SEND_ZC);
+            fixed_buffers_ = zero_copy_ && ring_.register_buffer_slots(MAX_BUFFER_SLOTS);
+            wake_fd_ = eventfd(0, EFD_CLOEXEC);
+            TORCH_CHECK(wake_fd_ >= 0, "eventfd failed: ", std::strerror(errno));
+        }
+
+        ~RingWorker() {
+            close(wake_fd_);
+        }
+
+        void start() {
+            thread_ = std::thread(&RingWorker::loop, this);
+        }
+
+        // Called once nothing hands connections over any more
+        void join() {
+            if (thread_.joinable()) {
+                stopping_ = true;
+                wake();
+                thread_.join();
+            }
+        }
+
+        bool register_buffer(int32_t index, void* addr, size_t nbytes) {
+            return fixed_buffers_ && ring_.update_buffer_slot(index, addr, nbytes);
+        }
+
+        // Take over a newly accepted connection
+        void adopt(int fd, ConnectionState state) {
+            auto connection = std::make_unique<Connection>();
+            connection->fd = fd;
+            hand_over({connection.release(), true, true, std::move(state)});
+        }
+
+    private:
+        enum Op : uint64_t { OP_RECV = 0, OP_SEND_HEADER = 1, OP_SEND_DATA = 2 };
+
+        struct Connection {
+            int fd = -1;
+            ConnectionState state;
+            bool closing = false;
+            // SQEs awaiting their completion, and zero-copy sends awaiting the
+            // notification that the kernel is done with their pages
+            int ops = 0;
+            int notifications = 0;
+
+            // Request being received: prefix, header and range body
+            char request[sizeof(int64_t) + sizeof(RequestHeader) + RANGE_BODY_SIZE];
+            size_t received = 0;
+            size_t expected = 0;
+
+            // Response being sent. pending holds the bytes to send before the
+            // data of the current frame, the response header before the first.
+            TensorResponse response;
+            std::string pending;
+            size_t sent = 0;
+            const char* data = nullptr;
+            int64_t next = 0;
+            int64_t end = 0;
+            int64_t chunk_numel = 0;
+            int64_t frame_numel = 0;
+            // When the request was read, -1 once the first byte of the response went out
+            int64_t received_ns = -1;
+            // Tensors of earlier responses in zero-copy sends not notified yet
+            std::vector<torch::Tensor> retained;
+        };
+
+        // A connection coming to the ring: new, or back from the worker pool
+        struct Handover {
+            Connection* connection;
+            bool adopted;
+            bool keep;
+            ConnectionState state;
+        };
+
+        void hand_over(Handover handover) {
+            {
+                std::lock_guard<std::mutex> lock(inbox_mutex_);
+                inbox_.push_back(handover);
+            }
+            wake();
+        }
+
+        void wake() {
+            uint64_t one = 1;
+            ssize_t unused = write(wake_fd_, &one, sizeof(one));
+            (void)unused;
+        }
+
+        void arm_wake() {
+            io_uring_sqe* sqe = ring_.get_sqe();
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = wake_fd_;
+            sqe->addr = reinterpret_cast<uint64_t>(&wake_value_);
+            sqe->len = sizeof(wake_value_);
+            sqe->user_data = 0;
+        }
+
+        io_uring_sqe* prepare(Connection* c, Op op) {
+            io_uring_sqe* sqe = ring_.get_sqe();
+            sqe->fd = c->fd;
+            sqe->user_data = reinterpret_cast<uint64_t>(c) | op;
+            ++c->ops;
+            return sqe;
+        }
+
+        void loop() {
+            arm_wake();
+            while (!stopping_) {
+                ring_.submit(1);
+                ring_.for_each_completion([this](const io_uring_cqe& cqe) { complete(cqe); });
+                take_inbox();
+            }
+
+            // Wake up every pending operation, then drop the connections. The
+            // kernel keeps the pages of unfinished zero-copy sends pinned itself.
+            take_inbox();
+            for (const auto& connection : connections_) {
+                connection.second->closing = true;
+                shutdown(connection.first->fd, SHUT_RDWR);
+            }
+            auto busy = [this] {
+                for (const auto& connection : connections_) {
+                    if (connection.first->ops > 0) {
+                        return true;
+                    }
+                }
+                return false;
+            };
+            while (busy()) {
+                ring_.submit(1);
+                ring_.for_each_completion([this](const io_uring_cqe& cqe) { complete(cqe); });
+            }
+            for (const auto& connection : connections_) {
+                close(connection.first->fd);
+                server_.metrics_->connection_closed();
+            }
+            connections_.clear();
+        }
+
+        void take_inbox() {
+            std::vector<Handover> inbox;
+            {
+                std::lock_guard<std::mutex> lock(inbox_mutex_);
+                inbox.swap(inbox_);
+            }
+            for (const Handover& handover : inbox) {
+                Connection* c = handover.connection;
+                if (handover.adopted) {
+                    connections_.emplace(c, std::unique_ptr<Connection>(c));
+                }
+                c->state = handover.state;
+                if (!handover.keep || stopping_) {
+                    c->closing = true;
+                    release_if_done(c);
+                } else {
+                    start_request(c);
+                }
+            }
+        }
+
+        void complete(const io_uring_cqe& cqe) {
+            if (cqe.user_data == 0) {
+                arm_wake();
+                return;
+            }
+            auto* c = reinterpret_cast<Connection*>(cqe.user_data & ~uint64_t(3));
+            Op op = static_cast<Op>(cqe.user_data & 3);
+            if (cqe.flags & IORING_CQE_F_NOTIF) {
+                --c->notifications;
+                if (c->notifications == 0) {
+                    c->retained.clear();
+                }
+                release_if_done(c);
+                return;
+            }
+            --c->ops;
+            if (cqe.flags & IORING_CQE_F_MORE) {
+                ++c->notifications;
+            }
+            if (c->closing || cqe.res <= 0) {
+                // Failed, or the peer closed the connection
+                c->closing = true;
+                release_if_done(c);
+                return;
+            }
+
+            if (op != OP_RECV && c->received_ns >= 0) {
+                server_.metrics_->first_byte.record(monotonic_ns() - c->received_ns);
+                c->received_ns = -1;
+            }
+            switch (op) {
+                case OP_RECV:
+                    on_received(c, cqe.res);
+                    break;
+                case OP_SEND_HEADER:
+                    on_header_sent(c, cqe.res);
+                    break;
+                case OP_SEND_DATA:
+                    on_data_sent(c, cqe.res);
+                    break;
+            }
+        }
+
+        void release_if_done(Connection* c) {
+            if (c->closing && c->ops == 0 && c->notifications == 0) {
+                close(c->fd);
+                connections_.erase(c);
+                server_.metrics_->connection_closed();
+            }
+        }
+
+        void start_request(Connection* c) {
+            c->received = 0;
+            c->expected = (c->state.persistent ? sizeof(int64_t) : 0) + sizeof(RequestHeader);
+            submit_recv(c);
+        }
+
+        void submit_recv(Connection* c) {
+            io_uring_sqe* sqe = prepare(c, OP_RECV);
+            sqe->opcode = IORING_OP_RECV;
+            sqe->addr = reinterpret_cast<uint64_t>(c->request + c->received);
+            sqe->len = c->expected - c->received;
+            sqe->msg_flags = MSG_WAITALL;
+        }
+
+        void on_received(Connection* c, int received) {
+            c->received += received;
+            if (c->received < c->expected) {
+                submit_recv(c);
+                return;
+            }
+
+            size_t prefix_size = c->state.persistent ? sizeof(int64_t) : 0;
+            size_t header_end = prefix_size + sizeof(RequestHeader);
+            RequestHeader request;
+            std::memcpy(&request, c->request + prefix_size, sizeof(request));
+            if (c->expected == header_end && request.transfer_type == REQUEST_RANGE
+                && request.size == RANGE_BODY_SIZE) {
+                c->expected += RANGE_BODY_SIZE;
+                submit_recv(c);
+                return;
+            }
+
+            std::string prefix(c->request, prefix_size);
+            std::string body(c->request + header_end, c->expected - header_end);
+            int64_t received_ns = monotonic_ns();
+            if ((c->state.persistent || request.transfer_type != REQUEST_PERSISTENT) && !server_.scheduled()) {
+                std::optional<TensorResponse> response = server_.resolve_tensor_request(request, body);
+                if (response && sends_in_place(*response)) {
+                    server_.metrics_->count_request(true);
+                    c->received_ns = received_ns;
+                    start_response(c, std::move(*response), prefix);
+                    return;
+                }
+            }
+
+            // The connection belongs to the worker until it is handed back
+            ConnectionState state = c->state;
+            server_.push_task([this, c, request, body, prefix, state, received_ns]() mutable {
+                bool keep = false;
+                try {
+                    keep = server_.dispatch(c->fd, request, body, prefix, state, received_ns) && state.persistent;
+                } catch (const std::exception&) {
+                    // The client went away or stalled mid-request, nothing left to report to it
+                }
+                hand_over({c, false, keep, std::move(state)});
+            });
+        }
+
+        // Whether the frames of a response are runs of the tensor storage as is
+        static bool sends_in_place(const TensorResponse& response) {
+            const torch::Tensor& tensor = response.tensor;
+            int32_t transfer_type = response.transfer_type;
+            return tensor.device().is_cpu() && tensor.is_contiguous() && !is_compressed(transfer_type)
+                && transfer_type != TTYPE_UNIFORM_INT8 && wire_scalar_type(transfer_type) == tensor.scalar_type();
+        }
+
+        void start_response(Connection* c, TensorResponse response, const std::string& prefix) {
+            if (c->notifications > 0) {
+                c->retained.push_back(c->response.tensor);
+            }
+            const torch::Tensor& tensor = response.tensor;
+            int64_t count = response.count < 0 ? tensor.numel() - response.start : response.count;
+            c->pending = response_header(prefix, response);
+            c->sent = 0;
+            c->next = response.start;
+            c->end = response.start + count;
+            c->chunk_numel = std::max<int64_t>(1, server_.chunk_size_ / tensor.element_size());
+            server_.metrics_->add_payload_bytes(response.transfer_type, count * tensor.element_size());
+            c->response = std::move(response);
+            send_next_frame(c);
+        }
+
+        void send_next_frame(Connection* c) {
+            if (c->next == c->end) {
+                // A header still pending belongs to a response without elements
+                if (!c->pending.empty()) {
+                    submit_header(c);
+                } else {
+                    finish_response(c);
+                }
+                return;
+            }
+            c->frame_numel = std::min(c->chunk_numel, c->end - c->next);
+            int64_t elem_size = c->response.tensor.element_size();
+            FrameHeader frame{c->frame_numel * elem_size, c->frame_numel};
+            c->pending.append(reinterpret_cast<const char*>(&frame), sizeof(frame));
+            c->data = static_cast<const char*>(c->response.tensor.data_ptr()) + c->next * elem_size;
+            submit_header(c);
+        }
+
+        void submit_header(Connection* c) {
+            io_uring_sqe* sqe = prepare(c, OP_SEND_HEADER);
+            sqe->opcode = IORING_OP_SEND;
+            sqe->addr = reinterpret_cast<uint64_t>(c->pending.data() + c->sent);
+            sqe->len = c->pending.size() - c->sent;
+            // Holds the header back until the frame data joins it
+            sqe->msg_flags = MSG_NOSIGNAL | (c->next < c->end ? MSG_MORE : 0);
+        }
+
+        // Short sends mean the socket buffer was full, how long for isn't known
+        void on_header_sent(Connection* c, int sent) {
+            c->sent += sent;
+            if (c->sent < c->pending.size()) {
+                server_.metrics_->add_stalls(1, 0);
+                submit_header(c);
+                return;
+            }
+            c->pending.clear();
+            c->sent = 0;
+            if (c->next == c->end) {
+                finish_response(c);
+            } else {
+                submit_data(c);
+            }
+        }
+
+        void submit_data(Connection* c) {
+            int64_t nbytes = c->frame_numel * c->response.tensor.element_size();
+            io_uring_sqe* sqe = prepare(c, OP_SEND_DATA);
+            sqe->opcode = zero_copy_ && nbytes >= ZERO_COPY_MIN_BYTES ? IORING_OP_SEND_ZC : IORING_OP_SEND;
+            sqe->addr = reinterpret_cast<uint64_t>(c->data + c->sent);
+            sqe->len = nbytes - c->sent;
+            sqe->msg_flags = MSG_NOSIGNAL;
+            if (sqe->opcode == IORING_OP_SEND_ZC && c->response.buffer_index >= 0) {
+                sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+                sqe->buf_index = c->response.buffer_index;
+            }
+        }
+
+        void on_data_sent(Connection* c, int sent) {
+            c->sent += sent;
+            if (static_cast<int64_t>(c->sent) < c->frame_numel * c->response.tensor.element_size()) {
+                server_.metrics_->add_stalls(1, 0);
+                submit_data(c);
+                return;
+            }
+            c->sent = 0;
+            c->next += c->frame_numel;
+            send_next_frame(c);
+        }
+
+        void finish_response(Connection* c) {
+            if (c->state.persistent) {
+                start_request(c);
+            } else {
+                c->closing = true;
+                release_if_done(c);
+            }
+        }
+
+        NativeServer& server_;
+        IoUring ring_;
+        bool zero_copy_ = false;
+        bool fixed_buffers_ = false;
+        int wake_fd_ = -1;
+        uint64_t wake_value_ = 0;
+        std::atomic<bool> stopping_{false};
+        std::thread thread_;
+        std::unordered_map<Connection*, std::unique_ptr<Connection>> connections_;
+        std::vector<Handover> inbox_;
+        std::mutex inbox_mutex_;
+    };
+
+    struct BufferSlot {
+        int32_t index;
+        size_t nbytes;
+        // Keeps the registered memory alive for as long as the slot points at it
+        torch::Tensor owner;
+    };
+
+    std::string host_;
+    int port_;
+    int num_workers_;
+    int64_t chunk_size_;
+    std::atomic<int64_t> body_timeout_ns_{static_cast<int64_t>(DEFAULT_BODY_TIMEOUT * 1e9)};
+    py::object fallback_;
+    std::shared_ptr<Scheduler> scheduler_;
+    std::shared_ptr<Metrics> metrics_ = std::make_shared<Metrics>();
+    std::shared_ptr<EncodingCache> encoding_cache_;
+
+    std::unordered_map<std::string, TensorEntry> tensors_;
+    std::shared_mutex tensors_mutex_;
+
+    // Registered buffer slots by address, those registered since the last clear()
+    // and those registered before it
+    std::unordered_map<void*, BufferSlot> buffer_slots_;
+    std::unordered_map<void*, BufferSlot> stale_buffer_slots_;
+    std::vector<int32_t> free_buffer_slots_;
+    std::vector<std::unique_ptr<RingWorker>> rings_;
+    size_t next_ring_ = 0;
+
+    int listen_fd_ = -1;
+    int epoll_fd_ = -1;
+    int wake_fd_ = -1;
+    std::atomic<bool> running_{false};
+    std::thread event_thread_;
+    std::vector<std::thread> workers_;
+
+    // Open connections and their state
+    std::unordered_map<int, ConnectionState> connections_;
+    std::deque<std::function<void()>> tasks_;
+    std::mutex queue_mutex_;
+    std::condition_variable queue_cv_;
+};
+
+// Define the Python bindings
+PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
+    py::class_<NativeServer>(m, "NativeServer")
+        .def(py::init<std::string, int, int, int64_t, py::object, bool>(),
+             py::arg("host"), py::arg("port"), py::arg("num_workers"), py::arg("chunk_size"), py::arg("fallback"),
+             py::arg("io_uring") = false)
+        .def("register_tensor", &NativeServer::register_tensor,
+             py::arg("path"), py::arg("tensor"), py::arg("transfer_type"), py::arg("version") = -1,
+             py::arg("cacheable") = false,
+             "Register a tensor to be served natively under the given path, cacheable if it never changes")
+        .def("clear", &NativeServer::clear,
+             "Remove all registered tensors")
+        .def("set_scheduler", &NativeServer::set_scheduler, py::arg("capsule"),
+             "Schedule the sends of the core with the scheduler of a Scheduler.capsule()")
+        .def("set_metrics", &NativeServer::set_metrics, py::arg("capsule"),
+             "Record into the metrics of a Metrics.capsule()")
+        .def("set_encoding_cache", &NativeServer::set_encoding_cache, py::arg("capsule"),
+             "Share snapshot encodings through the cache of an EncodingCache.capsule()")
+        .def("set_body_timeout", &NativeServer::set_body_timeout, py::arg("seconds"),
+             "Close connections whose request body takes longer than seconds to arrive")
+        .def_property_readonly("io_uring", &NativeServer::uses_io_uring,
+             "Whether connections are served by io_uring rings rather than epoll")
+        .def("start", &NativeServer::start,
+             "Bind the listening socket and start the event loop and workers")
+        .def("stop", &NativeServer::stop, py::call_guard<py::gil_scoped_release>(),
+             "Stop the event loop and join all workers");
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "codec.h"
+
+// Future of a task on a HelperPool. Like those of std::async, it waits for the task
+// when destroyed or assigned over, so a task never outlives the buffers it works on.
+template <typename T>
+class HelperFuture {
+public:
+    HelperFuture() = default;
+    explicit HelperFuture(std::future<T> future) : future_(std::move(future)) {}
+    HelperFuture(HelperFuture&&) = default;
+
+    HelperFuture& operator=(HelperFuture&& other) {
+        wait();
+        future_ = std::move(other.future_);
+        return *this;
+    }
+
+    ~HelperFuture() {
+        wait();
+    }
+
+    bool valid() const {
+        return future_.valid();
+    }
+
+    // The result of the task, or what it threw
+    T get() {
+        return future_.get();
+    }
+
+private:
+    void wait() {
+        if (future_.valid()) {
+            future_.wait();
+        }
+    }
+
+    std::future<T> future_;
+};
+
+// A fixed set of helper threads fed by a queue, which encode or decode the chunks
+// of transfers ahead of the socket. Tasks start in the order they were submitted
+// and never wait on other tasks, so transfers sharing the threads only ever wait
+// for them to get to their chunks.
+class HelperPool {
+public:
+    explicit HelperPool(int num_threads) : idle_(num_threads) {
+        for (int i = 0; i < num_threads; ++i) {
+            threads_.emplace_back(&HelperPool::run, this);
+        }
+    }
+
+    template <typename F>
+    HelperFuture<std::invoke_result_t<std::decay_t<F>&>> submit(F&& task) {
+        using Result = std::invoke_result_t<std::decay_t<F>&>;
+        auto packaged = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(task));
+        std::future<Result> result = packaged->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tasks_.emplace_back([packaged] { (*packaged)(); });
+        }
+        cv_.notify_one();
+        return HelperFuture<Result>(std::move(result));
+    }
+
+    // Run task on a thread that is idle right now, without waiting for it. Returns
+    // false, and drops the task, if every thread is busy.
+    bool try_post(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (idle_ <= static_cast<int>(tasks_.size())) {
+                return false;
+            }
+            tasks_.push_back(std::move(task));
+        }
+        cv_.notify_one();
+        return true;
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            cv_.wait(lock, [this] { return !tasks_.empty(); });
+            std::function<void()> task = std::move(tasks_.front());
+            tasks_.pop_front();
+            --idle_;
+            lock.unlock();
+            task();
+            lock.lock();
+            ++idle_;
+        }
+    }
+
+    std::vector<std::thread> threads_;
+    std::deque<std::function<void()>> tasks_;
+    // Threads not running a task
+    int idle_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+};
+
+// The codec_slots() helper threads shared by every transfer of the process. Never
+// destroyed, so that transfers still running at exit can't outlive it.
+inline HelperPool& helper_pool() {
+    static HelperPool* pool = new HelperPool(codec_slots());
+    return *pool;
+}
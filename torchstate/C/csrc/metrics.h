@@ -0,0 +1,254 @@
+#pragma once
+
+#include <torch/extension.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <sstream>
+#include <string>
+#include "tensor_io.h"
+
+// Counters and latency histograms of the serving paths, cheap enough to keep
+// on for every request: each update is a relaxed atomic add, and sends only
+// read the clock a few times per response. Rendered in the Prometheus text
+// format for STATS requests and scrapes.
+
+// Name of the capsules the metrics are passed between extensions in
+constexpr const char* METRICS_CAPSULE = "torchstate.Metrics";
+
+// Transfer types counted separately, by value
+constexpr int32_t NUM_METRIC_TRANSFER_TYPES = 16;
+
+inline const char* transfer_type_name(int32_t transfer_type) {
+    switch (transfer_type) {
+        case TTYPE_FLOAT32: return "FLOAT32";
+        case TTYPE_BFLOAT16: return "BFLOAT16";
+        case TTYPE_FLOAT16: return "FLOAT16";
+        case TTYPE_UNIFORM_INT8: return "UNIFORM_INT8";
+        case TTYPE_SHUFFLE_ZSTD: return "SHUFFLE_ZSTD";
+        case TTYPE_SHUFFLE_LZ4: return "SHUFFLE_LZ4";
+        default: return nullptr;
+    }
+}
+
+// Durations in power of two buckets, from 1us to about 4s and then everything longer
+class alignas(64) Histogram {
+public:
+    static constexpr int NUM_BUCKETS = 24;
+
+    void record(int64_t ns) {
+        ns = std::max<int64_t>(ns, 0);
+        uint64_t us = (static_cast<uint64_t>(ns) + 999) / 1000;
+        int bucket = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+        buckets_[std::min(bucket, NUM_BUCKETS - 1)].fetch_add(1, std::memory_order_relaxed);
+        sum_ns_.fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    // Upper bound of a bucket in seconds, infinite for the last
+    static double bound(int bucket) {
+        if (bucket == NUM_BUCKETS - 1) {
+            return std::numeric_limits<double>::infinity();
+        }
+        return static_cast<double>(int64_t(1) << bucket) * 1e-6;
+    }
+
+    int64_t bucket_count(int bucket) const {
+        return buckets_[bucket].load(std::memory_order_relaxed);
+    }
+
+    int64_t count() const {
+        int64_t total = 0;
+        for (int bucket = 0; bucket < NUM_BUCKETS; ++bucket) {
+            total += bucket_count(bucket);
+        }
+        return total;
+    }
+
+    double sum() const {
+        return sum_ns_.load(std::memory_order_relaxed) * 1e-9;
+    }
+
+private:
+    std::atomic<int64_t> buckets_[NUM_BUCKETS] = {};
+    std::atomic<int64_t> sum_ns_{0};
+};
+
+class Metrics {
+public:
+    // Time to find the tensor of a request
+    Histogram lookup;
+    // Time from reading a request to sending the first byte of its first payload
+    Histogram first_byte;
+    // Time spent casting, quantizing or compressing the payload of a response
+    Histogram encode;
+
+    void count_request(bool native) {
+        (native ? native_requests_ : python_requests_).fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void count_error() {
+        errors_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void connection_opened() {
+        connections_.fetch_add(1, std::memory_order_relaxed);
+        total_connections_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void connection_closed() {
+        connections_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void add_payload_bytes(int32_t transfer_type, int64_t nbytes) {
+        if (transfer_type >= 0 && transfer_type < NUM_METRIC_TRANSFER_TYPES) {
+            payload_bytes_[transfer_type].fetch_add(nbytes, std::memory_order_relaxed);
+        }
+    }
+
+    void add_stalls(int64_t stalls, int64_t ns) {
+        if (stalls > 0) {
+            stalls_.fetch_add(stalls, std::memory_order_relaxed);
+            stall_ns_.fetch_add(ns, std::memory_order_relaxed);
+        }
+    }
+
+    // Record a finished payload of transfer_type sent for a request read at
+    // received_ns, which is -1 for the payloads after the first of a response
+    void record_send(int32_t transfer_type, int64_t received_ns, const SendStats& stats) {
+        if (received_ns >= 0 && stats.first_byte_ns >= 0) {
+            first_byte.record(stats.first_byte_ns - received_ns);
+        }
+        if (stats.encoded) {
+            encode.record(stats.encode_ns);
+        }
+        add_payload_bytes(transfer_type, stats.nbytes);
+        add_stalls(stats.stalls, stats.stall_ns);
+        if (stats.throttle_ns > 0) {
+            throttle_ns_.fetch_add(stats.throttle_ns, std::memory_order_relaxed);
+        }
+    }
+
+    // A response sent through the encoding cache, from a payload already in it or
+    // being encoded (hit) or from one it started encoding (miss)
+    void count_encoding_cache(bool hit) {
+        (hit ? cache_hits_ : cache_misses_).fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void set_encoding_cache_bytes(int64_t nbytes) {
+        cache_bytes_.store(nbytes, std::memory_order_relaxed);
+    }
+
+    int64_t requests(bool native) const {
+        return (native ? native_requests_ : python_requests_).load(std::memory_order_relaxed);
+    }
+
+    int64_t errors() const {
+        return errors_.load(std::memory_order_relaxed);
+    }
+
+    int64_t connections() const {
+        return connections_.load(std::memory_order_relaxed);
+    }
+
+    int64_t total_connections() const {
+        return total_connections_.load(std::memory_order_relaxed);
+    }
+
+    int64_t payload_bytes(int32_t transfer_type) const {
+        return payload_bytes_[transfer_type].load(std::memory_order_relaxed);
+    }
+
+    int64_t stalls() const {
+        return stalls_.load(std::memory_order_relaxed);
+    }
+
+    double stall_seconds() const {
+        return stall_ns_.load(std::memory_order_relaxed) * 1e-9;
+    }
+
+    double throttle_seconds() const {
+        return throttle_ns_.load(std::memory_order_relaxed) * 1e-9;
+    }
+
+    int64_t encoding_cache_lookups(bool hit) const {
+        return (hit ? cache_hits_ : cache_misses_).load(std::memory_order_relaxed);
+    }
+
+    int64_t encoding_cache_bytes() const {
+        return cache_bytes_.load(std::memory_order_relaxed);
+    }
+
+    // Everything in the Prometheus text exposition format
+    std::string prometheus() const {
+        std::ostringstream out;
+        auto header = [&](const char* name, const char* type, const char* help) {
+            out << "# HELP torchstate_" << name << " " << help << "\n# TYPE torchstate_" << name << " " << type
+                << "\n";
+        };
+        auto histogram = [&](const char* name, const char* help, const Histogram& h) {
+            header(name, "histogram", help);
+            int64_t cumulative = 0;
+            for (int bucket = 0; bucket < Histogram::NUM_BUCKETS; ++bucket) {
+                cumulative += h.bucket_count(bucket);
+                out << "torchstate_" << name << "_bucket{le=\"";
+                if (bucket == Histogram::NUM_BUCKETS - 1) {
+                    out << "+Inf";
+                } else {
+                    out << Histogram::bound(bucket);
+                }
+                out << "\"} " << cumulative << "\n";
+            }
+            out << "torchstate_" << name << "_sum " << h.sum() << "\n";
+            out << "torchstate_" << name << "_count " << cumulative << "\n";
+        };
+
+        header("requests_total", "counter", "Requests by the handler that served them");
+        out << "torchstate_requests_total{handler=\"native\"} " << requests(true) << "\n";
+        out << "torchstate_requests_total{handler=\"python\"} " << requests(false) << "\n";
+        header("errors_total", "counter", "Requests answered with an error");
+        out << "torchstate_errors_total " << errors() << "\n";
+        header("connections", "gauge", "Open client connections");
+        out << "torchstate_connections " << connections() << "\n";
+        header("connections_total", "counter", "Client connections accepted");
+        out << "torchstate_connections_total " << total_connections() << "\n";
+        header("payload_bytes_total", "counter", "Tensor payload bytes sent, as encoded, by transfer type");
+        for (int32_t transfer_type = 0; transfer_type < NUM_METRIC_TRANSFER_TYPES; ++transfer_type) {
+            if (const char* name = transfer_type_name(transfer_type)) {
+                out << "torchstate_payload_bytes_total{transfer_type=\"" << name << "\"} "
+                    << payload_bytes(transfer_type) << "\n";
+            }
+        }
+        header("send_stalls_total", "counter", "Sends that found the socket buffer full");
+        out << "torchstate_send_stalls_total " << stalls() << "\n";
+        header("send_stall_seconds_total", "counter", "Time spent waiting for full socket buffers to drain");
+        out << "torchstate_send_stall_seconds_total " << stall_seconds() << "\n";
+        header("throttle_seconds_total", "counter", "Time payload frames were held back by the scheduler");
+        out << "torchstate_throttle_seconds_total " << throttle_seconds() << "\n";
+        header("encoding_cache_hits_total", "counter", "Responses sent from an encoding already cached or underway");
+        out << "torchstate_encoding_cache_hits_total " << encoding_cache_lookups(true) << "\n";
+        header("encoding_cache_misses_total", "counter", "Responses that started a cached encoding");
+        out << "torchstate_encoding_cache_misses_total " << encoding_cache_lookups(false) << "\n";
+        header("encoding_cache_bytes", "gauge", "Bytes of encoded payloads kept in the cache");
+        out << "torchstate_encoding_cache_bytes " << encoding_cache_bytes() << "\n";
+        histogram("lookup_seconds", "Time to find the tensor of a request", lookup);
+        histogram("first_byte_seconds", "Time from reading a request to sending its first payload byte",
+                  first_byte);
+        histogram("encode_seconds", "Time spent casting, quantizing or compressing a payload", encode);
+        return out.str();
+    }
+
+private:
+    std::atomic<int64_t> native_requests_{0};
+    std::atomic<int64_t> python_requests_{0};
+    std::atomic<int64_t> errors_{0};
+    std::atomic<int64_t> connections_{0};
+    std::atomic<int64_t> total_connections_{0};
+    std::atomic<int64_t> payload_bytes_[NUM_METRIC_TRANSFER_TYPES] = {};
+    std::atomic<int64_t> stalls_{0};
+    std::atomic<int64_t> stall_ns_{0};
+    std::atomic<int64_t> throttle_ns_{0};
+    std::atomic<int64_t> cache_hits_{0};
+    std::atomic<int64_t> cache_misses_{0};
+    std::atomic<int64_t> cache_bytes_{0};
+};
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <immintrin.h>
+#include "cast.h"
+
+// Uniform 8-bit quantization. Every block of values gets its own 256 entry fp32
+// codebook spanning [min, max] in equal steps, and each value is replaced by the
+// index of the nearest entry. Dequantizing is a codebook lookup, so the decoder
+// doesn't depend on how the codebook was built.
+constexpr int CODEBOOK_ENTRIES = 256;
+
+__attribute__((target("avx2")))
+inline int64_t min_max_avx2(const float* src, int64_t n, float* lo, float* hi) {
+    if (n < 8) {
+        return 0;
+    }
+    __m256 vmin = _mm256_loadu_ps(src);
+    __m256 vmax = vmin;
+    int64_t i = 8;
+    for (; i + 8 <= n; i += 8) {
+        __m256 values = _mm256_loadu_ps(src + i);
+        vmin = _mm256_min_ps(values, vmin);
+        vmax = _mm256_max_ps(values, vmax);
+    }
+    float mins[8], maxs[8];
+    _mm256_storeu_ps(mins, vmin);
+    _mm256_storeu_ps(maxs, vmax);
+    *lo = *std::min_element(mins, mins + 8);
+    *hi = *std::max_element(maxs, maxs + 8);
+    return i;
+}
+
+__attribute__((target("avx2")))
+inline int64_t quantize_avx2(const float* src, uint8_t* dst, int64_t n, float lo, float inv_step) {
+    const __m256 vlo = _mm256_set1_ps(lo);
+    const __m256 vinv = _mm256_set1_ps(inv_step);
+    const __m256 vzero = _mm256_setzero_ps();
+    const __m256 vmax = _mm256_set1_ps(CODEBOOK_ENTRIES - 1);
+    int64_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i codes[4];
+        for (int j = 0; j < 4; ++j) {
+            __m256 scaled = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(src + i + 8 * j), vlo), vinv);
+            scaled = _mm256_min_ps(_mm256_max_ps(scaled, vzero), vmax);
+            codes[j] = _mm256_cvtps_epi32(_mm256_round_ps(scaled, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+        }
+        // Narrow 32 -> 16 -> 8 bits, then undo the per lane interleaving of the packs
+        __m256i packed16_lo = _mm256_packus_epi32(codes[0], codes[1]);
+        __m256i packed16_hi = _mm256_packus_epi32(codes[2], codes[3]);
+        __m256i packed8 = _mm256_packus_epi16(packed16_lo, packed16_hi);
+        packed8 = _mm256_permutevar8x32_epi32(packed8, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), packed8);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+inline int64_t dequantize_avx2(const float* codebook, const uint8_t* src, float* dst, int64_t n) {
+    int64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i indices = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + i)));
+        _mm256_storeu_ps(dst + i, _mm256_i32gather_ps(codebook, indices, 4));
+    }
+    return i;
+}
+
+// Quantize n values into dst and write the codebook used for them.
+inline void quantize_uniform_int8(const float* src, int64_t n, float* codebook, uint8_t* dst) {
+    float lo = n > 0 ? src[0] : 0.0f;
+    float hi = lo;
+    int64_t i = cpu_features().avx2 ? min_max_avx2(src, n, &lo, &hi) : 0;
+    for (; i < n; ++i) {
+        lo = std::min(lo, src[i]);
+        hi = std::max(hi, src[i]);
+    }
+
+    float step = (hi - lo) / (CODEBOOK_ENTRIES - 1);
+    float inv_step = step > 0 ? 1.0f / step : 0.0f;
+    for (int entry = 0; entry < CODEBOOK_ENTRIES; ++entry) {
+        codebook[entry] = lo + entry * step;
+    }
+
+    i = cpu_features().avx2 ? quantize_avx2(src, dst, n, lo, inv_step) : 0;
+    for (; i < n; ++i) {
+        float scaled = std::min(std::max((src[i] - lo) * inv_step, 0.0f), float(CODEBOOK_ENTRIES - 1));
+        dst[i] = static_cast<uint8_t>(std::nearbyint(scaled));
+    }
+}
+
+// Replace each code by its codebook entry.
+inline void dequantize_int8(const float* codebook, const uint8_t* src, int64_t n, float* dst) {
+    int64_t i = cpu_features().avx2 ? dequantize_avx2(codebook, src, dst, n) : 0;
+    for (; i < n; ++i) {
+        dst[i] = codebook[src[i]];
+    }
+}
@@ -0,0 +1,279 @@
+#include <torch/extension.h>
+#include <infiniband/verbs.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+
+// Connection details of one end of a reliable connected queue pair, exchanged
+// over the TCP control connection
+struct EndpointInfo {
+    uint8_t gid[16];
+    uint32_t qpn;
+    uint32_t psn;
+    uint16_t lid;
+    uint16_t unused;
+};
+static_assert(sizeof(EndpointInfo) == 28, "Endpoint info must be 28 bytes");
+
+// Most reads in flight on one queue pair, each signaled on completion
+constexpr int MAX_OUTSTANDING_READS = 128;
+// Longest single read, larger ones are split
+constexpr int64_t MAX_READ_SIZE = 1LL << 30;
+
+// An opened RDMA device and its protection domain, shared by the endpoints and
+// memory regions created from it
+class RdmaContext : public std::enable_shared_from_this<RdmaContext> {
+public:
+    RdmaContext(const std::string& device_name, int port, int gid_index) : port_(port), gid_index_(gid_index) {
+        int num_devices = 0;
+        ibv_device** devices = ibv_get_device_list(&num_devices);
+        TORCH_CHECK(devices != nullptr && num_devices > 0, "No RDMA devices found");
+        ibv_device* device = nullptr;
+        for (int i = 0; i < num_devices; ++i) {
+            if (device_name.empty() || device_name == ibv_get_device_name(devices[i])) {
+                device = devices[i];
+                break;
+            }
+        }
+        if (device != nullptr) {
+            context_ = ibv_open_device(device);
+        }
+        ibv_free_device_list(devices);
+        TORCH_CHECK(device != nullptr, "RDMA device ", device_name, " not found");
+        TORCH_CHECK(context_ != nullptr, "Failed to open RDMA device: ", std::strerror(errno));
+
+        pd_ = ibv_alloc_pd(context_);
+        TORCH_CHECK(pd_ != nullptr, "Failed to allocate protection domain: ", std::strerror(errno));
+        TORCH_CHECK(ibv_query_port(context_, port_, &port_attr_) == 0, "Failed to query RDMA port ", port_);
+        TORCH_CHECK(ibv_query_device(context_, &device_attr_) == 0, "Failed to query RDMA device");
+        std::memset(&gid_, 0, sizeof(gid_));
+        if (gid_index_ >= 0) {
+            TORCH_CHECK(ibv_query_gid(context_, port_, gid_index_, &gid_) == 0, "Failed to query GID ", gid_index_);
+        }
+    }
+
+    ~RdmaContext() {
+        ibv_dealloc_pd(pd_);
+        ibv_close_device(context_);
+    }
+
+    std::shared_ptr<class RdmaRegion> register_tensor(torch::Tensor tensor);
+    std::shared_ptr<class RdmaEndpoint> endpoint();
+
+    ibv_context* context_ = nullptr;
+    ibv_pd* pd_ = nullptr;
+    ibv_port_attr port_attr_;
+    ibv_device_attr device_attr_;
+    ibv_gid gid_;
+    int port_;
+    // RoCE needs a GID to route by, InfiniBand uses the LID when this is -1
+    int gid_index_;
+};
+
+// The storage of a contiguous tensor registered with the device, so that peers
+// can read it and local reads can land in it. CUDA tensors are registered as is,
+// which needs GPUDirect RDMA (nvidia-peermem) on the host.
+class RdmaRegion {
+public:
+    RdmaRegion(std::shared_ptr<RdmaContext> context, torch::Tensor tensor)
+        : context_(std::move(context)), tensor_(std::move(tensor)) {
+        TORCH_CHECK(tensor_.is_contiguous(), "Only contiguous tensors can be registered");
+        int access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ;
+        mr_ = ibv_reg_mr(context_->pd_, tensor_.data_ptr(), nbytes(), access);
+        TORCH_CHECK(mr_ != nullptr, "Failed to register ", nbytes(), " bytes with the RDMA device: ",
+                    std::strerror(errno));
+    }
+
+    ~RdmaRegion() {
+        ibv_dereg_mr(mr_);
+    }
+
+    uint64_t addr() const { return reinterpret_cast<uint64_t>(tensor_.data_ptr()); }
+    int64_t nbytes() const { return tensor_.numel() * tensor_.element_size(); }
+    uint32_t rkey() const { return mr_->rkey; }
+    uint32_t lkey() const { return mr_->lkey; }
+
+private:
+    std::shared_ptr<RdmaContext> context_;
+    // Keeps the registered memory alive
+    torch::Tensor tensor_;
+    ibv_mr* mr_ = nullptr;
+};
+
+// One end of a reliable connected queue pair. The server side only needs to be
+// connected, reads from the client side are served by the adapters alone.
+class RdmaEndpoint {
+public:
+    explicit RdmaEndpoint(std::shared_ptr<RdmaContext> context) : context_(std::move(context)) {
+        cq_ = ibv_create_cq(context_->context_, MAX_OUTSTANDING_READS, nullptr, nullptr, 0);
+        TORCH_CHECK(cq_ != nullptr, "Failed to create completion queue: ", std::strerror(errno));
+
+        ibv_qp_init_attr init{};
+        init.send_cq = cq_;
+        init.recv_cq = cq_;
+        init.qp_type = IBV_QPT_RC;
+        init.cap.max_send_wr = MAX_OUTSTANDING_READS;
+        init.cap.max_recv_wr = 1;
+        init.cap.max_send_sge = 1;
+        init.cap.max_recv_sge = 1;
+        qp_ = ibv_create_qp(context_->pd_, &init);
+        TORCH_CHECK(qp_ != nullptr, "Failed to create queue pair: ", std::strerror(errno));
+
+        ibv_qp_attr attr{};
+        attr.qp_state = IBV_QPS_INIT;
+        attr.pkey_index = 0;
+        attr.port_num = context_->port_;
+        attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ;
+        modify(attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS, "INIT");
+
+        psn_ = std::random_device()() & 0xffffff;
+    }
+
+    ~RdmaEndpoint() {
+        ibv_destroy_qp(qp_);
+        ibv_destroy_cq(cq_);
+    }
+
+    // This end's connection details, to be passed to connect() on the other end
+    py::bytes info() const {
+        EndpointInfo info{};
+        std::memcpy(info.gid, context_->gid_.raw, sizeof(info.gid));
+        info.qpn = qp_->qp_num;
+        info.psn = psn_;
+        info.lid = context_->port_attr_.lid;
+        return py::bytes(reinterpret_cast<const char*>(&info), sizeof(info));
+    }
+
+    // Connect to the other end, given its info(), and get ready to send
+    void connect(const std::string& remote_info) {
+        TORCH_CHECK(remote_info.size() == sizeof(EndpointInfo), "Invalid RDMA endpoint info");
+        EndpointInfo remote;
+        std::memcpy(&remote, remote_info.data(), sizeof(remote));
+        int max_rd_atomic = std::min(16, context_->device_attr_.max_qp_rd_atom);
+
+        ibv_qp_attr attr{};
+        attr.qp_state = IBV_QPS_RTR;
+        attr.path_mtu = context_->port_attr_.active_mtu;
+        attr.dest_qp_num = remote.qpn;
+        attr.rq_psn = remote.psn;
+        attr.max_dest_rd_atomic = std::min(16, context_->device_attr_.max_qp_init_rd_atom);
+        attr.min_rnr_timer = 12;
+        attr.ah_attr.dlid = remote.lid;
+        attr.ah_attr.port_num = context_->port_;
+        if (context_->gid_index_ >= 0) {
+            attr.ah_attr.is_global = 1;
+            std::memcpy(attr.ah_attr.grh.dgid.raw, remote.gid, sizeof(remote.gid));
+            attr.ah_attr.grh.sgid_index = context_->gid_index_;
+            attr.ah_attr.grh.hop_limit = 1;
+        }
+        modify(attr, IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+                     IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER, "RTR");
+
+        attr = ibv_qp_attr{};
+        attr.qp_state = IBV_QPS_RTS;
+        attr.timeout = 14;
+        attr.retry_cnt = 7;
+        attr.rnr_retry = 7;
+        attr.sq_psn = psn_;
+        attr.max_rd_atomic = max_rd_atomic;
+        modify(attr, IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN |
+                     IBV_QP_MAX_QP_RD_ATOMIC, "RTS");
+    }
+
+    // Start reading nbytes at remote_addr of the peer into region at offset.
+    // Returns once the reads are posted, wait() blocks until they have landed.
+    void read(const RdmaRegion& region, int64_t offset, uint64_t remote_addr, uint32_t rkey, int64_t nbytes) {
+        TORCH_CHECK(offset >= 0 && nbytes >= 0 && offset + nbytes <= region.nbytes(),
+                    "Read of ", nbytes, " bytes at ", offset, " overflows a region of ", region.nbytes(), " bytes");
+        py::gil_scoped_release no_gil;
+        for (int64_t done = 0; done < nbytes; done += MAX_READ_SIZE) {
+            while (outstanding_ == MAX_OUTSTANDING_READS) {
+                poll();
+            }
+            ibv_sge sge{};
+            sge.addr = region.addr() + offset + done;
+            sge.length = static_cast<uint32_t>(std::min(MAX_READ_SIZE, nbytes - done));
+            sge.lkey = region.lkey();
+
+            ibv_send_wr wr{};
+            ibv_send_wr* bad = nullptr;
+            wr.sg_list = &sge;
+            wr.num_sge = 1;
+            wr.opcode = IBV_WR_RDMA_READ;
+            wr.send_flags = IBV_SEND_SIGNALED;
+            wr.wr.rdma.remote_addr = remote_addr + done;
+            wr.wr.rdma.rkey = rkey;
+            int err = ibv_post_send(qp_, &wr, &bad);
+            TORCH_CHECK(err == 0, "Failed to post RDMA read: ", std::strerror(err));
+            ++outstanding_;
+        }
+    }
+
+    // Wait for every posted read to complete
+    void wait() {
+        py::gil_scoped_release no_gil;
+        while (outstanding_ > 0) {
+            poll();
+        }
+    }
+
+private:
+    void modify(ibv_qp_attr& attr, int mask, const char* state) {
+        int err = ibv_modify_qp(qp_, &attr, mask);
+        TORCH_CHECK(err == 0, "Failed to move queue pair to ", state, ": ", std::strerror(err));
+    }
+
+    // Busy poll the completion queue, reads are expected to finish at line rate
+    void poll() {
+        ibv_wc wc[16];
+        int n = ibv_poll_cq(cq_, 16, wc);
+        TORCH_CHECK(n >= 0, "Failed to poll completion queue");
+        for (int i = 0; i < n; ++i) {
+            --outstanding_;
+            TORCH_CHECK(wc[i].status == IBV_WC_SUCCESS, "RDMA read failed: ", ibv_wc_status_str(wc[i].status));
+        }
+    }
+
+    std::shared_ptr<RdmaContext> context_;
+    ibv_cq* cq_ = nullptr;
+    ibv_qp* qp_ = nullptr;
+    uint32_t psn_ = 0;
+    int outstanding_ = 0;
+};
+
+std::shared_ptr<RdmaRegion> RdmaContext::register_tensor(torch::Tensor tensor) {
+    return std::make_shared<RdmaRegion>(shared_from_this(), std::move(tensor));
+}
+
+std::shared_ptr<RdmaEndpoint> RdmaContext::endpoint() {
+    return std::make_shared<RdmaEndpoint>(shared_from_this());
+}
+
+// Define the Python bindings
+PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
+    m.attr("ENDPOINT_INFO_SIZE") = static_cast<int>(sizeof(EndpointInfo));
+    py::class_<RdmaContext, std::shared_ptr<RdmaContext>>(m, "RdmaContext")
+        .def(py::init<std::string, int, int>(), py::arg("device") = "", py::arg("port") = 1,
+             py::arg("gid_index") = -1)
+        .def("register_tensor", &RdmaContext::register_tensor,
+             "Register the memory of a contiguous tensor for RDMA reads")
+        .def("endpoint", &RdmaContext::endpoint,
+             "Create an unconnected queue pair");
+    py::class_<RdmaRegion, std::shared_ptr<RdmaRegion>>(m, "RdmaRegion")
+        .def_property_readonly("addr", &RdmaRegion::addr)
+        .def_property_readonly("nbytes", &RdmaRegion::nbytes)
+        .def_property_readonly("rkey", &RdmaRegion::rkey);
+    py::class_<RdmaEndpoint, std::shared_ptr<RdmaEndpoint>>(m, "RdmaEndpoint")
+        .def("info", &RdmaEndpoint::info,
+             "Connection details to pass to connect() on the other end")
+        .def("connect", &RdmaEndpoint::connect,
+             "Connect to the other end given its info()")
+        .def("read", &RdmaEndpoint::read,
+             "Post reads of nbytes at remote_addr into region at offset",
+             py::arg("region"), py::arg("offset"), py::arg("remote_addr"), py::arg("rkey"), py::arg("nbytes"))
+        .def("wait", &RdmaEndpoint::wait,
+             "Wait for every posted read to complete");
+}
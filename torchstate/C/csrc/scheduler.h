@@ -0,0 +1,214 @@
+#pragma once
+
+#include <torch/extension.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Admission control for the payload a server sends, so serving doesn't push up
+// the step time of the trainer it runs in. Every frame waits for its turn: none
+// goes out while serving is paused, the total and per client host bandwidth is
+// capped with token buckets, and when the budget is short, the frames of the
+// most urgent priority class go first and the connections of one class take
+// turns frame by frame.
+
+// Priority classes, most urgent first: ranks recovering their state, the
+// default, and background readers like eval pollers
+constexpr int32_t PRIORITY_RECOVERY = 0;
+constexpr int32_t PRIORITY_NORMAL = 1;
+constexpr int32_t PRIORITY_BACKGROUND = 2;
+constexpr int32_t NUM_PRIORITIES = 3;
+
+// Seconds worth of bandwidth a bucket saves up while idle, which bounds the
+// bursts that follow
+constexpr double SCHEDULER_BURST_SECONDS = 0.01;
+
+// Name of the capsules the scheduler is passed between extensions in
+constexpr const char* SCHEDULER_CAPSULE = "torchstate.Scheduler";
+
+class Scheduler {
+    using Clock = std::chrono::steady_clock;
+
+    struct Bucket {
+        // Bytes that may be sent right away, negative while in debt
+        double tokens = 0;
+        Clock::time_point refilled = Clock::now();
+
+        void refill(double rate, Clock::time_point now) {
+            double elapsed = std::chrono::duration<double>(now - refilled).count();
+            tokens = std::min(tokens + elapsed * rate, rate * SCHEDULER_BURST_SECONDS);
+            refilled = now;
+        }
+
+        // Seconds until the bucket is out of debt
+        double deficit(double rate) const {
+            return tokens >= 0 ? 0 : -tokens / rate;
+        }
+    };
+
+public:
+    // The bandwidth budget shared by the connections of one client host
+    class Client {
+        friend class Scheduler;
+        Bucket bucket_;
+    };
+
+    // Cap the total and the per client bandwidth, in bytes per second (0 for no cap)
+    void set_bandwidth(double total, double per_client) {
+        TORCH_CHECK(total >= 0 && per_client >= 0, "Bandwidth caps can't be negative");
+        std::lock_guard<std::mutex> lock(mutex_);
+        total_rate_ = total;
+        client_rate_ = per_client;
+        update_active();
+        cv_.notify_all();
+    }
+
+    double total_bandwidth() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return total_rate_;
+    }
+
+    double client_bandwidth() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return client_rate_;
+    }
+
+    // Hold back every frame not sent yet until resume()
+    void pause() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        paused_ = true;
+        update_active();
+    }
+
+    void resume() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        paused_ = false;
+        update_active();
+        cv_.notify_all();
+    }
+
+    bool paused() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return paused_;
+    }
+
+    // Whether frames may have to wait, i.e. serving is paused or capped
+    bool active() const {
+        return active_.load(std::memory_order_relaxed);
+    }
+
+    // The budget of a client host, shared by all its connections
+    std::shared_ptr<Client> client(const std::string& host) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::shared_ptr<Client> client = clients_[host].lock();
+        if (client == nullptr) {
+            // Hosts without connections left are forgotten
+            for (auto it = clients_.begin(); it != clients_.end();) {
+                it = it->second.expired() ? clients_.erase(it) : std::next(it);
+            }
+            client = std::make_shared<Client>();
+            clients_[host] = client;
+        }
+        return client;
+    }
+
+    // Block until a frame of nbytes may be sent to client (which may be null) at
+    // priority. Frames are let through one at a time, the first in order of
+    // priority and arrival whose client is within its budget going next.
+    void acquire(Client* client, int32_t priority, int64_t nbytes) {
+        if (!active()) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        priority = std::clamp<int32_t>(priority, 0, NUM_PRIORITIES - 1);
+        auto position = std::find_if(waiters_.begin(), waiters_.end(),
+                                     [&](const Waiter& w) { return w.priority > priority; });
+        auto self = waiters_.insert(position, Waiter{client, priority});
+
+        while (true) {
+            Clock::time_point now = Clock::now();
+            total_.refill(total_rate_, now);
+            auto next = waiters_.end();
+            double client_delay = -1;
+            for (auto it = waiters_.begin(); it != waiters_.end(); ++it) {
+                if (client_rate_ == 0 || it->client == nullptr) {
+                    next = it;
+                    break;
+                }
+                it->client->bucket_.refill(client_rate_, now);
+                double deficit = it->client->bucket_.deficit(client_rate_);
+                if (deficit == 0) {
+                    next = it;
+                    break;
+                }
+                client_delay = client_delay < 0 ? deficit : std::min(client_delay, deficit);
+            }
+
+            double delay = total_rate_ > 0 ? total_.deficit(total_rate_) : 0;
+            if (!paused_ && next == self && delay == 0) {
+                break;
+            }
+            if (next == waiters_.end()) {
+                delay = std::max(delay, client_delay);
+            }
+            // Whoever goes next wakes the others once through, and resume() and
+            // set_bandwidth() wake everyone
+            if (paused_ || delay == 0) {
+                cv_.wait(lock);
+            } else {
+                cv_.wait_for(lock, std::chrono::duration<double>(delay));
+            }
+        }
+
+        waiters_.erase(self);
+        if (total_rate_ > 0) {
+            total_.tokens -= nbytes;
+        }
+        if (client_rate_ > 0 && client != nullptr) {
+            client->bucket_.tokens -= nbytes;
+        }
+        cv_.notify_all();
+    }
+
+private:
+    struct Waiter {
+        Client* client;
+        int32_t priority;
+    };
+
+    void update_active() {
+        active_ = paused_ || total_rate_ > 0 || client_rate_ > 0;
+    }
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::atomic<bool> active_{false};
+    bool paused_ = false;
+    double total_rate_ = 0;
+    double client_rate_ = 0;
+    Bucket total_;
+    // Frames waiting for their turn, by priority, then in order of arrival
+    std::list<Waiter> waiters_;
+    std::unordered_map<std::string, std::weak_ptr<Client>> clients_;
+};
+
+// What the frames of one response are scheduled as: the client they go to and its
+// priority class. Frames of responses without a scheduler are never held back.
+struct Pacer {
+    Scheduler* scheduler = nullptr;
+    Scheduler::Client* client = nullptr;
+    int32_t priority = PRIORITY_NORMAL;
+
+    void acquire(int64_t nbytes) const {
+        if (scheduler != nullptr) {
+            scheduler->acquire(client, priority, nbytes);
+        }
+    }
+};
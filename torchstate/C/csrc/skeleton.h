@@ -0,0 +1,238 @@
+#pragma once
+
+#include <torch/extension.h>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// The non-tensor part of a state dict, e.g. that of an optimizer or LR scheduler,
+// as one compact tree, so that thousands of param groups and step counters take a
+// single response instead of a request each. Every node is a tag byte followed by:
+//
+//   NONE, FALSE, TRUE    nothing
+//   INT                  the value ('q')
+//   FLOAT                the value ('d')
+//   STR                  the UTF-8 length ('I'), then the bytes
+//   LIST, TUPLE          the item count ('I'), then every item
+//   DICT                 the item count ('I'), then every key and value
+//   TENSOR               the key ID of the tensor ('q'), fetched separately
+//
+// Dict keys keep their type, unlike in request paths.
+constexpr uint8_t SKELETON_NONE = 0;
+constexpr uint8_t SKELETON_FALSE = 1;
+constexpr uint8_t SKELETON_TRUE = 2;
+constexpr uint8_t SKELETON_INT = 3;
+constexpr uint8_t SKELETON_FLOAT = 4;
+constexpr uint8_t SKELETON_STR = 5;
+constexpr uint8_t SKELETON_LIST = 6;
+constexpr uint8_t SKELETON_TUPLE = 7;
+constexpr uint8_t SKELETON_DICT = 8;
+constexpr uint8_t SKELETON_TENSOR = 9;
+
+// Deeper trees are rejected rather than overflowing the stack
+constexpr int MAX_SKELETON_DEPTH = 256;
+
+// Encodes the value at a path of the state dict. Tensors are looked up by path in
+// index (path -> index entry, whose first field is the key ID) and leaves in
+// scalars (path -> value), which holds the scalars of the snapshot being served,
+// if any.
+class SkeletonEncoder {
+public:
+    SkeletonEncoder(py::dict index, py::dict scalars) : index_(std::move(index)), scalars_(std::move(scalars)) {}
+
+    std::string encode(py::handle value, std::string path) {
+        out_.clear();
+        encode_node(value, path, 0);
+        return std::move(out_);
+    }
+
+private:
+    template <typename T>
+    void put(T value) {
+        out_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    void put_count(size_t count, const std::string& path) {
+        TORCH_CHECK(count <= UINT32_MAX, "Too many items at ", path);
+        put(static_cast<uint32_t>(count));
+    }
+
+    void encode_node(py::handle value, std::string& path, int depth) {
+        TORCH_CHECK(depth < MAX_SKELETON_DEPTH, "State dict is nested too deeply at ", path);
+        PyObject* object = value.ptr();
+
+        if (PyDict_Check(object)) {
+            put(SKELETON_DICT);
+            put_count(PyDict_Size(object), path);
+            PyObject* key;
+            PyObject* item;
+            Py_ssize_t position = 0;
+            size_t length = path.size();
+            while (PyDict_Next(object, &position, &key, &item)) {
+                encode_node(key, path, depth + 1);
+                path += "[" + py::str(key).cast<std::string>() + "]";
+                encode_node(item, path, depth + 1);
+                path.resize(length);
+            }
+            return;
+        }
+        if (PyList_Check(object) || PyTuple_Check(object)) {
+            put(PyList_Check(object) ? SKELETON_LIST : SKELETON_TUPLE);
+            py::sequence items = py::reinterpret_borrow<py::sequence>(value);
+            size_t count = items.size();
+            put_count(count, path);
+            size_t length = path.size();
+            for (size_t i = 0; i < count; ++i) {
+                path += "[" + std::to_string(i) + "]";
+                encode_node(items[i], path, depth + 1);
+                path.resize(length);
+            }
+            return;
+        }
+
+        py::str key(path);
+        if (index_.contains(key)) {
+            put(SKELETON_TENSOR);
+            put(index_[key].cast<py::tuple>()[0].cast<int64_t>());
+            return;
+        }
+        // Leaves are served as of the snapshot, like scalar requests
+        py::object leaf = scalars_.contains(key) ? scalars_[key] : py::reinterpret_borrow<py::object>(value);
+        object = leaf.ptr();
+        if (object == Py_None) {
+            put(SKELETON_NONE);
+        } else if (PyBool_Check(object)) {
+            put(object == Py_True ? SKELETON_TRUE : SKELETON_FALSE);
+        } else if (PyLong_Check(object)) {
+            int overflow = 0;
+            long long number = PyLong_AsLongLongAndOverflow(object, &overflow);
+            TORCH_CHECK(overflow == 0, "Integer at ", path, " doesn't fit in 64 bits");
+            put(SKELETON_INT);
+            put(static_cast<int64_t>(number));
+        } else if (PyFloat_Check(object)) {
+            put(SKELETON_FLOAT);
+            put(PyFloat_AsDouble(object));
+        } else if (PyUnicode_Check(object)) {
+            Py_ssize_t size;
+            const char* data = PyUnicode_AsUTF8AndSize(object, &size);
+            if (data == nullptr) {
+                throw py::error_already_set();
+            }
+            put(SKELETON_STR);
+            put_count(size, path);
+            out_.append(data, size);
+        } else {
+            // Tensors added since the last refresh_index() aren't indexed either
+            TORCH_CHECK(false, "Value at ", path, " of type ", Py_TYPE(object)->tp_name, " can't be encoded");
+        }
+    }
+
+    py::dict index_;
+    py::dict scalars_;
+    std::string out_;
+};
+
+// Rebuilds a tree encoded by SkeletonEncoder, putting in the tensor of every
+// reference from tensors (key ID -> tensor). Without tensors, only the key IDs of
+// the references are collected.
+class SkeletonDecoder {
+public:
+    SkeletonDecoder(const std::string& data, py::object tensors)
+        : data_(data), with_tensors_(!tensors.is_none()) {
+        if (with_tensors_) {
+            tensors_ = tensors.cast<py::dict>();
+        }
+    }
+
+    py::object decode() {
+        offset_ = 0;
+        py::object value = decode_node(0);
+        TORCH_CHECK(offset_ == data_.size(), "Trailing bytes after the skeleton");
+        return value;
+    }
+
+    // Key IDs of the references, in order of appearance
+    const std::vector<int64_t>& key_ids() const {
+        return key_ids_;
+    }
+
+private:
+    template <typename T>
+    T take() {
+        TORCH_CHECK(data_.size() - offset_ >= sizeof(T), "Truncated skeleton");
+        T value;
+        std::memcpy(&value, data_.data() + offset_, sizeof(T));
+        offset_ += sizeof(T);
+        return value;
+    }
+
+    py::object decode_node(int depth) {
+        TORCH_CHECK(depth < MAX_SKELETON_DEPTH, "Skeleton is nested too deeply");
+        uint8_t tag = take<uint8_t>();
+        switch (tag) {
+            case SKELETON_NONE:
+                return py::none();
+            case SKELETON_FALSE:
+                return py::bool_(false);
+            case SKELETON_TRUE:
+                return py::bool_(true);
+            case SKELETON_INT:
+                return py::int_(take<int64_t>());
+            case SKELETON_FLOAT:
+                return py::float_(take<double>());
+            case SKELETON_STR: {
+                uint32_t size = take<uint32_t>();
+                TORCH_CHECK(data_.size() - offset_ >= size, "Truncated skeleton");
+                py::str value(data_.data() + offset_, size);
+                offset_ += size;
+                return value;
+            }
+            case SKELETON_LIST: {
+                uint32_t count = take<uint32_t>();
+                py::list value;
+                for (uint32_t i = 0; i < count; ++i) {
+                    value.append(decode_node(depth + 1));
+                }
+                return value;
+            }
+            case SKELETON_TUPLE: {
+                uint32_t count = take<uint32_t>();
+                // Every item takes at least its tag byte
+                TORCH_CHECK(data_.size() - offset_ >= count, "Truncated skeleton");
+                py::tuple value(count);
+                for (uint32_t i = 0; i < count; ++i) {
+                    value[i] = decode_node(depth + 1);
+                }
+                return value;
+            }
+            case SKELETON_DICT: {
+                uint32_t count = take<uint32_t>();
+                py::dict value;
+                for (uint32_t i = 0; i < count; ++i) {
+                    py::object key = decode_node(depth + 1);
+                    value[key] = decode_node(depth + 1);
+                }
+                return value;
+            }
+            case SKELETON_TENSOR: {
+                int64_t key_id = take<int64_t>();
+                key_ids_.push_back(key_id);
+                if (!with_tensors_) {
+                    return py::none();
+                }
+                py::int_ key(key_id);
+                TORCH_CHECK(tensors_.contains(key), "No tensor for key ID ", key_id);
+                return tensors_[key];
+            }
+            default:
+                TORCH_CHECK(false, "Unknown skeleton tag ", static_cast<int>(tag));
+        }
+    }
+
+    const std::string& data_;
+    bool with_tensors_;
+    py::dict tensors_;
+    size_t offset_ = 0;
+    std::vector<int64_t> key_ids_;
+};
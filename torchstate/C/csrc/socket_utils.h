@@ -0,0 +1,126 @@
+#pragma once
+
+#include <torch/extension.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+constexpr int SOCKET_BUFFER_SIZE = 4 * 1024 * 1024;
+
+// Large kernel buffers and no Nagle delay
+inline void optimize_socket(int sock) {
+    int buffer_size = SOCKET_BUFFER_SIZE;
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+
+    int flag = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+}
+
+// Steady clock time in nanoseconds, the clock of time.monotonic_ns() on Linux
+inline int64_t monotonic_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Block until the socket is ready for the requested events. Only needed when the
+// caller handed us a non-blocking fd (e.g. a Python socket with a timeout set).
+// With a deadline (a monotonic_ns() time), fails once it passes.
+inline void wait_for_socket(int fd, short events, int64_t deadline_ns = -1) {
+    pollfd pfd{fd, events, 0};
+    while (true) {
+        int timeout_ms = -1;
+        if (deadline_ns >= 0) {
+            int64_t remaining_ns = deadline_ns - monotonic_ns();
+            TORCH_CHECK(remaining_ns > 0, "Timed out waiting for the socket");
+            timeout_ms = static_cast<int>(std::min<int64_t>((remaining_ns + 999999) / 1000000, INT32_MAX));
+        }
+        int ready = poll(&pfd, 1, timeout_ms);
+        if (ready > 0) {
+            return;
+        }
+        TORCH_CHECK(ready == 0 || errno == EINTR, "poll failed: ", std::strerror(errno));
+    }
+}
+
+// What a send reports for the server metrics
+struct SendStats {
+    // When the first byte went out, -1 until then
+    int64_t first_byte_ns = -1;
+    // Payload bytes as sent, after encoding
+    int64_t nbytes = 0;
+    // Time spent casting, quantizing or compressing, summed over the threads
+    // doing it, and whether anything was
+    int64_t encode_ns = 0;
+    bool encoded = false;
+    // Times the socket buffer was full, and the time spent waiting for it to drain
+    int64_t stalls = 0;
+    int64_t stall_ns = 0;
+    // Time frames were held back by the scheduler
+    int64_t throttle_ns = 0;
+};
+
+// Write all iovecs to the socket, resuming after partial writes. With stats,
+// sendmsg doesn't block, so that waiting for a full socket buffer is measured.
+inline void sendmsg_all(int fd, iovec* iov, int iovcnt, SendStats* stats = nullptr) {
+    int flags = MSG_NOSIGNAL | (stats != nullptr ? MSG_DONTWAIT : 0);
+    while (iovcnt > 0) {
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t sent = sendmsg(fd, &msg, flags);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                int64_t begin = stats != nullptr ? monotonic_ns() : 0;
+                wait_for_socket(fd, POLLOUT);
+                if (stats != nullptr) {
+                    ++stats->stalls;
+                    stats->stall_ns += monotonic_ns() - begin;
+                }
+                continue;
+            }
+            TORCH_CHECK(false, "sendmsg failed: ", std::strerror(errno));
+        }
+        if (stats != nullptr && stats->first_byte_ns < 0 && sent > 0) {
+            stats->first_byte_ns = monotonic_ns();
+        }
+        // Skip over the iovecs that were fully written
+        size_t remaining = static_cast<size_t>(sent);
+        while (iovcnt > 0 && remaining >= iov->iov_len) {
+            remaining -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + remaining;
+            iov->iov_len -= remaining;
+        }
+    }
+}
+
+// Read exactly len bytes from the socket into buf. With a deadline (a
+// monotonic_ns() time), recv never blocks, and reading fails once it passes.
+inline void recv_all(int fd, char* buf, size_t len, int64_t deadline_ns = -1) {
+    int flags = deadline_ns >= 0 ? MSG_DONTWAIT : MSG_WAITALL;
+    while (len > 0) {
+        ssize_t received = recv(fd, buf, len, flags);
+        if (received < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                wait_for_socket(fd, POLLIN, deadline_ns);
+                continue;
+            }
+            TORCH_CHECK(false, "recv failed: ", std::strerror(errno));
+        }
+        TORCH_CHECK(received > 0, "Connection closed before receiving all data");
+        buf += received;
+        len -= received;
+    }
+}
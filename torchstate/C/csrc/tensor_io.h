@@ -0,0 +1,831 @@
+#pragma once
+
+#include <torch/extension.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <optional>
+#include <string>
+#include <vector>
+#include "cast.h"
+#include "codec.h"
+#include "helper_pool.h"
+#include "quantize.h"
+#include "scheduler.h"
+#include "socket_utils.h"
+
+#ifdef WITH_CUDA
+#include <ATen/cuda/CUDAEvent.h>
+#include <c10/cuda/CUDAGuard.h>
+#include <c10/cuda/CUDAStream.h>
+#endif
+
+constexpr int64_t DEFAULT_CHUNK_SIZE = 4 * 1024 * 1024;
+
+// Transfer types, mirroring TransferType in ttype_consts.py
+constexpr int32_t TTYPE_FLOAT32 = 4;
+constexpr int32_t TTYPE_BFLOAT16 = 5;
+constexpr int32_t TTYPE_FLOAT16 = 6;
+constexpr int32_t TTYPE_UNIFORM_INT8 = 7;
+constexpr int32_t TTYPE_SHUFFLE_ZSTD = 8;
+constexpr int32_t TTYPE_SHUFFLE_LZ4 = 9;
+
+// The lossless transfer types send the elements in the dtype of the tensor,
+// byte-shuffled and compressed frame by frame
+inline bool is_compressed(int32_t transfer_type) {
+    return transfer_type == TTYPE_SHUFFLE_ZSTD || transfer_type == TTYPE_SHUFFLE_LZ4;
+}
+
+// Transfer types this build can encode, the lossless ones only with the codecs
+inline bool is_transfer_type(int32_t transfer_type) {
+    return transfer_type >= TTYPE_FLOAT32 && transfer_type <= TTYPE_SHUFFLE_LZ4
+        && (CODECS_AVAILABLE || !is_compressed(transfer_type));
+}
+
+inline Codec frame_codec(int32_t transfer_type) {
+    return transfer_type == TTYPE_SHUFFLE_LZ4 ? Codec::LZ4 : Codec::ZSTD;
+}
+
+// Dtypes are sent as their index in DTYPE_CODES in ttype_consts.py, -1 if not listed
+inline int32_t dtype_code(c10::ScalarType type) {
+    switch (type) {
+        case torch::kFloat32: return 0;
+        case torch::kBFloat16: return 1;
+        case torch::kFloat16: return 2;
+        case torch::kFloat64: return 3;
+        case torch::kInt64: return 4;
+        case torch::kInt32: return 5;
+        case torch::kInt16: return 6;
+        case torch::kInt8: return 7;
+        case torch::kUInt8: return 8;
+        case torch::kBool: return 9;
+        default: return -1;
+    }
+}
+
+inline c10::ScalarType dtype_from_code(int32_t code) {
+    static const c10::ScalarType types[] = {
+        torch::kFloat32, torch::kBFloat16, torch::kFloat16, torch::kFloat64, torch::kInt64,
+        torch::kInt32, torch::kInt16, torch::kInt8, torch::kUInt8, torch::kBool,
+    };
+    TORCH_CHECK(code >= 0 && code < static_cast<int32_t>(sizeof(types) / sizeof(types[0])),
+                "Unknown dtype code ", code);
+    return types[code];
+}
+
+// A tensor payload is sent as a sequence of frames, each this header followed by
+// nbytes of data holding numel elements. Neither side ever needs more than one
+// chunk of extra memory, whatever the size of the tensor. UNIFORM_INT8 frames start
+// with the fp32 codebook of their block, followed by one code per element.
+// Compressed frames start with a CodecHeader, followed by the compressed elements.
+struct FrameHeader {
+    int64_t nbytes;
+    int64_t numel;
+};
+static_assert(sizeof(FrameHeader) == 16, "Frame header must be 16 bytes ('qq')");
+
+struct CodecHeader {
+    // Dtype of the compressed elements, which is the dtype of the sent tensor
+    int32_t dtype_code;
+    // Whether the elements were byte-shuffled before compressing
+    int32_t shuffled;
+};
+static_assert(sizeof(CodecHeader) == 8, "Codec header must be 8 bytes ('ii')");
+
+// The scalar type a transfer type puts on the wire
+inline c10::ScalarType wire_scalar_type(int32_t transfer_type) {
+    switch (transfer_type) {
+        case TTYPE_FLOAT32:
+            return torch::kFloat32;
+        case TTYPE_BFLOAT16:
+            return torch::kBFloat16;
+        case TTYPE_FLOAT16:
+            return torch::kFloat16;
+        case TTYPE_UNIFORM_INT8:
+            return torch::kUInt8;
+        default:
+            TORCH_CHECK(false, "Unsupported transfer type: ", transfer_type);
+    }
+}
+
+// Whether tensors on this device can be streamed directly
+inline bool is_streamable_device(const c10::Device& device) {
+#ifdef WITH_CUDA
+    return device.is_cpu() || device.is_cuda();
+#else
+    return device.is_cpu();
+#endif
+}
+
+// Bytes of codebook at the start of every frame of a transfer type
+inline int64_t frame_codebook_bytes(int32_t transfer_type) {
+    return transfer_type == TTYPE_UNIFORM_INT8 ? CODEBOOK_ENTRIES * sizeof(float) : 0;
+}
+
+// Convert numel elements between scalar types. The fp32 <-> bf16/fp16 pairs used
+// for transfers go through the SIMD kernels, anything else through ATen.
+inline void cast_elements(
+    const void* src, c10::ScalarType src_type, void* dst, c10::ScalarType dst_type, int64_t numel
+) {
+    if (src_type == dst_type) {
+        std::memcpy(dst, src, numel * c10::elementSize(src_type));
+    } else if (src_type == torch::kFloat32 && dst_type == torch::kBFloat16) {
+        fp32_to_bf16(static_cast<const float*>(src), static_cast<uint16_t*>(dst), numel);
+    } else if (src_type == torch::kBFloat16 && dst_type == torch::kFloat32) {
+        bf16_to_fp32(static_cast<const uint16_t*>(src), static_cast<float*>(dst), numel);
+    } else if (src_type == torch::kFloat32 && dst_type == torch::kFloat16 && cpu_features().f16c) {
+        fp32_to_fp16_f16c(static_cast<const float*>(src), static_cast<uint16_t*>(dst), numel);
+    } else if (src_type == torch::kFloat16 && dst_type == torch::kFloat32 && cpu_features().f16c) {
+        fp16_to_fp32_f16c(static_cast<const uint16_t*>(src), static_cast<float*>(dst), numel);
+    } else {
+        torch::Tensor src_view = torch::from_blob(const_cast<void*>(src), {numel}, torch::TensorOptions(src_type));
+        torch::Tensor dst_view = torch::from_blob(dst, {numel}, torch::TensorOptions(dst_type));
+        dst_view.copy_(src_view);
+    }
+}
+
+// Element addressing of a strided tensor in row-major order, used to gather runs
+// of elements out of a non-contiguous tensor and to scatter them back into one
+// without a full contiguous copy. Size one dimensions are dropped and dimensions
+// laid out contiguously with respect to each other are merged, so the innermost
+// runs are as long as the layout allows.
+class StridedLayout {
+public:
+    StridedLayout(const torch::Tensor& tensor) : elem_size_(tensor.element_size()) {
+        for (int64_t d = 0; d < tensor.dim(); ++d) {
+            if (tensor.size(d) == 1) {
+                continue;
+            }
+            if (!sizes_.empty() && strides_.back() == tensor.stride(d) * tensor.size(d)) {
+                sizes_.back() *= tensor.size(d);
+                strides_.back() = tensor.stride(d);
+            } else {
+                sizes_.push_back(tensor.size(d));
+                strides_.push_back(tensor.stride(d));
+            }
+        }
+        if (sizes_.empty()) {
+            sizes_.push_back(1);
+            strides_.push_back(1);
+        }
+    }
+
+    // Copy elements [start, start + n) of the tensor at base into dst
+    void gather(const char* base, int64_t start, int64_t n, char* dst) const {
+        visit(start, n, [&](int64_t offset, int64_t stride, int64_t run, int64_t pos) {
+            copy_run(base + offset * elem_size_, stride, dst + pos * elem_size_, 1, run);
+        });
+    }
+
+    // Copy n elements from src into elements [start, start + n) of the tensor at base
+    void scatter(const char* src, int64_t start, int64_t n, char* base) const {
+        visit(start, n, [&](int64_t offset, int64_t stride, int64_t run, int64_t pos) {
+            copy_run(src + pos * elem_size_, 1, base + offset * elem_size_, stride, run);
+        });
+    }
+
+private:
+    // Call fn(element offset, inner stride, run length, position) for every run of
+    // elements along the innermost dimension
+    template <typename Fn>
+    void visit(int64_t start, int64_t n, Fn&& fn) const {
+        int64_t ndim = sizes_.size();
+        std::vector<int64_t> index(ndim);
+        for (int64_t d = ndim - 1, rest = start; d >= 0; --d) {
+            index[d] = rest % sizes_[d];
+            rest /= sizes_[d];
+        }
+
+        for (int64_t pos = 0; pos < n;) {
+            int64_t offset = 0;
+            for (int64_t d = 0; d < ndim; ++d) {
+                offset += index[d] * strides_[d];
+            }
+            int64_t run = std::min(sizes_[ndim - 1] - index[ndim - 1], n - pos);
+            fn(offset, strides_[ndim - 1], run, pos);
+            pos += run;
+
+            index[ndim - 1] += run;
+            for (int64_t d = ndim - 1; d > 0 && index[d] == sizes_[d]; --d) {
+                index[d] = 0;
+                ++index[d - 1];
+            }
+        }
+    }
+
+    template <typename T>
+    static void copy_elements(const char* src, int64_t src_stride, char* dst, int64_t dst_stride, int64_t n) {
+        const T* s = reinterpret_cast<const T*>(src);
+        T* d = reinterpret_cast<T*>(dst);
+        for (int64_t i = 0; i < n; ++i) {
+            d[i * dst_stride] = s[i * src_stride];
+        }
+    }
+
+    void copy_run(const char* src, int64_t src_stride, char* dst, int64_t dst_stride, int64_t n) const {
+        if (src_stride == 1 && dst_stride == 1) {
+            std::memcpy(dst, src, n * elem_size_);
+            return;
+        }
+        switch (elem_size_) {
+            case 1: copy_elements<uint8_t>(src, src_stride, dst, dst_stride, n); break;
+            case 2: copy_elements<uint16_t>(src, src_stride, dst, dst_stride, n); break;
+            case 4: copy_elements<uint32_t>(src, src_stride, dst, dst_stride, n); break;
+            case 8: copy_elements<uint64_t>(src, src_stride, dst, dst_stride, n); break;
+            default:
+                for (int64_t i = 0; i < n; ++i) {
+                    std::memcpy(dst + i * dst_stride * elem_size_, src + i * src_stride * elem_size_, elem_size_);
+                }
+        }
+    }
+
+    std::vector<int64_t> sizes_;
+    std::vector<int64_t> strides_;
+    int64_t elem_size_;
+};
+
+// Splits elements [start, start + count) of a tensor, in row-major order, into
+// runs of elements. A count of -1 reads up to the end. Contiguous CPU tensors are
+// read in place, non-contiguous ones are gathered element block by element block.
+// CUDA tensors are copied out on a dedicated stream, slab by slab along the first
+// dimension if they aren't contiguous. Anything not read in place goes to a caller
+// provided staging buffer allocated with staging_options().
+class ChunkReader {
+public:
+    ChunkReader(const torch::Tensor& tensor, int64_t chunk_numel, int64_t start = 0, int64_t count = -1)
+        : tensor_(tensor), start_(start) {
+        chunk_numel = std::max<int64_t>(1, chunk_numel);
+        int64_t numel = tensor.numel();
+        count_ = count < 0 ? numel - start : count;
+        TORCH_CHECK(start >= 0 && count_ >= 0 && start + count_ <= numel,
+                    "Element range [", start, ", ", start + count_, ") out of bounds for ", numel, " elements");
+        TORCH_CHECK(is_streamable_device(tensor.device()), "Can't stream tensors on ", tensor.device());
+
+        if (!tensor.is_contiguous() && !tensor.device().is_cpu() && count_ < numel) {
+            // Slabs can't describe an arbitrary element range, flatten on the device instead
+            tensor_ = tensor.reshape({-1}).narrow(0, start, count_);
+            start_ = 0;
+        }
+        if (tensor_.is_contiguous() || count_ == 0 || tensor_.device().is_cpu()) {
+            chunk_numel_ = chunk_numel;
+            num_chunks_ = (count_ + chunk_numel - 1) / chunk_numel;
+            if (!tensor_.is_contiguous() && count_ > 0) {
+                layout_.emplace(tensor_);
+            }
+        } else {
+            row_numel_ = numel / tensor.size(0);
+            rows_per_chunk_ = std::max<int64_t>(1, chunk_numel / row_numel_);
+            chunk_numel_ = rows_per_chunk_ * row_numel_;
+            num_chunks_ = (tensor.size(0) + rows_per_chunk_ - 1) / rows_per_chunk_;
+        }
+
+#ifdef WITH_CUDA
+        if (tensor.is_cuda()) {
+            // Copy on a side stream so the training stream never waits on the network,
+            // but only after the work already queued on the current stream
+            copy_stream_ = c10::cuda::getStreamFromPool(false, tensor.device().index());
+            at::cuda::CUDAEvent ready;
+            ready.record(c10::cuda::getCurrentCUDAStream(tensor.device().index()));
+            ready.block(*copy_stream_);
+        }
+#endif
+    }
+
+    int64_t num_chunks() const { return num_chunks_; }
+
+    // Largest number of elements in one chunk, i.e. the staging buffer size needed
+    int64_t max_chunk_numel() const { return chunk_numel_; }
+
+    // Whether read() needs a staging buffer
+    bool needs_staging() const { return layout_ || rows_per_chunk_ > 0 || !tensor_.device().is_cpu(); }
+
+    // Staging buffers are pinned host memory when reading from a device
+    torch::TensorOptions staging_options() const {
+        return tensor_.options().device(torch::kCPU).pinned_memory(!tensor_.device().is_cpu());
+    }
+
+    // Pointer to the elements of chunk k. numel is set to the number of elements.
+    const char* read(int64_t k, const torch::Tensor& staging, int64_t* numel) const {
+        torch::Tensor chunk;
+        if (rows_per_chunk_ == 0) {
+            int64_t start = start_ + k * chunk_numel_;
+            *numel = std::min(chunk_numel_, start_ + count_ - start);
+            if (layout_) {
+                char* dst = static_cast<char*>(staging.data_ptr());
+                layout_->gather(static_cast<const char*>(tensor_.data_ptr()), start, *numel, dst);
+                return dst;
+            }
+            if (tensor_.device().is_cpu()) {
+                return static_cast<const char*>(tensor_.data_ptr()) + start * tensor_.element_size();
+            }
+            chunk = tensor_.view({-1}).narrow(0, start, *numel);
+        } else {
+            int64_t row = k * rows_per_chunk_;
+            chunk = tensor_.narrow(0, row, std::min(rows_per_chunk_, tensor_.size(0) - row));
+            *numel = chunk.numel();
+        }
+
+        torch::Tensor dst = staging.narrow(0, 0, *numel).view(chunk.sizes());
+#ifdef WITH_CUDA
+        if (copy_stream_) {
+            c10::cuda::CUDAStreamGuard guard(*copy_stream_);
+            dst.copy_(chunk, /*non_blocking=*/true);
+            copy_stream_->synchronize();
+            return static_cast<const char*>(staging.data_ptr());
+        }
+#endif
+        dst.copy_(chunk);
+        return static_cast<const char*>(staging.data_ptr());
+    }
+
+private:
+    torch::Tensor tensor_;
+    int64_t start_ = 0;
+    int64_t count_ = 0;
+    int64_t chunk_numel_ = 0;
+    int64_t num_chunks_ = 0;
+    int64_t row_numel_ = 0;
+    int64_t rows_per_chunk_ = 0;
+    std::optional<StridedLayout> layout_;
+#ifdef WITH_CUDA
+    std::optional<c10::cuda::CUDAStream> copy_stream_;
+#endif
+};
+
+// A frame ready to be sent
+struct EncodedChunk {
+    const char* data;
+    int64_t numel;
+    int64_t nbytes;
+};
+
+// Encode elements [start, start + count) of the tensor (all of it by default) into
+// payload frames, converted to the scalar type of transfer_type (or quantized for
+// UNIFORM_INT8, or shuffled and compressed for the lossless types), passing every
+// frame to emit as soon as it is ready. The data of a frame is valid until emit
+// returns.
+//
+// When chunks need gathering, copying off the device or encoding, chunk k+1 is
+// prepared on the helper pool while chunk k is being emitted, alternating between
+// two sets of staging buffers. Compression is slower than the link, so up to
+// codec_slots() chunks are compressed ahead at once instead. With stats, the time
+// spent encoding is measured.
+template <typename Emit>
+inline void encode_tensor_frames(
+    const torch::Tensor& tensor, int32_t transfer_type, int64_t chunk_size, int64_t start, int64_t count,
+    Emit&& emit, SendStats* stats = nullptr
+) {
+    TORCH_CHECK(chunk_size > 0, "chunk_size must be positive");
+
+    c10::ScalarType src_type = tensor.scalar_type();
+    bool compressed = is_compressed(transfer_type);
+    c10::ScalarType wire_type = compressed ? src_type : wire_scalar_type(transfer_type);
+    int64_t wire_elem_size = c10::elementSize(wire_type);
+    int64_t codebook_size = frame_codebook_bytes(transfer_type);
+    bool quantize = codebook_size > 0;
+    bool cast = !quantize && src_type != wire_type;
+    bool shuffle = compressed && is_shuffled(wire_elem_size);
+
+    // Quantization works on fp32, so other dtypes are converted first
+    int64_t max_elem_size = std::max<int64_t>(tensor.element_size(), quantize ? sizeof(float) : wire_elem_size);
+    ChunkReader reader(tensor, chunk_size / max_elem_size, start, count);
+
+    if (!cast && !quantize && !compressed && !reader.needs_staging()) {
+        for (int64_t k = 0; k < reader.num_chunks(); ++k) {
+            int64_t numel;
+            const char* data = reader.read(k, torch::Tensor(), &numel);
+            emit({data, numel, numel * wire_elem_size});
+        }
+    } else {
+        int num_slots = compressed ? codec_slots() : 2;
+        int64_t staging_numel = reader.max_chunk_numel();
+        int64_t encoded_size = compressed
+            ? sizeof(CodecHeader) + compress_bound(frame_codec(transfer_type), staging_numel * wire_elem_size)
+            : codebook_size + staging_numel * wire_elem_size;
+        bool to_float = quantize && src_type != torch::kFloat32;
+        std::vector<torch::Tensor> gathered(num_slots);
+        std::vector<torch::Tensor> floats(num_slots);
+        std::vector<torch::Tensor> shuffled(num_slots);
+        std::vector<torch::Tensor> encoded(num_slots);
+        for (int slot = 0; slot < num_slots; ++slot) {
+            if (reader.needs_staging()) {
+                gathered[slot] = torch::empty({staging_numel}, reader.staging_options());
+            }
+            if (to_float) {
+                floats[slot] = torch::empty({staging_numel}, torch::TensorOptions(torch::kFloat32));
+            }
+            if (shuffle) {
+                shuffled[slot] = torch::empty({staging_numel * wire_elem_size}, torch::TensorOptions(torch::kUInt8));
+            }
+            if (cast || quantize || compressed) {
+                encoded[slot] = torch::empty({encoded_size}, torch::TensorOptions(torch::kUInt8));
+            }
+        }
+
+        // Summed over the encoding threads
+        std::atomic<int64_t> encode_ns{0};
+        bool timed = stats != nullptr && (cast || quantize || compressed);
+        auto encode_chunk = [&](int64_t numel, const char* data, int slot) -> EncodedChunk {
+            char* out = static_cast<char*>(encoded[slot].data_ptr());
+            if (compressed) {
+                if (shuffle) {
+                    byte_shuffle(data, numel, wire_elem_size, shuffled[slot].data_ptr());
+                    data = static_cast<const char*>(shuffled[slot].data_ptr());
+                }
+                CodecHeader codec_header{dtype_code(wire_type), shuffle};
+                std::memcpy(out, &codec_header, sizeof(codec_header));
+                int64_t size = compress(frame_codec(transfer_type), data, numel * wire_elem_size,
+                                        out + sizeof(codec_header), encoded_size - sizeof(codec_header));
+                return {out, numel, static_cast<int64_t>(sizeof(codec_header)) + size};
+            }
+            if (quantize) {
+                if (to_float) {
+                    cast_elements(data, src_type, floats[slot].data_ptr(), torch::kFloat32, numel);
+                    data = static_cast<const char*>(floats[slot].data_ptr());
+                }
+                quantize_uniform_int8(reinterpret_cast<const float*>(data), numel,
+                                      reinterpret_cast<float*>(out), reinterpret_cast<uint8_t*>(out + codebook_size));
+                return {out, numel, codebook_size + numel * wire_elem_size};
+            }
+            if (cast) {
+                cast_elements(data, src_type, out, wire_type, numel);
+                return {out, numel, numel * wire_elem_size};
+            }
+            return {data, numel, numel * wire_elem_size};
+        };
+        auto encode = [&](int64_t k, int slot) -> EncodedChunk {
+            int64_t numel;
+            const char* data = reader.read(k, gathered[slot], &numel);
+            if (!timed) {
+                return encode_chunk(numel, data, slot);
+            }
+            int64_t begin = monotonic_ns();
+            EncodedChunk chunk = encode_chunk(numel, data, slot);
+            encode_ns.fetch_add(monotonic_ns() - begin, std::memory_order_relaxed);
+            return chunk;
+        };
+
+        // Declared after the buffers so pending encodes finish before they are freed.
+        // Chunk k is encoded in slot k % num_slots, which was last used by a chunk
+        // that has already been sent.
+        std::deque<HelperFuture<EncodedChunk>> next;
+        int64_t launched = 0;
+        auto launch = [&] {
+            int slot = static_cast<int>(launched % num_slots);
+            next.push_back(helper_pool().submit([&encode, k = launched, slot] { return encode(k, slot); }));
+            ++launched;
+        };
+        while (launched < std::min<int64_t>(num_slots - 1, reader.num_chunks())) {
+            launch();
+        }
+        for (int64_t k = 0; k < reader.num_chunks(); ++k) {
+            EncodedChunk chunk = next.front().get();
+            next.pop_front();
+            if (launched < reader.num_chunks()) {
+                launch();
+            }
+            emit(chunk);
+        }
+        if (timed) {
+            stats->encode_ns += encode_ns.load();
+            stats->encoded = true;
+        }
+    }
+
+}
+
+// Wait for the turn of nbytes with pacer, measuring how long it is held back
+inline void pace(const Pacer& pacer, int64_t nbytes, SendStats* stats) {
+    if (stats != nullptr && pacer.scheduler != nullptr && pacer.scheduler->active()) {
+        int64_t begin = monotonic_ns();
+        pacer.acquire(nbytes);
+        stats->throttle_ns += monotonic_ns() - begin;
+    } else {
+        pacer.acquire(nbytes);
+    }
+}
+
+// Send header followed by the framed payload of elements [start, start + count) of
+// the tensor, encoded by encode_tensor_frames. The header goes out with the first
+// frame so small tensors need a single sendmsg.
+//
+// Every frame waits for its turn with pacer before it is sent. With stats, the
+// time to the first byte, encoding, socket stalls and pacing are measured.
+inline void send_tensor_frames(
+    int fd, const torch::Tensor& tensor, const std::string& header, int32_t transfer_type, int64_t chunk_size,
+    int64_t start = 0, int64_t count = -1, const Pacer& pacer = Pacer{}, SendStats* stats = nullptr
+) {
+    std::string pending = header;
+    auto send_frame = [&](const EncodedChunk& chunk) {
+        FrameHeader frame{chunk.nbytes, chunk.numel};
+        pace(pacer, frame.nbytes, stats);
+        iovec iov[3] = {
+            {const_cast<char*>(pending.data()), pending.size()},
+            {&frame, sizeof(frame)},
+            {const_cast<char*>(chunk.data), static_cast<size_t>(frame.nbytes)},
+        };
+        sendmsg_all(fd, iov, 3, stats);
+        pending.clear();
+        if (stats != nullptr) {
+            stats->nbytes += frame.nbytes;
+        }
+    };
+
+    encode_tensor_frames(tensor, transfer_type, chunk_size, start, count, send_frame, stats);
+
+    if (!pending.empty()) {
+        iovec iov = {const_cast<char*>(pending.data()), pending.size()};
+        sendmsg_all(fd, &iov, 1, stats);
+    }
+}
+
+// Send header followed by nbytes of payload already encoded into frames, in
+// pieces of up to chunk_size bytes that each wait for their turn with pacer
+inline void send_encoded_payload(
+    int fd, const std::string& header, const char* data, int64_t nbytes, int64_t chunk_size,
+    const Pacer& pacer = Pacer{}, SendStats* stats = nullptr
+) {
+    TORCH_CHECK(chunk_size > 0, "chunk_size must be positive");
+    std::string pending = header;
+    int64_t offset = 0;
+    do {
+        int64_t size = std::min(chunk_size, nbytes - offset);
+        pace(pacer, size, stats);
+        iovec iov[2] = {
+            {const_cast<char*>(pending.data()), pending.size()},
+            {const_cast<char*>(data + offset), static_cast<size_t>(size)},
+        };
+        sendmsg_all(fd, iov, 2, stats);
+        pending.clear();
+        offset += size;
+        if (stats != nullptr) {
+            stats->nbytes += size;
+        }
+    } while (offset < nbytes);
+}
+
+// Decode numel elements of one frame into dst
+inline void decode_frame(
+    const char* frame, int32_t transfer_type, void* dst, c10::ScalarType dst_type, int64_t numel, float* floats
+) {
+    if (transfer_type != TTYPE_UNIFORM_INT8) {
+        cast_elements(frame, wire_scalar_type(transfer_type), dst, dst_type, numel);
+        return;
+    }
+    const float* codebook = reinterpret_cast<const float*>(frame);
+    const uint8_t* codes = reinterpret_cast<const uint8_t*>(frame + frame_codebook_bytes(transfer_type));
+    if (dst_type == torch::kFloat32) {
+        dequantize_int8(codebook, codes, numel, static_cast<float*>(dst));
+    } else {
+        dequantize_int8(codebook, codes, numel, floats);
+        cast_elements(floats, torch::kFloat32, dst, dst_type, numel);
+    }
+}
+
+// Check a received frame header against the elements still expected
+inline void check_frame(const FrameHeader& frame, int64_t remaining, int32_t transfer_type, int64_t wire_elem_size) {
+    bool valid = frame.numel > 0 && frame.numel <= remaining;
+    if (is_compressed(transfer_type)) {
+        // Bound by the widest dtype, the actual one is only known from the frame
+        valid = valid && frame.nbytes >= static_cast<int64_t>(sizeof(CodecHeader)) &&
+                frame.nbytes <= static_cast<int64_t>(sizeof(CodecHeader)) +
+                                    compress_bound(frame_codec(transfer_type), frame.numel * sizeof(int64_t));
+    } else {
+        valid = valid && frame.nbytes == frame_codebook_bytes(transfer_type) + frame.numel * wire_elem_size;
+    }
+    TORCH_CHECK(valid, "Invalid payload frame of ", frame.nbytes, " bytes for ", frame.numel, " elements");
+}
+
+// Dtype of the elements of a compressed frame
+inline c10::ScalarType compressed_frame_dtype(const char* frame) {
+    CodecHeader header;
+    std::memcpy(&header, frame, sizeof(header));
+    return dtype_from_code(header.dtype_code);
+}
+
+// Decompress the numel elements of a compressed frame of nbytes into out, in the
+// dtype given by compressed_frame_dtype(). Shuffled frames are decompressed into
+// the shuffled buffer first and unshuffled into out.
+inline void decompress_frame(
+    const char* frame, int64_t nbytes, int32_t transfer_type, int64_t numel, char* out, std::vector<char>& shuffled
+) {
+    CodecHeader header;
+    std::memcpy(&header, frame, sizeof(header));
+    int64_t elem_size = c10::elementSize(dtype_from_code(header.dtype_code));
+    const char* payload = frame + sizeof(header);
+    int64_t payload_nbytes = nbytes - sizeof(header);
+    if (!header.shuffled) {
+        decompress(frame_codec(transfer_type), payload, payload_nbytes, out, numel * elem_size);
+        return;
+    }
+    TORCH_CHECK(is_shuffled(elem_size), "Can't unshuffle elements of ", elem_size, " bytes");
+    shuffled.resize(numel * elem_size);
+    decompress(frame_codec(transfer_type), payload, payload_nbytes, shuffled.data(), shuffled.size());
+    byte_unshuffle(shuffled.data(), numel, elem_size, out);
+}
+
+#ifdef WITH_CUDA
+// Receive a framed payload into a CUDA tensor. Frames land in two alternating
+// pinned buffers and are copied to the device on a side stream while the next
+// frame is being received. Upcasting and dequantizing run on the device, so the
+// host only ever touches the wire bytes. Compressed frames are decompressed on the
+// host, straight into the pinned buffer copied to the device.
+inline void recv_tensor_frames_cuda(int fd, const torch::Tensor& tensor, int32_t transfer_type, int64_t start, int64_t count) {
+    c10::cuda::CUDAGuard device_guard(tensor.device());
+    c10::cuda::CUDAStream current_stream = c10::cuda::getCurrentCUDAStream(tensor.device().index());
+    c10::cuda::CUDAStream copy_stream = c10::cuda::getStreamFromPool(false, tensor.device().index());
+
+    // Don't overwrite the tensor before the work already queued on it has run
+    at::cuda::CUDAEvent ready;
+    ready.record(current_stream);
+    ready.block(copy_stream);
+
+    torch::Tensor dst = tensor.is_contiguous() ? tensor.view({-1}).narrow(0, start, count)
+                                               : torch::empty({count}, tensor.options());
+    int64_t numel = count;
+    bool compressed = is_compressed(transfer_type);
+    c10::ScalarType wire_type = compressed ? tensor.scalar_type() : wire_scalar_type(transfer_type);
+    int64_t wire_elem_size = c10::elementSize(wire_type);
+    int64_t codebook_size = frame_codebook_bytes(transfer_type);
+
+    torch::Tensor staging[2];
+    torch::Tensor unpacked[2];
+    std::vector<char> shuffled;
+    at::cuda::CUDAEvent copied[2];
+    int64_t received = 0;
+    for (int slot = 0; received < numel; slot ^= 1) {
+        FrameHeader frame;
+        recv_all(fd, reinterpret_cast<char*>(&frame), sizeof(frame));
+        check_frame(frame, numel - received, transfer_type, wire_elem_size);
+
+        // Wait for the copy out of this slot two frames ago before reusing it
+        copied[slot].synchronize();
+        if (!staging[slot].defined() || staging[slot].numel() < frame.nbytes) {
+            staging[slot] = torch::empty({frame.nbytes}, torch::TensorOptions(torch::kUInt8).pinned_memory(true));
+        }
+        recv_all(fd, static_cast<char*>(staging[slot].data_ptr()), frame.nbytes);
+
+        torch::Tensor host_values;
+        if (compressed) {
+            const char* compressed_frame = static_cast<const char*>(staging[slot].data_ptr());
+            c10::ScalarType frame_type = compressed_frame_dtype(compressed_frame);
+            int64_t nbytes = frame.numel * c10::elementSize(frame_type);
+            if (!unpacked[slot].defined() || unpacked[slot].numel() < nbytes) {
+                unpacked[slot] = torch::empty({nbytes}, torch::TensorOptions(torch::kUInt8).pinned_memory(true));
+            }
+            decompress_frame(compressed_frame, frame.nbytes, transfer_type, frame.numel,
+                             static_cast<char*>(unpacked[slot].data_ptr()), shuffled);
+            host_values = unpacked[slot].narrow(0, 0, nbytes).view(frame_type);
+        } else {
+            host_values = staging[slot].narrow(0, codebook_size, frame.numel * wire_elem_size).view(wire_type);
+        }
+
+        {
+            c10::cuda::CUDAStreamGuard stream_guard(copy_stream);
+            torch::Tensor values = host_values.to(tensor.device(), /*non_blocking=*/true);
+            torch::Tensor out = dst.narrow(0, received, frame.numel);
+            if (codebook_size > 0) {
+                torch::Tensor codebook = staging[slot].narrow(0, 0, codebook_size)
+                                             .view(torch::kFloat32)
+                                             .to(tensor.device(), /*non_blocking=*/true);
+                out.copy_(codebook.index_select(0, values.to(torch::kInt64)));
+            } else {
+                out.copy_(values);
+            }
+            copied[slot].record(copy_stream);
+        }
+        received += frame.numel;
+    }
+
+    // Later work on the current stream sees the received values
+    at::cuda::CUDAEvent done;
+    done.record(copy_stream);
+    done.block(current_stream);
+    if (!tensor.is_contiguous()) {
+        if (count == tensor.numel()) {
+            tensor.copy_(dst.view(tensor.sizes()));
+        } else {
+            // Scatter the range through the storage offsets of its elements
+            torch::Tensor index = torch::arange(start, start + count, tensor.options().dtype(torch::kInt64));
+            torch::Tensor offsets = torch::zeros_like(index);
+            int64_t span = 1;
+            for (int64_t d = tensor.dim() - 1; d >= 0; --d) {
+                offsets += index.remainder(tensor.size(d)) * tensor.stride(d);
+                index = index.div(tensor.size(d), "floor");
+                span += (tensor.size(d) - 1) * tensor.stride(d);
+            }
+            tensor.as_strided({span}, {1}).index_copy_(0, offsets, dst);
+        }
+    }
+    // The pinned buffers are freed on return
+    copy_stream.synchronize();
+}
+#endif
+
+// Receive a framed tensor payload sent with the given transfer type. When the wire
+// type matches a contiguous tensor each frame lands directly at its offset in the
+// storage. Otherwise frames are received into alternating staging buffers and
+// decoded and/or scattered into place on the helper pool while the next frame is
+// being received. Compressed frames rotate through codec_slots() buffers, so that
+// many are decompressed at once, and are decompressed (and unshuffled) straight
+// into the tensor when their dtype matches it.
+inline void recv_tensor_frames(
+    int fd, const torch::Tensor& tensor, int32_t transfer_type, int64_t start = 0, int64_t count = -1
+) {
+    count = count < 0 ? tensor.numel() - start : count;
+    TORCH_CHECK(start >= 0 && start + count <= tensor.numel(),
+                "Element range [", start, ", ", start + count, ") out of bounds for ", tensor.numel(), " elements");
+#ifdef WITH_CUDA
+    if (tensor.is_cuda()) {
+        recv_tensor_frames_cuda(fd, tensor, transfer_type, start, count);
+        return;
+    }
+#endif
+    TORCH_CHECK(tensor.device().is_cpu(), "Can't receive into tensors on ", tensor.device());
+
+    c10::ScalarType dst_type = tensor.scalar_type();
+    int64_t elem_size = tensor.element_size();
+    int64_t numel = count;
+    bool compressed = is_compressed(transfer_type);
+    c10::ScalarType wire_type = compressed ? dst_type : wire_scalar_type(transfer_type);
+    int64_t wire_elem_size = c10::elementSize(wire_type);
+    int64_t codebook_size = frame_codebook_bytes(transfer_type);
+    bool decode = codebook_size > 0 || wire_type != dst_type;
+    std::optional<StridedLayout> layout;
+    char* data = static_cast<char*>(tensor.data_ptr());
+    if (!tensor.is_contiguous()) {
+        layout.emplace(tensor);
+    } else {
+        data += start * elem_size;
+    }
+
+    // Turn the frame in a slot into elements of the tensor dtype, at their place in
+    // the tensor or in decoded for scattering
+    struct Slot {
+        std::vector<char> staging;
+        std::vector<char> shuffled;
+        std::vector<char> unpacked;
+        std::vector<char> decoded;
+        std::vector<float> floats;
+        // Declared last so the task finishes before the buffers are freed
+        HelperFuture<void> pending;
+    };
+    auto decode_slot = [&](Slot& slot, int64_t offset, int64_t frame_numel) {
+        const char* values = slot.staging.data();
+        char* out = layout ? nullptr : data + offset * elem_size;
+        if (compressed) {
+            c10::ScalarType frame_type = compressed_frame_dtype(values);
+            char* unpacked = out;
+            if (frame_type != dst_type || layout) {
+                slot.unpacked.resize(frame_numel * c10::elementSize(frame_type));
+                unpacked = slot.unpacked.data();
+            }
+            decompress_frame(values, slot.staging.size(), transfer_type, frame_numel, unpacked, slot.shuffled);
+            values = unpacked;
+            if (frame_type != dst_type) {
+                slot.decoded.resize(layout ? frame_numel * elem_size : 0);
+                char* cast_out = layout ? slot.decoded.data() : out;
+                cast_elements(values, frame_type, cast_out, dst_type, frame_numel);
+                values = cast_out;
+            }
+        } else if (decode) {
+            slot.floats.resize(codebook_size > 0 ? frame_numel : 0);
+            slot.decoded.resize(layout ? frame_numel * elem_size : 0);
+            char* decode_out = layout ? slot.decoded.data() : out;
+            decode_frame(values, transfer_type, decode_out, dst_type, frame_numel, slot.floats.data());
+            values = decode_out;
+        }
+        if (layout) {
+            layout->scatter(values, start + offset, frame_numel, data);
+        }
+    };
+
+    int num_slots = compressed ? codec_slots() : 2;
+    std::vector<Slot> slots(num_slots);
+    int64_t received = 0;
+    for (int index = 0; received < numel; index = (index + 1) % num_slots) {
+        FrameHeader frame;
+        recv_all(fd, reinterpret_cast<char*>(&frame), sizeof(frame));
+        check_frame(frame, numel - received, transfer_type, wire_elem_size);
+
+        if (!compressed && !decode && !layout) {
+            recv_all(fd, data + received * elem_size, frame.nbytes);
+        } else {
+            Slot& slot = slots[index];
+            if (slot.pending.valid()) {
+                slot.pending.get();
+            }
+            slot.staging.resize(frame.nbytes);
+            recv_all(fd, slot.staging.data(), frame.nbytes);
+            slot.pending = helper_pool().submit([&decode_slot, &slot, offset = received, frame_numel = frame.numel] {
+                decode_slot(slot, offset, frame_numel);
+            });
+        }
+        received += frame.numel;
+    }
+    for (Slot& slot : slots) {
+        if (slot.pending.valid()) {
+            slot.pending.get();
+        }
+    }
+}
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <torch/extension.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+// Thin io_uring wrapper over the raw system calls, covering what the engine needs:
+// an SQ/CQ ring pair, batched submission, and a sparse table of registered buffers
+// that can be updated while requests are in flight. liburing isn't required.
+
+inline int io_uring_setup_syscall(unsigned entries, io_uring_params* params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+inline int io_uring_enter_syscall(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+inline int io_uring_register_syscall(int fd, unsigned opcode, const void* arg, unsigned nr_args) {
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+class IoUring {
+public:
+    // Throws if the kernel doesn't support io_uring or doesn't allow it
+    explicit IoUring(unsigned entries) {
+        io_uring_params params{};
+        // Completions are only reaped by the submitting thread, which needs no IPIs
+        params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+        fd_ = io_uring_setup_syscall(entries, &params);
+        if (fd_ < 0 && errno == EINVAL) {
+            params = io_uring_params{};
+            fd_ = io_uring_setup_syscall(entries, &params);
+        }
+        TORCH_CHECK(fd_ >= 0, "io_uring_setup failed: ", std::strerror(errno));
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+            close(fd_);
+            TORCH_CHECK(false, "io_uring needs kernel 5.4 or newer");
+        }
+
+        ring_size_ = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                              params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        ring_ = mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = static_cast<io_uring_sqe*>(
+            mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES));
+        if (ring_ == MAP_FAILED || sqes_ == MAP_FAILED) {
+            int err = errno;
+            unmap();
+            close(fd_);
+            TORCH_CHECK(false, "Mapping the io_uring rings failed: ", std::strerror(err));
+        }
+
+        char* ring = static_cast<char*>(ring_);
+        sq_head_ = reinterpret_cast<unsigned*>(ring + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned*>(ring + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned*>(ring + params.sq_off.ring_mask);
+        sq_entries_ = params.sq_entries;
+        sq_array_ = reinterpret_cast<unsigned*>(ring + params.sq_off.array);
+        cq_head_ = reinterpret_cast<unsigned*>(ring + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(ring + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned*>(ring + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(ring + params.cq_off.cqes);
+        // SQE i always sits at index i of the array
+        for (unsigned i = 0; i < sq_entries_; ++i) {
+            sq_array_[i] = i;
+        }
+    }
+
+    ~IoUring() {
+        unmap();
+        close(fd_);
+    }
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    // Next free SQE, cleared, submitting the queued ones first if the ring is full
+    io_uring_sqe* get_sqe() {
+        unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+        if (sq_local_tail_ - head >= sq_entries_) {
+            submit(0);
+            head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+            TORCH_CHECK(sq_local_tail_ - head < sq_entries_, "io_uring submission queue is full");
+        }
+        io_uring_sqe* sqe = &sqes_[sq_local_tail_ & sq_mask_];
+        ++sq_local_tail_;
+        std::memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    // Submit every queued SQE in one system call, and wait for at least
+    // min_complete completions
+    void submit(unsigned min_complete) {
+        __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+        // Includes SQEs left over by an earlier call that was interrupted
+        unsigned to_submit = sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+        if (to_submit == 0 && min_complete == 0) {
+            return;
+        }
+        unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+        while (io_uring_enter_syscall(fd_, to_submit, min_complete, flags) < 0) {
+            // EBUSY means the CQ has to be drained first, EINTR a signal
+            if (errno == EINTR || errno == EBUSY) {
+                return;
+            }
+            TORCH_CHECK(false, "io_uring_enter failed: ", std::strerror(errno));
+        }
+    }
+
+    // Call f on every available completion, returning how many there were
+    template <typename F>
+    unsigned for_each_completion(F&& f) {
+        unsigned head = *cq_head_;
+        unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        unsigned count = 0;
+        for (; head != tail; ++head, ++count) {
+            f(cqes_[head & cq_mask_]);
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        return count;
+    }
+
+    // Whether the kernel supports an opcode
+    bool supports(int opcode) const {
+        std::vector<char> buffer(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+        auto* probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+        if (io_uring_register_syscall(fd_, IORING_REGISTER_PROBE, probe, 256) < 0) {
+            return false;
+        }
+        return opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    // Reserve count empty registered buffer slots. Returns false if the kernel
+    // can't, in which case buffers are never registered.
+    bool register_buffer_slots(unsigned count) {
+        io_uring_rsrc_register reg{};
+        reg.nr = count;
+        reg.flags = IORING_RSRC_REGISTER_SPARSE;
+        return io_uring_register_syscall(fd_, IORING_REGISTER_BUFFERS2, &reg, sizeof(reg)) >= 0;
+    }
+
+    // Point a registered buffer slot at [addr, addr + len), which pins its pages.
+    // Requests already using the slot keep the previous buffer until they finish.
+    bool update_buffer_slot(unsigned index, void* addr, size_t len) {
+        iovec iov{addr, len};
+        io_uring_rsrc_update2 update{};
+        update.offset = index;
+        update.data = reinterpret_cast<uint64_t>(&iov);
+        update.nr = 1;
+        return io_uring_register_syscall(fd_, IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update)) >= 0;
+    }
+
+private:
+    void unmap() {
+        if (ring_ != nullptr && ring_ != MAP_FAILED) {
+            munmap(ring_, ring_size_);
+        }
+        if (sqes_ != nullptr && sqes_ != MAP_FAILED) {
+            munmap(sqes_, sqes_size_);
+        }
+    }
+
+    int fd_ = -1;
+    void* ring_ = nullptr;
+    size_t ring_size_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned* sq_array_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned sq_entries_ = 0;
+    // Tail including the SQEs handed out but not submitted yet
+    unsigned sq_local_tail_ = 0;
+
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+};
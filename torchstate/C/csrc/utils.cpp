@@ -1,5 +1,11 @@
 #include <torch/extension.h>
+#include <memory>
 #include <vector>
+#include "encoding_cache.h"
+#include "hash.h"
+#include "metrics.h"
+#include "skeleton.h"
+#include "tensor_io.h"
 
 // Function to copy bytes into a tensor
 void copy_bytes_to_tensor(torch::Tensor tensor, const std::string& bytes) {
@@ -34,10 +40,259 @@ py::bytes get_bytes_from_tensor(torch::Tensor tensor) {
     return py::bytes(tensor_data, total_bytes);
 }
 
+// Send header followed by the tensor payload straight to a socket fd.
+// The payload is written in chunk_size frames from data_ptr() without an
+// intermediate bytes object, cast to transfer_type on the way, and the GIL is
+// released for the duration of the transfer. start and count select a range of
+// elements in row-major order, count -1 meaning up to the end. With a scheduler,
+// frames wait for their turn as sent to client at priority. With metrics, the
+// send is recorded as the first payload of a request read at received
+// (time.monotonic_ns()), or as a later one if received is -1. With a cache, the
+// payload of a tensor of the snapshot at version is shared with the other
+// responses sending it.
+void send_tensor(int fd, torch::Tensor tensor, const std::string& header, int32_t transfer_type, int64_t chunk_size,
+                 int64_t start, int64_t count, std::shared_ptr<Scheduler> scheduler, const std::string& client,
+                 int32_t priority, std::shared_ptr<Metrics> metrics, int64_t received,
+                 std::shared_ptr<EncodingCache> cache, int64_t version) {
+    std::shared_ptr<Scheduler::Client> budget = scheduler ? scheduler->client(client) : nullptr;
+    py::gil_scoped_release no_gil;
+    SendStats stats;
+    send_cached_tensor_frames(cache.get(), version, fd, tensor, header, transfer_type, chunk_size, start, count,
+                              Pacer{scheduler.get(), budget.get(), priority}, metrics ? &stats : nullptr);
+    if (metrics) {
+        metrics->record_send(transfer_type, received, stats);
+    }
+}
+
+// The framed payload of a tensor encoded with transfer_type, as a uint8 tensor, so
+// that one encoding can be sent to many clients with send_payload. The encoding
+// time is recorded in metrics if given.
+torch::Tensor encode_tensor(torch::Tensor tensor, int32_t transfer_type, int64_t chunk_size,
+                            std::shared_ptr<Metrics> metrics) {
+    auto payload = std::make_unique<std::string>();
+    SendStats stats;
+    {
+        py::gil_scoped_release no_gil;
+        encode_tensor_frames(tensor, transfer_type, chunk_size, 0, -1, [&](const EncodedChunk& chunk) {
+            FrameHeader frame{chunk.nbytes, chunk.numel};
+            payload->append(reinterpret_cast<const char*>(&frame), sizeof(frame));
+            payload->append(chunk.data, chunk.nbytes);
+        }, &stats);
+    }
+    if (metrics && stats.encoded) {
+        metrics->encode.record(stats.encode_ns);
+    }
+    // The tensor owns the string, no copy needed
+    void* data = payload->data();
+    int64_t nbytes = static_cast<int64_t>(payload->size());
+    std::string* owner = payload.release();
+    return torch::from_blob(data, {nbytes}, [owner](void*) { delete owner; }, torch::TensorOptions(torch::kUInt8));
+}
+
+// Send header followed by a payload from encode_tensor, of the given transfer type,
+// scheduled and recorded like send_tensor
+void send_payload(int fd, torch::Tensor payload, const std::string& header, int32_t transfer_type,
+                  int64_t chunk_size, std::shared_ptr<Scheduler> scheduler, const std::string& client,
+                  int32_t priority, std::shared_ptr<Metrics> metrics) {
+    TORCH_CHECK(payload.device().is_cpu() && payload.is_contiguous() && payload.scalar_type() == torch::kUInt8,
+                "send_payload needs a payload from encode_tensor");
+    std::shared_ptr<Scheduler::Client> budget = scheduler ? scheduler->client(client) : nullptr;
+    py::gil_scoped_release no_gil;
+    SendStats stats;
+    send_encoded_payload(fd, header, static_cast<const char*>(payload.data_ptr()), payload.numel(), chunk_size,
+                         Pacer{scheduler.get(), budget.get(), priority}, metrics ? &stats : nullptr);
+    if (metrics) {
+        metrics->record_send(transfer_type, -1, stats);
+    }
+}
+
+// A capsule holding a reference to the object, for the engine extension to
+// share it
+template <typename T>
+py::object shared_capsule(std::shared_ptr<T> object, const char* name) {
+    auto* reference = new std::shared_ptr<T>(std::move(object));
+    // The destructor can't capture the name, but the capsule keeps it
+    PyObject* capsule = PyCapsule_New(reference, name, [](PyObject* self) {
+        delete static_cast<std::shared_ptr<T>*>(PyCapsule_GetPointer(self, PyCapsule_GetName(self)));
+    });
+    if (capsule == nullptr) {
+        delete reference;
+        throw py::error_already_set();
+    }
+    return py::reinterpret_steal<py::object>(capsule);
+}
+
+py::dict histogram_dict(const Histogram& histogram) {
+    py::list buckets;
+    for (int bucket = 0; bucket < Histogram::NUM_BUCKETS; ++bucket) {
+        buckets.append(py::make_tuple(Histogram::bound(bucket), histogram.bucket_count(bucket)));
+    }
+    py::dict result;
+    result["count"] = histogram.count();
+    result["sum"] = histogram.sum();
+    result["buckets"] = buckets;
+    return result;
+}
+
+// The metrics as a dict, histograms as their count, sum and (upper bound, count)
+// of every bucket
+py::dict metrics_dict(const Metrics& metrics) {
+    py::dict payload_bytes;
+    for (int32_t transfer_type = 0; transfer_type < NUM_METRIC_TRANSFER_TYPES; ++transfer_type) {
+        if (const char* name = transfer_type_name(transfer_type)) {
+            payload_bytes[name] = metrics.payload_bytes(transfer_type);
+        }
+    }
+    py::dict requests;
+    requests["native"] = metrics.requests(true);
+    requests["python"] = metrics.requests(false);
+    py::dict result;
+    result["requests"] = requests;
+    result["errors"] = metrics.errors();
+    result["connections"] = metrics.connections();
+    result["connections_total"] = metrics.total_connections();
+    result["payload_bytes"] = payload_bytes;
+    result["send_stalls"] = metrics.stalls();
+    result["send_stall_seconds"] = metrics.stall_seconds();
+    result["throttle_seconds"] = metrics.throttle_seconds();
+    py::dict cache;
+    cache["hits"] = metrics.encoding_cache_lookups(true);
+    cache["misses"] = metrics.encoding_cache_lookups(false);
+    cache["bytes"] = metrics.encoding_cache_bytes();
+    result["encoding_cache"] = cache;
+    result["lookup_seconds"] = histogram_dict(metrics.lookup);
+    result["first_byte_seconds"] = histogram_dict(metrics.first_byte);
+    result["encode_seconds"] = histogram_dict(metrics.encode);
+    return result;
+}
+
+// Receive a tensor payload straight from a socket fd into data_ptr(),
+// converting from transfer_type to the tensor dtype if they differ. The
+// payload fills elements [start, start + count) of the tensor.
+void recv_into_tensor(int fd, torch::Tensor tensor, int32_t transfer_type, int64_t start, int64_t count) {
+    py::gil_scoped_release no_gil;
+    recv_tensor_frames(fd, tensor, transfer_type, start, count);
+}
+
+// XXH64 of every block_numel elements of a contiguous CPU tensor, the last block
+// possibly shorter. Blocks are hashed in parallel without the GIL.
+torch::Tensor block_hashes(torch::Tensor tensor, int64_t block_numel) {
+    TORCH_CHECK(tensor.device().is_cpu() && tensor.is_contiguous(), "block_hashes needs a contiguous CPU tensor");
+    TORCH_CHECK(block_numel > 0, "block_numel must be positive");
+    int64_t numel = tensor.numel();
+    int64_t num_blocks = (numel + block_numel - 1) / block_numel;
+    torch::Tensor hashes = torch::empty({num_blocks}, torch::kInt64);
+
+    const uint8_t* data = static_cast<const uint8_t*>(tensor.data_ptr());
+    int64_t element_size = tensor.element_size();
+    int64_t* out = hashes.data_ptr<int64_t>();
+    py::gil_scoped_release no_gil;
+    at::parallel_for(0, num_blocks, 1, [&](int64_t begin, int64_t end) {
+        for (int64_t block = begin; block < end; ++block) {
+            int64_t first = block * block_numel;
+            int64_t count = std::min(block_numel, numel - first);
+            out[block] = static_cast<int64_t>(xxh64(data + first * element_size, count * element_size));
+        }
+    });
+    return hashes;
+}
+
+// Number of references to the storage of a tensor, one per tensor viewing it and
+// per Python storage object, whether held by Python or by the extensions
+int64_t storage_use_count(const torch::Tensor& tensor) {
+    return static_cast<int64_t>(tensor.storage().use_count());
+}
+
+// The value at path of a state dict as a skeleton (see skeleton.h), its tensors
+// as references to their key IDs in index and its leaves taken from scalars
+py::bytes encode_skeleton(py::object value, const std::string& path, py::dict index, py::dict scalars) {
+    return py::bytes(SkeletonEncoder(std::move(index), std::move(scalars)).encode(value, path));
+}
+
+// Rebuild the value encoded in a skeleton, with the tensors of its references
+// taken from tensors (key ID -> tensor)
+py::object decode_skeleton(const std::string& data, py::dict tensors) {
+    return SkeletonDecoder(data, tensors).decode();
+}
+
+// Key IDs of the tensors referenced by a skeleton, in order of appearance
+std::vector<int64_t> skeleton_key_ids(const std::string& data) {
+    SkeletonDecoder decoder(data, py::none());
+    decoder.decode();
+    return decoder.key_ids();
+}
+
 // Define the Python bindings
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
     m.def("copy_bytes_to_tensor", &copy_bytes_to_tensor, 
           "Copy bytes into tensor storage");
     m.def("get_bytes_from_tensor", &get_bytes_from_tensor,
           "Get bytes from tensor storage");
+    m.def("send_tensor", &send_tensor,
+          "Send header and tensor storage to a socket fd without copying",
+          py::arg("fd"), py::arg("tensor"), py::arg("header"), py::arg("transfer_type"),
+          py::arg("chunk_size") = DEFAULT_CHUNK_SIZE, py::arg("start") = 0, py::arg("count") = -1,
+          py::arg("scheduler") = nullptr, py::arg("client") = "", py::arg("priority") = PRIORITY_NORMAL,
+          py::arg("metrics") = nullptr, py::arg("received") = -1, py::arg("cache") = nullptr,
+          py::arg("version") = -1);
+    m.def("encode_tensor", &encode_tensor,
+          "Encode the framed payload of a tensor once, for send_payload",
+          py::arg("tensor"), py::arg("transfer_type"), py::arg("chunk_size") = DEFAULT_CHUNK_SIZE,
+          py::arg("metrics") = nullptr);
+    m.def("send_payload", &send_payload,
+          "Send header and a payload from encode_tensor to a socket fd",
+          py::arg("fd"), py::arg("payload"), py::arg("header"), py::arg("transfer_type"),
+          py::arg("chunk_size") = DEFAULT_CHUNK_SIZE, py::arg("scheduler") = nullptr, py::arg("client") = "",
+          py::arg("priority") = PRIORITY_NORMAL, py::arg("metrics") = nullptr);
+    m.def("recv_into_tensor", &recv_into_tensor,
+          "Receive tensor storage from a socket fd directly into the tensor",
+          py::arg("fd"), py::arg("tensor"), py::arg("transfer_type"), py::arg("start") = 0, py::arg("count") = -1);
+    py::class_<Scheduler, std::shared_ptr<Scheduler>>(m, "Scheduler")
+        .def(py::init<>())
+        .def("set_bandwidth", &Scheduler::set_bandwidth, py::arg("total"), py::arg("per_client"),
+             "Cap the total and per client host bandwidth in bytes per second, 0 for no cap")
+        .def_property_readonly("total_bandwidth", &Scheduler::total_bandwidth)
+        .def_property_readonly("client_bandwidth", &Scheduler::client_bandwidth)
+        .def("pause", &Scheduler::pause, "Hold back every frame not sent yet until resume()")
+        .def("resume", &Scheduler::resume)
+        .def_property_readonly("paused", &Scheduler::paused)
+        .def("capsule", [](std::shared_ptr<Scheduler> self) { return shared_capsule(self, SCHEDULER_CAPSULE); },
+             "A capsule referencing the scheduler, for the engine extension");
+    py::class_<Metrics, std::shared_ptr<Metrics>>(m, "Metrics")
+        .def(py::init<>())
+        .def("count_request", &Metrics::count_request, py::arg("native"))
+        .def("count_error", &Metrics::count_error)
+        .def("connection_opened", &Metrics::connection_opened)
+        .def("connection_closed", &Metrics::connection_closed)
+        .def("record_lookup", [](Metrics& self, int64_t ns) { self.lookup.record(ns); }, py::arg("ns"))
+        .def("as_dict", &metrics_dict, "The metrics as a dict")
+        .def("prometheus", &Metrics::prometheus, "The metrics in the Prometheus text format")
+        .def("capsule", [](std::shared_ptr<Metrics> self) { return shared_capsule(self, METRICS_CAPSULE); },
+             "A capsule referencing the metrics, for the engine extension");
+    py::class_<EncodingCache, std::shared_ptr<EncodingCache>>(m, "EncodingCache")
+        .def(py::init<int64_t, std::shared_ptr<Metrics>>(), py::arg("capacity"), py::arg("metrics") = nullptr)
+        .def_property("capacity", &EncodingCache::capacity, &EncodingCache::set_capacity,
+                      "Bytes of finished payloads kept, 0 for none")
+        .def_property_readonly("size", &EncodingCache::size)
+        .def("retire", &EncodingCache::retire, py::arg("version"),
+             "Drop the payloads of the snapshots before version")
+        .def("clear", &EncodingCache::clear)
+        .def("capsule", [](std::shared_ptr<EncodingCache> self) {
+                 return shared_capsule(self, ENCODING_CACHE_CAPSULE);
+             }, "A capsule referencing the cache, for the engine extension");
+    m.def("encode_skeleton", &encode_skeleton,
+          "Encode the non-tensor part of the value at a path of a state dict",
+          py::arg("value"), py::arg("path"), py::arg("index"), py::arg("scalars"));
+    m.def("decode_skeleton", &decode_skeleton,
+          "Rebuild a value from its skeleton and the tensors it references",
+          py::arg("data"), py::arg("tensors"));
+    m.def("skeleton_key_ids", &skeleton_key_ids,
+          "Key IDs of the tensors a skeleton references",
+          py::arg("data"));
+    m.def("storage_use_count", &storage_use_count,
+          "Number of references to the storage of a tensor",
+          py::arg("tensor"));
+    m.def("block_hashes", &block_hashes,
+          "Hash every block_numel elements of a contiguous CPU tensor",
+          py::arg("tensor"), py::arg("block_numel"));
 }
\ No newline at end of file
@@ -0,0 +1,16 @@
+from torch.utils.cpp_extension import load
+from pathlib import Path
+from torchstate.C.utils import WITH_CUDA, CODEC_CFLAGS, CODEC_LDFLAGS
+
+ENGINE_CSRC_PATH = Path(__file__).parent / "csrc" / "engine.cpp"
+
+_engine = load(
+    name="engine",
+    sources=[ENGINE_CSRC_PATH],
+    extra_cflags=['-O3'] + (['-DWITH_CUDA'] if WITH_CUDA else []) + CODEC_CFLAGS,
+    extra_ldflags=CODEC_LDFLAGS,
+    with_cuda=WITH_CUDA,
+    verbose=False
+)
+
+NativeServer = _engine.NativeServer
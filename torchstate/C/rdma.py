@@ -0,0 +1,20 @@
+from torch.utils.cpp_extension import load
+from pathlib import Path
+from torchstate.C.utils import WITH_CUDA
+
+RDMA_CSRC_PATH = Path(__file__).parent / "csrc" / "rdma.cpp"
+
+# Only built when an RDMA transport is used, so libibverbs isn't needed otherwise
+_rdma = load(
+    name="rdma",
+    sources=[RDMA_CSRC_PATH],
+    extra_cflags=['-O3'] + (['-DWITH_CUDA'] if WITH_CUDA else []),
+    extra_ldflags=['-libverbs'],
+    with_cuda=WITH_CUDA,
+    verbose=False
+)
+
+ENDPOINT_INFO_SIZE = _rdma.ENDPOINT_INFO_SIZE
+RdmaContext = _rdma.RdmaContext
+RdmaRegion = _rdma.RdmaRegion
+RdmaEndpoint = _rdma.RdmaEndpoint
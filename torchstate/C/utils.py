@@ -1,13 +1,40 @@
 from torch.utils.cpp_extension import load
+from ctypes.util import find_library
 from pathlib import Path
+from typing import Any, Dict, List, Optional
+import os
 import torch
 
 UTILS_CSRC_PATH = Path(__file__).parent / "csrc" / "utils.cpp"
 
+# Stream CUDA tensors directly when torch can see a GPU
+WITH_CUDA = torch.cuda.is_available()
+
+def _have_codecs() -> bool:
+    """Whether the headers and libraries of zstd and lz4 are installed."""
+    include_dirs = ['/usr/include', '/usr/local/include']
+    if os.environ.get('CONDA_PREFIX'):
+        include_dirs.append(os.path.join(os.environ['CONDA_PREFIX'], 'include'))
+    for variable in ('CPATH', 'C_INCLUDE_PATH', 'CPLUS_INCLUDE_PATH'):
+        include_dirs += [d for d in os.environ.get(variable, '').split(os.pathsep) if d]
+    return all(
+        find_library(library) and any(os.path.exists(os.path.join(d, header)) for d in include_dirs)
+        for library, header in (('zstd', 'zstd.h'), ('lz4', 'lz4.h'))
+    )
+
+# The lossless transfer types are only built when libzstd and liblz4 are found, or
+# as set by TORCHSTATE_WITH_CODECS=0/1. Without them, SHUFFLE_ZSTD and SHUFFLE_LZ4
+# are rejected and every other transfer type still works.
+WITH_CODECS = os.environ.get('TORCHSTATE_WITH_CODECS', '1' if _have_codecs() else '0') == '1'
+CODEC_CFLAGS = ['-DWITH_CODECS'] if WITH_CODECS else []
+CODEC_LDFLAGS = ['-lzstd', '-llz4'] if WITH_CODECS else []
+
 _utils = load(
     name="utils",
     sources=[UTILS_CSRC_PATH],
-    extra_cflags=['-O3'],
+    extra_cflags=['-O3'] + (['-DWITH_CUDA'] if WITH_CUDA else []) + CODEC_CFLAGS,
+    extra_ldflags=CODEC_LDFLAGS,
+    with_cuda=WITH_CUDA,
     verbose=False
 )
 
@@ -16,3 +43,86 @@ def copy_bytes_to_tensor(tensor: torch.Tensor, bytes_data: bytes) -> None:
 
 def get_bytes_from_tensor(tensor: torch.Tensor) -> bytes:
     return _utils.get_bytes_from_tensor(tensor)
+
+DEFAULT_CHUNK_SIZE = 4 * 1024 * 1024
+
+# Holds payload frames back while paused, caps the bandwidth they take and orders
+# them by priority (see scheduler.h)
+Scheduler = _utils.Scheduler
+
+# Counters and latency histograms of the serving paths, shared with the native
+# server core (see metrics.h)
+Metrics = _utils.Metrics
+
+# Encoded payloads of snapshot tensors shared by the responses sending them,
+# within a memory budget (see encoding_cache.h)
+EncodingCache = _utils.EncodingCache
+
+def send_tensor(
+    fd: int,
+    tensor: torch.Tensor,
+    header: bytes,
+    transfer_type: int,
+    chunk_size: int = DEFAULT_CHUNK_SIZE,
+    start: int = 0,
+    count: int = -1,
+    scheduler: Optional[Scheduler] = None,
+    client: str = "",
+    priority: int = 1,
+    metrics: Optional[Metrics] = None,
+    received: int = -1,
+    cache: Optional[EncodingCache] = None,
+    version: int = -1,
+) -> None:
+    _utils.send_tensor(fd, tensor, header, transfer_type, chunk_size, start, count, scheduler, client, priority,
+                       metrics, received, cache, version)
+
+def encode_tensor(
+    tensor: torch.Tensor,
+    transfer_type: int,
+    chunk_size: int = DEFAULT_CHUNK_SIZE,
+    metrics: Optional[Metrics] = None,
+) -> torch.Tensor:
+    """The framed payload of tensor as send_tensor would send it, as a uint8 tensor."""
+    return _utils.encode_tensor(tensor, transfer_type, chunk_size, metrics)
+
+def send_payload(
+    fd: int,
+    payload: torch.Tensor,
+    header: bytes,
+    transfer_type: int,
+    chunk_size: int = DEFAULT_CHUNK_SIZE,
+    scheduler: Optional[Scheduler] = None,
+    client: str = "",
+    priority: int = 1,
+    metrics: Optional[Metrics] = None,
+) -> None:
+    """Send header and a payload from encode_tensor, like send_tensor would."""
+    _utils.send_payload(fd, payload, header, transfer_type, chunk_size, scheduler, client, priority, metrics)
+
+def recv_into_tensor(fd: int, tensor: torch.Tensor, transfer_type: int, start: int = 0, count: int = -1) -> None:
+    _utils.recv_into_tensor(fd, tensor, transfer_type, start, count)
+
+def encode_skeleton(value: Any, path: str, index: Dict[str, Any], scalars: Dict[str, Any]) -> bytes:
+    """The non-tensor part of the value at path of a state dict as one compact tree
+    (see skeleton.h). Tensors are encoded as the key ID of their entry in index
+    (path -> index entry), and leaves found in scalars (path -> value) as that."""
+    return _utils.encode_skeleton(value, path, index, scalars)
+
+def decode_skeleton(data: bytes, tensors: Dict[int, torch.Tensor]) -> Any:
+    """Rebuild the value encoded by encode_skeleton, with the tensor of every key ID
+    it references taken from tensors."""
+    return _utils.decode_skeleton(data, tensors)
+
+def skeleton_key_ids(data: bytes) -> List[int]:
+    """Key IDs of the tensors referenced by a skeleton."""
+    return _utils.skeleton_key_ids(data)
+
+def storage_use_count(tensor: torch.Tensor) -> int:
+    """Number of references to the storage of tensor, one per tensor viewing it and
+    per storage object, counting those held by the C++ extensions too."""
+    return _utils.storage_use_count(tensor)
+
+def block_hashes(tensor: torch.Tensor, block_numel: int) -> torch.Tensor:
+    """XXH64 of every block_numel elements of a contiguous CPU tensor, as int64."""
+    return _utils.block_hashes(tensor, block_numel)
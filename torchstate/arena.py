@@ -0,0 +1,62 @@
+from typing import TYPE_CHECKING, List, Optional
+import mmap
+import torch
+
+if TYPE_CHECKING:
+    from torchstate.client import TensorInfo
+
+# Offsets of the tensors in an arena are aligned to a cache line, which also
+# satisfies the alignment of every dtype
+ARENA_ALIGNMENT = 64
+HUGE_PAGE_SIZE = 2 * 1024 * 1024
+
+def _align(offset: int, alignment: int) -> int:
+    return (offset + alignment - 1) // alignment * alignment
+
+class TensorArena:
+    """A single host buffer that tensors are handed out from as contiguous views.
+
+    Restoring a state dict into an arena costs one allocation instead of one per
+    tensor, and leaves everything in one region that can be copied to a device or
+    registered with it as a whole.
+
+    pin_memory allocates the buffer in page-locked memory. huge_pages backs it with
+    an anonymous mapping advised to use transparent huge pages. The two can't be
+    combined, since pinned memory comes from the CUDA host allocator.
+    """
+
+    def __init__(self, pin_memory: bool = False, huge_pages: bool = False, alignment: int = ARENA_ALIGNMENT):
+        if pin_memory and huge_pages:
+            raise ValueError("pin_memory and huge_pages can't be combined")
+        self.pin_memory = pin_memory
+        self.huge_pages = huge_pages
+        self.alignment = alignment
+        self.buffer: Optional[torch.Tensor] = None
+
+    def allocate(self, infos: List["TensorInfo"]) -> List[torch.Tensor]:
+        """Allocate a new buffer holding a tensor for each entry of a manifest.
+
+        Tensors handed out by an earlier call keep their previous buffer alive.
+        """
+        offsets = []
+        total = 0
+        for info in infos:
+            total = _align(total, self.alignment)
+            offsets.append(total)
+            total += info.nbytes
+
+        self.buffer = self._allocate_buffer(total)
+        return [
+            self.buffer[offset:offset + info.nbytes].view(info.dtype).view(info.shape)
+            for offset, info in zip(offsets, infos)
+        ]
+
+    def _allocate_buffer(self, size: int) -> torch.Tensor:
+        if not self.huge_pages:
+            return torch.empty(size, dtype=torch.uint8, pin_memory=self.pin_memory)
+
+        # The tensor keeps the mapping alive for as long as any view of it exists
+        mapping = mmap.mmap(-1, max(_align(size, HUGE_PAGE_SIZE), HUGE_PAGE_SIZE))
+        if hasattr(mmap, "MADV_HUGEPAGE"):
+            mapping.madvise(mmap.MADV_HUGEPAGE)
+        return torch.frombuffer(mapping, dtype=torch.uint8)[:size]
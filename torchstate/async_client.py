@@ -0,0 +1,243 @@
+from typing import TYPE_CHECKING, Any, Callable, Deque, Dict, Iterator, List, Optional, Tuple, Union
+from collections import deque
+from concurrent.futures import Future, as_completed
+import asyncio
+import queue
+import threading
+import torch
+from torchstate.client import StateClient, ServerResponseError, _insert_nested, _pattern_root
+from torchstate.ttype_consts import Priority, TransferType
+
+if TYPE_CHECKING:
+    from torchstate.arena import TensorArena
+
+class _Request:
+    """A request queued on a connection: the packed request, the function reading
+    its response given the request ID, and the future completed with the result."""
+    __slots__ = ("packed_request", "receive", "future", "nbytes")
+
+    def __init__(self, packed_request: bytes, receive: Callable[[int], Any], future: Future, nbytes: int):
+        self.packed_request = packed_request
+        self.receive = receive
+        self.future = future
+        self.nbytes = nbytes
+
+class _Connection:
+    """A persistent connection and the thread driving it.
+
+    The thread keeps up to max_inflight requests sent ahead of the response it is
+    reading. Payloads are received by the native code without the GIL, so the
+    connections of a client receive in parallel while the caller keeps running.
+    """
+
+    def __init__(self, url: str, max_inflight: int, priority: Optional[Priority]):
+        self.client = StateClient(url, persistent=True, priority=priority)
+        self.max_inflight = max_inflight
+        # Requests queued or in flight and the bytes of their tensors, where known,
+        # to spread requests over the connections by size
+        self.pending = 0
+        self.pending_bytes = 0
+        self._lock = threading.Lock()
+        self._requests: "queue.SimpleQueue[Optional[_Request]]" = queue.SimpleQueue()
+        self._thread = threading.Thread(target=self._run, daemon=True)
+        self._thread.start()
+
+    def submit(self, request: _Request) -> None:
+        with self._lock:
+            self.pending += 1
+            self.pending_bytes += request.nbytes
+        self._requests.put(request)
+
+    def close(self) -> None:
+        """Finish the queued requests and close the connection."""
+        self._requests.put(None)
+        self._thread.join()
+        self.client.close()
+
+    def _done(self, request: _Request) -> None:
+        with self._lock:
+            self.pending -= 1
+            self.pending_bytes -= request.nbytes
+
+    def _run(self) -> None:
+        inflight: Deque[Tuple[int, _Request]] = deque()
+        closing = False
+        while not closing or inflight:
+            # Top up the pipeline, only waiting for new requests when it is empty
+            while not closing and len(inflight) < self.max_inflight:
+                try:
+                    request = self._requests.get(block=not inflight)
+                except queue.Empty:
+                    break
+                if request is None:
+                    closing = True
+                    break
+                if not request.future.set_running_or_notify_cancel():
+                    self._done(request)
+                    continue
+                try:
+                    inflight.append((self.client._send_request(request.packed_request), request))
+                except Exception as e:
+                    self._fail(inflight, request, e)
+
+            if not inflight:
+                continue
+            request_id, request = inflight.popleft()
+            try:
+                result = request.receive(request_id)
+            except ServerResponseError as e:
+                # The error response was read whole, the pipeline is still in sync
+                self._done(request)
+                request.future.set_exception(e)
+            except Exception as e:
+                self._fail(inflight, request, e)
+            else:
+                self._done(request)
+                request.future.set_result(result)
+
+    def _fail(self, inflight: Deque[Tuple[int, _Request]], request: _Request, error: Exception) -> None:
+        """Fail request and everything in flight behind it, whose responses are lost
+        with the connection. The next request opens a new one."""
+        self.client.close()
+        for failed in [request] + [r for _, r in inflight]:
+            self._done(failed)
+            failed.future.set_exception(error)
+        inflight.clear()
+
+class PendingStateDict:
+    """A state dict being fetched by AsyncStateClient.get_state_dict_async.
+
+    state_dict holds every tensor from the start, each filled in place once its
+    future completes. Awaiting it from asyncio, or calling result(), waits for all
+    of them and returns state_dict.
+    """
+
+    def __init__(self, state_dict: dict, futures: Dict[str, Future]):
+        self.state_dict = state_dict
+        # Future of every tensor by its path on the server
+        self.futures = futures
+
+    def done(self) -> bool:
+        return all(future.done() for future in self.futures.values())
+
+    def as_completed(self, timeout: Optional[float] = None) -> Iterator[Tuple[str, torch.Tensor]]:
+        """Yield (path, tensor) for every tensor as soon as it has arrived."""
+        paths = {future: path for path, future in self.futures.items()}
+        for future in as_completed(paths, timeout):
+            yield paths[future], future.result()
+
+    def result(self, timeout: Optional[float] = None) -> dict:
+        for _ in self.as_completed(timeout):
+            pass
+        return self.state_dict
+
+    def __await__(self):
+        async def wait() -> dict:
+            for future in self.futures.values():
+                await asyncio.wrap_future(future)
+            return self.state_dict
+        return wait().__await__()
+
+class AsyncStateClient:
+    """Fetch tensors without blocking, over a pool of persistent connections.
+
+    Every get_*_async call queues its requests and returns futures right away. The
+    requests are spread over num_connections connections by the bytes already
+    pending on each, and each connection keeps up to max_inflight of them in
+    flight. Tensors are received straight into their destination, so a restore can
+    overlap with building the model, and with loading the tensors that already
+    arrived. Futures can be awaited from asyncio through asyncio.wrap_future.
+    priority sets the class the server schedules the responses in.
+    """
+
+    def __init__(self, url: str, num_connections: int = 4, max_inflight: int = 16,
+                 priority: Optional[Priority] = None):
+        if num_connections < 1 or max_inflight < 1:
+            raise ValueError("num_connections and max_inflight must be at least 1")
+        self.url = url
+        self._connections = [_Connection(url, max_inflight, priority) for _ in range(num_connections)]
+        self._closed = False
+
+    def close(self):
+        """Wait for the requests already queued and close every connection."""
+        if not self._closed:
+            self._closed = True
+            for connection in self._connections:
+                connection.close()
+
+    def __enter__(self) -> "AsyncStateClient":
+        return self
+
+    def __exit__(self, *exc) -> None:
+        self.close()
+
+    def get_tensor_async(
+        self,
+        path: Union[str, int],
+        transfer_type: Optional[TransferType] = None,
+        inplace_tensor: Optional[torch.Tensor] = None,
+    ) -> "Future[torch.Tensor]":
+        """Queue a request for one tensor, returning the future of the tensor it is
+        received into (inplace_tensor if given)."""
+        nbytes = inplace_tensor.numel() * inplace_tensor.element_size() if inplace_tensor is not None else 0
+        return self._submit(path, transfer_type, inplace_tensor, nbytes)
+
+    def get_tensors_async(
+        self,
+        paths: List[Union[str, int]],
+        transfer_type: Optional[TransferType] = None,
+        inplace_tensors: Optional[List[torch.Tensor]] = None,
+    ) -> List["Future[torch.Tensor]"]:
+        """Queue requests for several tensors, like get_tensors, returning a future
+        per path."""
+        if inplace_tensors is None:
+            inplace_tensors = [None] * len(paths)
+        if len(inplace_tensors) != len(paths):
+            raise ValueError("inplace_tensors must have one entry per path")
+        return [self.get_tensor_async(path, transfer_type, tensor) for path, tensor in zip(paths, inplace_tensors)]
+
+    def get_state_dict_async(
+        self,
+        prefix: str = "",
+        transfer_type: Optional[TransferType] = None,
+        inplace: Optional[dict] = None,
+        arena: Optional["TensorArena"] = None,
+    ) -> PendingStateDict:
+        """Start fetching every tensor matching prefix, like get_state_dict.
+
+        Returns once the manifest is listed and the tensors are allocated, with
+        tensors found in inplace filled in place. Each tensor is its own request, so
+        unlike get_state_dict a snapshot published during the fetch may reach only
+        some of them; take a snapshot before recovering if that matters.
+        """
+        lister = StateClient(self.url)
+        try:
+            infos = lister.list_tensors(prefix)
+            parts, tensors = lister._allocate_state_dict(_pattern_root(prefix), infos, inplace, arena)
+        finally:
+            lister.close()
+
+        state_dict = {}
+        futures = {}
+        for info, tensor_parts, tensor in zip(infos, parts, tensors):
+            _insert_nested(state_dict, tensor_parts, tensor)
+            futures[info.path] = self._submit(info.path, transfer_type, tensor, info.nbytes)
+        return PendingStateDict(state_dict, futures)
+
+    def _submit(
+        self,
+        path: Union[str, int],
+        transfer_type: Optional[TransferType],
+        inplace_tensor: Optional[torch.Tensor],
+        nbytes: int,
+    ) -> Future:
+        if self._closed:
+            raise RuntimeError("AsyncStateClient is closed")
+        connection = min(self._connections, key=lambda c: (c.pending_bytes, c.pending))
+        client = connection.client
+        packed_request = client._pack_tensor_request(path, transfer_type, inplace_tensor)
+        future = Future()
+        connection.submit(_Request(
+            packed_request, lambda request_id: client._recv_tensor(request_id, inplace_tensor), future, nbytes
+        ))
+        return future
@@ -1,15 +1,26 @@
-from typing import Optional, Any, TypeVar, Type
+from typing import TYPE_CHECKING, Callable, Optional, Any, Dict, List, NamedTuple, Tuple, TypeVar, Type, Union
 import torch
 import socket
 import struct
-from torchstate.C.utils import copy_bytes_to_tensor
-from torchstate.ttype_consts import TransferType, ScalarTransferType, TTYPE_TO_ELEMENT_SIZE, TTYPE_TO_CODEBOOK_SIZE
+from concurrent.futures import ThreadPoolExecutor
+from torchstate.C.utils import decode_skeleton, recv_into_tensor, skeleton_key_ids
+from torchstate.ttype_consts import (
+    TransferType, ScalarTransferType, RequestType, Priority, TRANSFER_TYPE_VALUES, DTYPE_CODES
+)
+
+if TYPE_CHECKING:
+    from torchstate.arena import TensorArena
+    from torchstate.subscription import Subscription
 
 T = TypeVar('T')
 
 class StateClientError(Exception):
     pass
 
+class ServerResponseError(StateClientError):
+    """Error reported by the server. The response was fully read, so the connection stays usable."""
+    pass
+
 SCALAR_TYPE_MAPPING = {
     ScalarTransferType.FLOAT64: (8, 'd', float),
     ScalarTransferType.INT64: (8, 'q', int),
@@ -18,6 +29,9 @@ SCALAR_TYPE_MAPPING = {
 }
 
 CHUNK_SIZE = 2 * 4096
+SOCKET_BUFFER_SIZE = 4 * 1024 * 1024
+# Stripes of a tensor fetched over parallel connections start at multiples of this many elements
+STRIPE_ALIGNMENT = 64 * 1024
 
 def recv_exact(sock: socket.socket, size: int, chunk_size: int = CHUNK_SIZE) -> bytes:
     """Receive exactly size bytes from socket, handling large transfers in chunks."""
@@ -34,82 +48,657 @@ def recv_exact(sock: socket.socket, size: int, chunk_size: int = CHUNK_SIZE) ->
     
     return bytes(data)
 
+def _parse_url(url: str) -> Tuple[str, int]:
+    """Split a 'scheme://host:port' URL into host and port. The scheme is optional,
+    and must name one of TRANSPORTS if given."""
+    scheme, sep, address = url.rpartition("://")
+    if sep and scheme not in TRANSPORTS:
+        raise ValueError(f"Unsupported URL scheme: {scheme}")
+    hostname, _, port = address.rpartition(":")
+    if not hostname:
+        raise ValueError(f"Invalid server URL: {url}")
+    return hostname.strip("[]"), int(port)
+
 def _pack_request(path: str, transfer_type: int, size: int) -> bytes:
     if len(path) > 244:
         raise ValueError("Path length must be at most 244 characters")
     encoded_path = path.encode().ljust(244, b'\x00')
     return struct.pack('244siq', encoded_path, transfer_type, size)
 
+def _encode_path(path: Union[str, int]) -> str:
+    """Request path for a bracketed path, or for an integer key ID ('#<id>')."""
+    return f"#{path}" if isinstance(path, int) else path
+
+def _parse_path(path: str) -> List[Any]:
+    """Split a bracketed path into its keys, the same way the server resolves it."""
+    return [int(part) if part.isdigit() else part for part in path.strip('[]').split('][')]
+
+def _pattern_root(pattern: str) -> str:
+    """The literal bracketed keys of a path pattern before any wildcard."""
+    literal = pattern.split('*', 1)[0]
+    return literal[:literal.rfind(']') + 1]
+
+def _relative_parts(root: str, path: str) -> List[Any]:
+    """Keys of path below the pattern root, where get_state_dict puts its tensor."""
+    return _parse_path(path[len(root):] if path.startswith(root) else path)
+
+def _lookup_tensor(d: Any, parts: List[Any]) -> Optional[torch.Tensor]:
+    """Find the tensor at a parsed path in a nested dict, or None if absent."""
+    try:
+        for part in parts:
+            d = d[part]
+    except (KeyError, IndexError, TypeError):
+        return None
+    return d if isinstance(d, torch.Tensor) else None
+
+def _insert_nested(d: dict, parts: List[Any], value: Any) -> None:
+    """Set value at a parsed path in a nested dict, creating levels as needed."""
+    for part in parts[:-1]:
+        d = d.setdefault(part, {})
+    d[parts[-1]] = value
+
+class TensorInfo(NamedTuple):
+    """Description of a tensor on the server, as listed in a manifest."""
+    path: str
+    key_id: int
+    transfer_type: int
+    dtype: torch.dtype
+    numel: int
+    shape: Tuple[int, ...]
+    stride: Tuple[int, ...]
+
+    @property
+    def nbytes(self) -> int:
+        return self.numel * self.dtype.itemsize
+
+def _unpack_manifest(manifest: bytes) -> Tuple[int, List[TensorInfo]]:
+    """Unpack a batch or list manifest into its snapshot version and entries."""
+    version, count = struct.unpack_from('qq', manifest, 0)
+    offset = 16
+    entries = []
+    for _ in range(count):
+        path_len, ttype, dtype_code, ndim, numel, key_id = struct.unpack_from('iiiiqq', manifest, offset)
+        offset += 32
+        dims = struct.unpack_from(f'{2 * ndim}q', manifest, offset)
+        offset += 16 * ndim
+        path = manifest[offset:offset + path_len].decode()
+        offset += path_len
+        entries.append(TensorInfo(path, key_id, ttype, DTYPE_CODES[dtype_code], numel, dims[:ndim], dims[ndim:]))
+    return version, entries
+
 class StateClient:
-    def __init__(self, url: str):
-        self.hostname, port = url.split(":")
-        self.port = int(port)
+    def __init__(self, url: str, persistent: bool = False, priority: Optional[Priority] = None):
+        self.url = url
+        self.hostname, self.port = _parse_url(url)
+        self.persistent = persistent
+        # Class the server schedules the responses of the connection in, which is
+        # set once per connection and so needs a persistent one
+        if priority is not None and not persistent:
+            raise ValueError("priority needs a persistent client")
+        self.priority = priority
+        self.client_socket = None
+        self._next_request_id = 0
+        # Key IDs of the paths seen in batch manifests, usable in place of the paths
+        self.key_ids: Dict[str, int] = {}
+        # Snapshot version of the last response that reported one, -1 for the live state
+        self.last_version: Optional[int] = None
         #self._init_socket()
 
+    def _connection_settings(self) -> Dict[str, Any]:
+        """Arguments besides the URL for a client of the same class that connects the
+        way this one does, like the clients of the stripes of a tensor."""
+        return {"persistent": self.persistent, "priority": self.priority}
+
     def _init_socket(self):
         """Initialize a new socket connection"""
         self.client_socket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.client_socket.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, SOCKET_BUFFER_SIZE)
+        self.client_socket.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
         self.client_socket.connect((self.hostname, self.port))
 
+    def _init_persistent_socket(self):
+        """Open a connection and switch it to persistent mode"""
+        self._init_socket()
+        try:
+            self.client_socket.sendall(_pack_request("", RequestType.PERSISTENT.value, 0))
+            succ, ttype, size = struct.unpack('iiq', recv_exact(self.client_socket, 16))
+            self._handle_error_response(succ, ttype, size)
+            if self.priority is not None:
+                request_id = self._send_request(_pack_request("", RequestType.PRIORITY.value, self.priority.value))
+                self._recv_response_header(request_id)
+        except Exception:
+            self.close()
+            raise
+
+    def close(self):
+        """Close the connection to the server if one is open"""
+        if self.client_socket is not None:
+            self.client_socket.close()
+            self.client_socket = None
+
+    def _send_request(self, packed_request: bytes) -> int:
+        """Send a request, opening a connection as needed. Returns the request ID"""
+        if not self.persistent:
+            # Reset socket connection
+            self._init_socket()
+            self.client_socket.sendall(packed_request)
+            return -1
+
+        if self.client_socket is None:
+            self._init_persistent_socket()
+        request_id = self._next_request_id
+        self._next_request_id += 1
+        self.client_socket.sendall(struct.pack('q', request_id) + packed_request)
+        return request_id
+
+    def _recv_response_header(self, request_id: int) -> Tuple[int, int]:
+        """Receive the response header, checking it answers the given request.
+
+        Returns the transfer type and size fields.
+        """
+        if self.persistent:
+            resp_id, succ, ttype, size = struct.unpack('qiiq', self._recv_header(24))
+            if resp_id != request_id:
+                raise StateClientError(f"Got response for request {resp_id}, expected {request_id}")
+        else:
+            succ, ttype, size = struct.unpack('iiq', self._recv_header(16))
+
+        # Check for errors
+        self._handle_error_response(succ, ttype, size)
+        return ttype, size
+
+    def _recv_header(self, size: int) -> bytes:
+        """Receive the size byte header of a response"""
+        return recv_exact(self.client_socket, size)
+
+    def _finish_request(self, failed: bool):
+        """Release the connection after a request, unless it is reused"""
+        if not self.persistent or failed:
+            self.close()
+
     def _handle_error_response(self, succ: int, ttype: int, size: int):
         """Handle error responses from the server. Raises an exception if not successful"""
         if succ != 0:
             if ttype == ScalarTransferType.STR.value:
-                response = self.client_socket.recv(size)
-                self.client_socket.close()
-                raise StateClientError(response.decode())
-            self.client_socket.close()
-            raise StateClientError("Failed to get value")
+                response = recv_exact(self.client_socket, size)
+                raise ServerResponseError(response.decode())
+            raise ServerResponseError("Failed to get value")
+
+    def _pack_tensor_request(
+        self,
+        path: Union[str, int],
+        transfer_type: Optional[TransferType],
+        inplace_tensor: Optional[torch.Tensor],
+    ) -> bytes:
+        encoded_transfer_type = transfer_type.value if transfer_type else -1
+        encoded_size = inplace_tensor.numel() if inplace_tensor is not None else -1
+        return _pack_request(_encode_path(path), encoded_transfer_type, encoded_size)
+
+    def _recv_tensor(self, request_id: int, inplace_tensor: Optional[torch.Tensor]) -> torch.Tensor:
+        """Receive a tensor response, allocating the tensor if none was given"""
+        # Unpack the header
+        ttype, size = self._recv_response_header(request_id)
+
+        # Unpack the dtype, shape and stride metadata
+        if inplace_tensor is None:
+            dtype, shape, stride = self._recv_tensor_metadata()
+            inplace_tensor = torch.empty_strided(shape, stride, dtype=dtype)
+
+        self._recv_tensor_payload(ttype, size, inplace_tensor)
+        return inplace_tensor
+
+    def _recv_tensor_metadata(self) -> Tuple[torch.dtype, Tuple[int, ...], Tuple[int, ...]]:
+        """Receive the dtype, shape and stride following a response header, recording
+        the snapshot version in last_version"""
+        dtype_code, ndim, self.last_version = struct.unpack('iiq', recv_exact(self.client_socket, 16))
+        dims = struct.unpack(f'{2 * ndim}q', recv_exact(self.client_socket, 16 * ndim))
+        return DTYPE_CODES[dtype_code], dims[:ndim], dims[ndim:]
+
+    def _recv_tensor_payload(self, ttype: int, size: int, inplace_tensor: torch.Tensor) -> None:
+        """Receive the data of a tensor into inplace_tensor"""
+        if ttype not in TRANSFER_TYPE_VALUES:
+            raise StateClientError(f"Unsupported transfer type: {ttype}")
+        if size != inplace_tensor.numel():
+            raise StateClientError(f"Received {size} elements doesn't match tensor size {inplace_tensor.numel()}")
+
+        # Receive the tensor data directly into the tensor storage,
+        # upcasting or dequantizing from the transfer type if needed
+        recv_into_tensor(self.client_socket.fileno(), inplace_tensor, ttype)
 
     def get_tensor(
         self,
-        path: str,
+        path: Union[str, int],
         transfer_type: Optional[TransferType] = None,
         inplace_tensor: Optional[torch.Tensor] = None,
+        num_connections: int = 1,
     ) -> torch.Tensor:
+        """Fetch one tensor, into inplace_tensor if given.
+
+        With num_connections > 1 the tensor is split into that many element ranges,
+        fetched in parallel over separate connections of the same transport and
+        priority class, so a single large tensor can use the bandwidth of several
+        streams.
+        """
+        if num_connections > 1:
+            return self._get_tensor_striped(path, transfer_type, inplace_tensor, num_connections)
+
         # Pack the request
-        encoded_transfer_type = transfer_type.value if transfer_type else -1
-        encoded_size = inplace_tensor.numel() if inplace_tensor is None else -1
-        packed_request = _pack_request(path, encoded_transfer_type, encoded_size)
+        packed_request = self._pack_tensor_request(path, transfer_type, inplace_tensor)
 
-        # Reset socket connection
-        self._init_socket()
+        failed = True
+        try:
+            request_id = self._send_request(packed_request)
+            inplace_tensor = self._recv_tensor(request_id, inplace_tensor)
+            failed = False
+            return inplace_tensor
+
+        except ServerResponseError:
+            # Server errors leave a persistent connection in a consistent state
+            failed = not self.persistent
+            raise
+
+        finally:
+            self._finish_request(failed)
+
+    def _get_tensor_striped(
+        self,
+        path: Union[str, int],
+        transfer_type: Optional[TransferType],
+        inplace_tensor: Optional[torch.Tensor],
+        num_connections: int,
+    ) -> torch.Tensor:
+        if inplace_tensor is None:
+            # The listing has everything needed to allocate, without fetching any data,
+            # and lists just the one tensor of a key ID
+            infos = self.list_tensors(_encode_path(path))
+            info = next((i for i in infos if i.path == path or i.key_id == path), None)
+            if info is None:
+                raise StateClientError(f"Tensor {path} not found on the server")
+            inplace_tensor = torch.empty_strided(info.shape, info.stride, dtype=info.dtype)
 
+        numel = inplace_tensor.numel()
+        stripe = -(-numel // num_connections)
+        stripe = max(STRIPE_ALIGNMENT, -(-stripe // STRIPE_ALIGNMENT) * STRIPE_ALIGNMENT)
+        ranges = [(start, min(stripe, numel - start)) for start in range(0, numel, stripe)]
+
+        # Every range has its own connection, of the same transport and priority
+        # class as this one, and the receives run without the GIL
+        def fetch(start: int, count: int) -> None:
+            client = type(self)(self.url, **self._connection_settings())
+            try:
+                client._get_tensor_range(path, transfer_type, inplace_tensor, start, count)
+            finally:
+                client.close()
+
+        with ThreadPoolExecutor(max_workers=len(ranges) or 1) as executor:
+            for future in [executor.submit(fetch, start, count) for start, count in ranges]:
+                future.result()
+        return inplace_tensor
+
+    def _get_tensor_range(
+        self,
+        path: Union[str, int],
+        transfer_type: Optional[TransferType],
+        tensor: torch.Tensor,
+        start: int,
+        count: int,
+        offset: Optional[int] = None,
+    ) -> None:
+        """Fetch elements [start, start + count) of a tensor into tensor, starting at
+        element offset (by default the same elements)."""
+        encoded_transfer_type = transfer_type.value if transfer_type else -1
+        body = struct.pack('=iqq', encoded_transfer_type, start, count)
+        packed_request = _pack_request(_encode_path(path), RequestType.RANGE.value, len(body)) + body
+
+        failed = True
         try:
-            # Send packed request
-            self.client_socket.sendall(packed_request)
+            request_id = self._send_request(packed_request)
+            ttype, size = self._recv_response_header(request_id)
+            if ttype not in TRANSFER_TYPE_VALUES:
+                raise StateClientError(f"Unsupported transfer type: {ttype}")
+            if size != count:
+                raise StateClientError(f"Received {size} elements for a range of {count}")
+            recv_into_tensor(self.client_socket.fileno(), tensor, ttype, start if offset is None else offset, count)
+            failed = False
+
+        except ServerResponseError:
+            failed = not self.persistent
+            raise
 
-            # Unpack the header
-            if inplace_tensor is None:
-                tensor_meta = self.client_socket.recv(64)
-                tensor_meta = struct.unpack('iiqiiiiiiiiiiii', tensor_meta)
-                succ, ttype, size = tensor_meta[0], tensor_meta[1], tensor_meta[2]
-                shapes = tuple(i for i in tensor_meta[3:9] if i != -1)
-                stride = tuple(i for i in tensor_meta[9:15] if i != -1)
+        finally:
+            self._finish_request(failed)
+
+    def get_tensor_delta(
+        self,
+        path: Union[str, int],
+        tensor: torch.Tensor,
+        version: int,
+        transfer_type: Optional[TransferType] = None,
+    ) -> int:
+        """Bring tensor, holding snapshot version of path, up to date in place.
+
+        Only the blocks that changed since version are fetched, or the whole tensor
+        if the server no longer knows that version. Returns the version tensor holds
+        afterwards.
+        """
+        encoded_transfer_type = transfer_type.value if transfer_type else -1
+        body = struct.pack('=iq', encoded_transfer_type, version)
+        packed_request = _pack_request(_encode_path(path), RequestType.DELTA.value, len(body)) + body
+
+        failed = True
+        try:
+            request_id = self._send_request(packed_request)
+            ttype, size = self._recv_response_header(request_id)
+            self._recv_tensor_metadata()
+            if ttype not in TRANSFER_TYPE_VALUES:
+                raise StateClientError(f"Unsupported transfer type: {ttype}")
+            if size != tensor.numel():
+                raise StateClientError(f"Received {size} elements doesn't match tensor size {tensor.numel()}")
 
-                inplace_tensor = torch.empty(size)
-                inplace_tensor.as_strided_(shapes, stride)
+            block_numel, num_runs = struct.unpack('qq', recv_exact(self.client_socket, 16))
+            if num_runs == -1:
+                recv_into_tensor(self.client_socket.fileno(), tensor, ttype)
             else:
-                resp_header = self.client_socket.recv(16)
-                succ, ttype, size = struct.unpack('iiq', resp_header)
+                runs = struct.unpack(f'{2 * num_runs}q', recv_exact(self.client_socket, 16 * num_runs))
+                for first, num_blocks in zip(runs[::2], runs[1::2]):
+                    start = first * block_numel
+                    count = min(num_blocks * block_numel, size - start)
+                    recv_into_tensor(self.client_socket.fileno(), tensor, ttype, start, count)
+            failed = False
+            return self.last_version
 
-            # Check for errors
-            self._handle_error_response(succ, ttype, size)
+        except ServerResponseError:
+            failed = not self.persistent
+            raise
 
-            # Get Codebook if needed
-            if ttype in TTYPE_TO_CODEBOOK_SIZE:
-                codebook_size = TTYPE_TO_CODEBOOK_SIZE[ttype]
-                _ = self.client_socket.recv(codebook_size)  # codebook currently unused
+        finally:
+            self._finish_request(failed)
 
-            # Receive the tensor data
-            elem_size = TTYPE_TO_ELEMENT_SIZE[ttype]
-            tensor_data = recv_exact(self.client_socket, elem_size * size)
-            copy_bytes_to_tensor(inplace_tensor, tensor_data)
+    def update_state_dict(
+        self,
+        prefix: str,
+        state_dict: dict,
+        version: int,
+        transfer_type: Optional[TransferType] = None,
+        max_rounds: int = 4,
+    ) -> int:
+        """Bring a state dict fetched with get_state_dict(prefix) at snapshot version
+        up to date in place, fetching only the changed blocks of each tensor.
 
-            return inplace_tensor
+        Tensors on the server that aren't in state_dict are skipped. If a snapshot
+        lands on the server while updating, the tensors updated before it are
+        brought up to that one too, so that the whole state dict ends up at a single
+        version, which is returned.
+
+        Catching up takes at most max_rounds passes over the tensors. If snapshots
+        keep landing faster than that, StateClientError is raised with state_dict
+        holding tensors of several versions; calling update_state_dict again with
+        the oldest of them, which the error reports, brings it to a single version.
+        """
+        if max_rounds < 1:
+            raise ValueError("max_rounds must be at least 1")
+        root = _pattern_root(prefix)
+        tensors = []
+        for info in self.list_tensors(prefix):
+            path = info.path
+            tensor = _lookup_tensor(state_dict, _parse_path(path[len(root):] if path.startswith(root) else path))
+            if tensor is not None:
+                tensors.append((path, tensor))
+
+        versions = {path: version for path, _ in tensors}
+        pending = tensors
+        for _ in range(max_rounds):
+            for path, tensor in pending:
+                versions[path] = self.get_tensor_delta(path, tensor, versions[path], transfer_type)
+            latest = max(versions.values(), default=version)
+            pending = [(path, tensor) for path, tensor in tensors if versions[path] != latest]
+            if not pending:
+                return latest
+        raise StateClientError(
+            f"{prefix} changed on every one of {max_rounds} update rounds, state_dict holds "
+            f"versions {min(versions.values())} to {max(versions.values())}"
+        )
+
+    def get_tensors(
+        self,
+        paths: List[Union[str, int]],
+        transfer_type: Optional[TransferType] = None,
+        inplace_tensors: Optional[List[torch.Tensor]] = None,
+        max_inflight: int = 16,
+    ) -> List[torch.Tensor]:
+        """Fetch several tensors over one persistent connection.
+
+        Up to max_inflight requests are pipelined ahead of the responses being read.
+        """
+        if not self.persistent:
+            raise StateClientError("get_tensors requires a persistent client")
+        if inplace_tensors is None:
+            inplace_tensors = [None] * len(paths)
+        if len(inplace_tensors) != len(paths):
+            raise ValueError("inplace_tensors must have one entry per path")
+
+        packed_requests = [
+            self._pack_tensor_request(path, transfer_type, tensor)
+            for path, tensor in zip(paths, inplace_tensors)
+        ]
+        request_ids = []
+        results = []
+        try:
+            for i in range(len(paths)):
+                # Keep the pipeline full before waiting on the oldest request
+                while len(request_ids) < min(len(paths), i + max_inflight):
+                    request_ids.append(self._send_request(packed_requests[len(request_ids)]))
+                results.append(self._recv_tensor(request_ids[i], inplace_tensors[i]))
+            return results
+
+        except Exception:
+            # Responses to the remaining in-flight requests are still on the wire
+            self.close()
+            raise
+
+    def get_state_dict(
+        self,
+        prefix: str = "",
+        paths: Optional[List[Union[str, int]]] = None,
+        transfer_type: Optional[TransferType] = None,
+        inplace: Optional[dict] = None,
+        arena: Optional["TensorArena"] = None,
+    ) -> dict:
+        """Fetch every tensor matching prefix (and any extra paths) in one response.
+
+        prefix may contain '*' wildcards, e.g. '[model][model.layers.*]'. The result is
+        a nested dict relative to the literal part of the prefix, so that
+        get_state_dict('[model]', inplace=model.state_dict()) fills the model tensors
+        in place. Tensors not found in inplace are freshly allocated, with the layout
+        they have on the server, or as contiguous views into a single new buffer of
+        arena if one is given.
+        """
+        encoded_transfer_type = transfer_type.value if transfer_type else -1
+        body = struct.pack('i', encoded_transfer_type) + '\n'.join(_encode_path(p) for p in paths or []).encode()
+        packed_request = _pack_request(prefix, RequestType.BATCH.value, len(body)) + body
+        root = _pattern_root(prefix)
+
+        failed = True
+        try:
+            request_id = self._send_request(packed_request)
+            _, manifest_size = self._recv_response_header(request_id)
+            self.last_version, entries = _unpack_manifest(recv_exact(self.client_socket, manifest_size))
+
+            self._record_key_ids(entries)
+            parts, tensors = self._allocate_state_dict(root, entries, inplace, arena)
+
+            result = {}
+            for info, tensor_parts, tensor in zip(entries, parts, tensors):
+                self._recv_tensor_payload(info.transfer_type, info.numel, tensor)
+                _insert_nested(result, tensor_parts, tensor)
+
+            failed = False
+            return result
+
+        except ServerResponseError:
+            failed = not self.persistent
+            raise
 
         finally:
-            self.client_socket.close()
+            self._finish_request(failed)
+
+    def get_object(
+        self,
+        path: str = "",
+        transfer_type: Optional[TransferType] = None,
+        inplace: Optional[Any] = None,
+        arena: Optional["TensorArena"] = None,
+        max_rounds: int = 4,
+    ) -> Any:
+        """Fetch the value at path, the whole state dict if empty, scalars, containers
+        and tensors alike, e.g. an optimizer or LR scheduler state dict to pass to
+        load_state_dict.
+
+        Everything but the tensors arrives as one skeleton response, rebuilt natively,
+        instead of a request per scalar. The tensors it references then come in one
+        batch response, filled in place into the tensors at the same keys of inplace
+        if given, like get_state_dict does. Both responses are from the same snapshot.
+
+        If a snapshot lands between the two, both are fetched again, for at most
+        max_rounds batch responses. If snapshots keep landing faster than that,
+        StateClientError is raised, with the tensors of inplace filled from the last
+        snapshot fetched.
+        """
+        if max_rounds < 1:
+            raise ValueError("max_rounds must be at least 1")
+        root = _pattern_root(path)
+        if root != path:
+            raise ValueError("get_object takes a path, not a pattern")
+        if root and inplace is not None:
+            # get_state_dict is asked for whole paths, so inplace has to be nested the same
+            scoped: dict = {}
+            _insert_nested(scoped, _parse_path(root), inplace)
+            inplace = scoped
+
+        version, skeleton = self._get_skeleton(path)
+        key_ids = list(dict.fromkeys(skeleton_key_ids(skeleton)))
+        for _ in range(max_rounds):
+            state_dict = self.get_state_dict("", key_ids, transfer_type, inplace, arena)
+            tensors_version = self.last_version
+            paths = {key_id: p for p, key_id in self.key_ids.items()}
+            tensors = {key_id: _lookup_tensor(state_dict, _parse_path(paths[key_id])) for key_id in key_ids}
+            if tensors_version == version:
+                break
+            # A snapshot was published in between, take the skeleton of the one the
+            # tensors come from, which may reference other tensors
+            version, skeleton = self._get_skeleton(path)
+            key_ids = list(dict.fromkeys(skeleton_key_ids(skeleton)))
+            if tensors_version == version and all(key_id in tensors for key_id in key_ids):
+                break
+        else:
+            raise StateClientError(
+                f"{path} changed on every one of {max_rounds} rounds, the last tensors fetched are of "
+                f"version {tensors_version} and the skeleton of version {version}"
+            )
+
+        self.last_version = version
+        return decode_skeleton(skeleton, tensors)
+
+    def _get_skeleton(self, path: str) -> Tuple[int, bytes]:
+        """The snapshot version and the skeleton of the value at path."""
+        response = self._control_request(RequestType.SKELETON, path)
+        version, = struct.unpack_from('q', response)
+        return version, response[8:]
+
+    def _allocate_state_dict(
+        self,
+        root: str,
+        entries: List[TensorInfo],
+        inplace: Optional[dict],
+        arena: Optional["TensorArena"],
+    ) -> Tuple[List[List[Any]], List[torch.Tensor]]:
+        """Pick the tensor each manifest entry is received into, and its path parts
+        relative to root, like get_state_dict does."""
+        parts = []
+        tensors = []
+        for info in entries:
+            path = info.path
+            parts.append(_relative_parts(root, path))
+            tensor = _lookup_tensor(inplace, parts[-1]) if inplace is not None else None
+            tensors.append(tensor if tensor is not None and tensor.numel() == info.numel else None)
+
+        missing = [i for i, tensor in enumerate(tensors) if tensor is None]
+        if arena is not None and missing:
+            for i, tensor in zip(missing, arena.allocate([entries[i] for i in missing])):
+                tensors[i] = tensor
+        else:
+            for i in missing:
+                tensors[i] = torch.empty_strided(entries[i].shape, entries[i].stride, dtype=entries[i].dtype)
+        return parts, tensors
+
+    def list_tensors(self, prefix: str = "") -> List[TensorInfo]:
+        """Describe every tensor on the server whose path matches prefix, without fetching any data.
+
+        prefix may contain '*' wildcards like in get_state_dict, or be a '#'-prefixed
+        key ID to describe that one tensor. The key IDs of the listed tensors are
+        recorded in key_ids.
+        """
+        packed_request = _pack_request(prefix, RequestType.LIST.value, 0)
+
+        failed = True
+        try:
+            request_id = self._send_request(packed_request)
+            _, manifest_size = self._recv_response_header(request_id)
+            self.last_version, entries = _unpack_manifest(recv_exact(self.client_socket, manifest_size))
+            self._record_key_ids(entries)
+            failed = False
+            return entries
+
+        except ServerResponseError:
+            failed = not self.persistent
+            raise
+
+        finally:
+            self._finish_request(failed)
+
+    def _control_request(self, request_type: RequestType, path: str, body: bytes = b"") -> bytes:
+        """Send a control request with a body and return the body of the response."""
+        packed_request = _pack_request(path, request_type.value, len(body)) + body
+
+        failed = True
+        try:
+            request_id = self._send_request(packed_request)
+            _, size = self._recv_response_header(request_id)
+            response = recv_exact(self.client_socket, size)
+            failed = False
+            return response
+
+        except ServerResponseError:
+            failed = not self.persistent
+            raise
+
+        finally:
+            self._finish_request(failed)
+
+    def subscribe(
+        self,
+        prefix: str = "",
+        paths: Optional[List[Union[str, int]]] = None,
+        transfer_type: Optional[TransferType] = None,
+        inplace: Optional[dict] = None,
+        arena: Optional["TensorArena"] = None,
+        version: Optional[int] = None,
+    ) -> "Subscription":
+        """Have the server push the tensors matching prefix (and any extra paths) after
+        every snapshot it publishes, instead of polling with get_state_dict. Only
+        snapshots after version are pushed, the current one too if it is newer.
+        See Subscription."""
+        from torchstate.subscription import Subscription
+        return Subscription(self.url, prefix, paths, transfer_type, inplace, arena, version)
+
+    def get_stats(self) -> str:
+        """Fetch the metrics of the server, in the Prometheus text format."""
+        return self._control_request(RequestType.STATS, "").decode()
+
+    def _record_key_ids(self, entries: List[TensorInfo]) -> None:
+        for info in entries:
+            if info.key_id != -1:
+                self.key_ids[info.path] = info.key_id
 
     def _get_scalar(self, path: str, scalar_type: ScalarTransferType, expected_type: Type[T]) -> T:
         """Generic method to handle scalar data retrieval"""
@@ -121,31 +710,31 @@ class StateClient:
         else:
             packed_request = _pack_request(path, scalar_type.value, size)
 
-        # Reset socket connection
-        self._init_socket()
-        
+        failed = True
         try:
             # Send request
-            self.client_socket.sendall(packed_request)
+            request_id = self._send_request(packed_request)
 
             # Receive and parse header
-            resp_header = self.client_socket.recv(16)
-            succ, ttype, recv_size = struct.unpack('iiq', resp_header)
-            
-            # Check for errors
-            self._handle_error_response(succ, ttype, recv_size)
+            _, recv_size = self._recv_response_header(request_id)
 
             # Handle string separately
             if scalar_type == ScalarTransferType.STR:
-                data = self.client_socket.recv(recv_size)
+                data = recv_exact(self.client_socket, recv_size)
+                failed = False
                 return data.decode()
 
             # Handle other scalar types
-            data = self.client_socket.recv(size)
+            data = recv_exact(self.client_socket, size)
+            failed = False
             return struct.unpack(fmt, data)[0]
 
+        except ServerResponseError:
+            failed = not self.persistent
+            raise
+
         finally:
-            self.client_socket.close()
+            self._finish_request(failed)
 
     def get_float(self, path: str) -> float:
         return self._get_scalar(path, ScalarTransferType.FLOAT64, float)
@@ -157,4 +746,30 @@ class StateClient:
         return self._get_scalar(path, ScalarTransferType.STR, str)
 
     def get_bool(self, path: str) -> bool:
-        return self._get_scalar(path, ScalarTransferType.BOOL8, bool)
\ No newline at end of file
+        return self._get_scalar(path, ScalarTransferType.BOOL8, bool)
+
+def _rdma_client(url: str, **kwargs) -> StateClient:
+    from torchstate.rdma import RdmaStateClient
+    return RdmaStateClient(url, **kwargs)
+
+def _shm_client(url: str, **kwargs) -> StateClient:
+    from torchstate.shm import ShmStateClient
+    return ShmStateClient(url, **kwargs)
+
+# Client factories by URL scheme. Every transport talks the same protocol over a
+# control connection to the server on port, TCP to host or a Unix socket for shm,
+# and may move tensor data differently. Transports other than plain TCP are only
+# imported when used.
+TRANSPORTS: Dict[str, Callable[..., StateClient]] = {
+    "zbserver": StateClient,
+    "rdma": _rdma_client,
+    "shm": _shm_client,
+}
+
+def connect(url: str, **kwargs) -> StateClient:
+    """Create a client for url with the transport named by its scheme, TCP if it
+    has none. kwargs are passed to the client class."""
+    scheme, sep, _ = url.rpartition("://")
+    if sep and scheme not in TRANSPORTS:
+        raise ValueError(f"Unsupported URL scheme: {scheme}")
+    return TRANSPORTS[scheme if sep else "zbserver"](url, **kwargs)
@@ -0,0 +1,224 @@
+from typing import TYPE_CHECKING, Dict, Iterable, List, Optional, Tuple, Union
+import struct
+import threading
+import torch
+from torchstate.client import StateClient, StateClientError, TensorInfo, _encode_path, _insert_nested, _pattern_root, _unpack_manifest
+from torchstate.ttype_consts import RequestType, TransferType
+
+if TYPE_CHECKING:
+    from torchstate.arena import TensorArena
+
+# Memory region of a manifest entry: address, size in bytes and remote key. A size
+# of -1 marks a tensor that can't be read remotely and has to be fetched over TCP.
+REGION_FORMAT = '=QqI'
+REGION_SIZE = struct.calcsize(REGION_FORMAT)
+
+Region = Tuple[int, int, int]
+
+def _open_context(device: str, port: int, gid_index: int):
+    # The extension needs libibverbs, so it is only built once RDMA is used
+    from torchstate.C.rdma import RdmaContext
+    return RdmaContext(device, port, gid_index)
+
+def _storage_tensor(tensor: torch.Tensor) -> torch.Tensor:
+    """A flat uint8 tensor covering the whole storage of tensor."""
+    return torch.empty(0, dtype=torch.uint8, device=tensor.device).set_(tensor.untyped_storage())
+
+class RdmaServer:
+    """The RDMA side of a StateServer: the queue pairs of connected clients and the
+    memory regions they read tensors from.
+
+    Clients read with one-sided RDMA READs, so the server CPU is only involved in
+    connecting and looking up regions, never per byte. Contiguous CPU tensors are
+    registered on first use, CUDA tensors too if GPUDirect RDMA is available.
+    """
+
+    def __init__(self, device: str = "", port: int = 1, gid_index: int = -1):
+        self.context = _open_context(device, port, gid_index)
+        self._endpoints: Dict[bytes, object] = {}
+        self._regions: Dict[Tuple[int, int], object] = {}
+        self._retired: Dict[Tuple[int, int], object] = {}
+        self._lock = threading.Lock()
+
+    def connect(self, client_info: bytes) -> bytes:
+        """Set up the server end of a queue pair to a client, returning its details."""
+        endpoint = self.context.endpoint()
+        endpoint.connect(client_info)
+        with self._lock:
+            self._endpoints[client_info] = endpoint
+        return endpoint.info()
+
+    def disconnect(self, client_info: bytes) -> None:
+        with self._lock:
+            self._endpoints.pop(client_info, None)
+
+    def region(self, tensor: torch.Tensor) -> bytes:
+        """Pack the memory region clients read tensor from, registering it if needed."""
+        if not tensor.is_contiguous() or not (tensor.device.type == "cpu" or tensor.is_cuda):
+            return struct.pack(REGION_FORMAT, 0, -1, 0)
+        nbytes = tensor.numel() * tensor.element_size()
+        if nbytes == 0:
+            return struct.pack(REGION_FORMAT, 0, 0, 0)
+
+        key = (tensor.data_ptr(), nbytes)
+        with self._lock:
+            region = self._regions.get(key) or self._retired.pop(key, None)
+            if region is None:
+                region = self.context.register_tensor(tensor)
+            self._regions[key] = region
+        return struct.pack(REGION_FORMAT, region.addr, region.nbytes, region.rkey)
+
+    def retire(self, tensors: Iterable[torch.Tensor]) -> None:
+        """Deregister the regions of tensors that are no longer served.
+
+        Regions stay registered for one more retirement after the tensors stop being
+        served, so clients that looked them up just before can finish reading.
+        """
+        keep = {(t.data_ptr(), t.numel() * t.element_size()) for t in tensors}
+        with self._lock:
+            self._retired = {key: region for key, region in self._regions.items() if key not in keep}
+            self._regions = {key: region for key, region in self._regions.items() if key in keep}
+
+    def close(self) -> None:
+        with self._lock:
+            self._endpoints.clear()
+            self._regions.clear()
+            self._retired.clear()
+
+class RdmaStateClient(StateClient):
+    """StateClient for rdma:// URLs, reading tensors with one-sided RDMA READs.
+
+    Requests and metadata go over a persistent TCP connection to host:port, tensor
+    data is read by the adapters straight from the server's registered memory
+    into the destination tensors. Reads that need a conversion (an explicit
+    transfer_type), and tensors the server can't expose, go over TCP as usual.
+    """
+
+    def __init__(self, url: str, device: str = "", port: int = 1, gid_index: int = -1):
+        super().__init__(url, persistent=True)
+        self.context = _open_context(device, port, gid_index)
+        self._endpoint = None
+        self._endpoint_info: Optional[bytes] = None
+
+    def close(self):
+        """Tear down the queue pair and close the control connection."""
+        endpoint_info, self._endpoint_info = self._endpoint_info, None
+        self._endpoint = None
+        if endpoint_info is not None and self.client_socket is not None:
+            try:
+                self._control_request(RequestType.RDMA_DISCONNECT, "", endpoint_info)
+            except (OSError, StateClientError):
+                pass  # The server drops it along with the connection state
+        super().close()
+
+    def get_tensor(
+        self,
+        path: Union[str, int],
+        transfer_type: Optional[TransferType] = None,
+        inplace_tensor: Optional[torch.Tensor] = None,
+        num_connections: int = 1,
+    ) -> torch.Tensor:
+        """Read one tensor, into inplace_tensor if given."""
+        if num_connections > 1:
+            # Every connection would need a queue pair of its own, and one-sided
+            # reads don't need the streams anyway
+            raise ValueError("rdma:// clients don't stripe tensors over several connections")
+        if transfer_type is not None:
+            return super().get_tensor(path, transfer_type, inplace_tensor, num_connections)
+
+        _, infos, regions = self._get_regions(_encode_path(path))
+        matches = [(info, region) for info, region in zip(infos, regions) if info.path == path or info.key_id == path]
+        if not matches:
+            raise StateClientError(f"Tensor {path} not found on the server")
+        info, region = matches[0]
+        if inplace_tensor is None:
+            inplace_tensor = torch.empty_strided(info.shape, info.stride, dtype=info.dtype)
+        self._read([(info, region, inplace_tensor)])
+        return inplace_tensor
+
+    def get_state_dict(
+        self,
+        prefix: str = "",
+        paths: Optional[List[Union[str, int]]] = None,
+        transfer_type: Optional[TransferType] = None,
+        inplace: Optional[dict] = None,
+        arena: Optional["TensorArena"] = None,
+    ) -> dict:
+        """Read every tensor matching prefix, like StateClient.get_state_dict.
+
+        All reads are posted at once and complete without any further round trip.
+        Restoring into an arena registers a single buffer instead of every tensor.
+        """
+        if paths or transfer_type is not None:
+            return super().get_state_dict(prefix, paths, transfer_type, inplace, arena)
+
+        _, infos, regions = self._get_regions(prefix)
+        parts, tensors = self._allocate_state_dict(_pattern_root(prefix), infos, inplace, arena)
+        self._read(list(zip(infos, regions, tensors)))
+
+        result = {}
+        for tensor_parts, tensor in zip(parts, tensors):
+            _insert_nested(result, tensor_parts, tensor)
+        return result
+
+    def _get_regions(self, path: str) -> Tuple[int, List[TensorInfo], List[Region]]:
+        """The snapshot version, manifest and memory regions of the tensors at path."""
+        body = self._control_request(RequestType.RDMA_REGIONS, path)
+        manifest_size, = struct.unpack_from('q', body)
+        version, infos = _unpack_manifest(body[8:8 + manifest_size])
+        self.last_version = version
+        self._record_key_ids(infos)
+        offset = 8 + manifest_size
+        regions = [struct.unpack_from(REGION_FORMAT, body, offset + i * REGION_SIZE) for i in range(len(infos))]
+        return version, infos, regions
+
+    def _connect_endpoint(self):
+        if self._endpoint is None:
+            endpoint = self.context.endpoint()
+            server_info = self._control_request(RequestType.RDMA_CONNECT, "", endpoint.info())
+            endpoint.connect(server_info)
+            self._endpoint, self._endpoint_info = endpoint, endpoint.info()
+        return self._endpoint
+
+    def _read(self, items: List[Tuple[TensorInfo, Region, torch.Tensor]]) -> None:
+        """Read every (info, region, tensor) item into its tensor.
+
+        Reads land directly in contiguous tensors of the sent dtype, others are
+        staged in a temporary and copied. The destination storages are registered
+        for the duration of the call.
+        """
+        endpoint = self._connect_endpoint()
+        local_regions: Dict[int, object] = {}
+        staged = []
+        over_tcp = []
+        for info, (addr, nbytes, rkey), tensor in items:
+            if tensor.numel() != info.numel:
+                raise StateClientError(f"{info.path} has {info.numel} elements, can't read into {tensor.numel()}")
+            if nbytes < 0:
+                over_tcp.append((info, tensor))
+                continue
+            dst = tensor
+            if not tensor.is_contiguous() or tensor.dtype != info.dtype:
+                dst = torch.empty(info.shape, dtype=info.dtype, device=tensor.device)
+                staged.append((tensor, dst))
+            if nbytes == 0:
+                continue
+
+            storage = _storage_tensor(dst)
+            region = local_regions.get(storage.data_ptr())
+            if region is None:
+                region = local_regions[storage.data_ptr()] = self.context.register_tensor(storage)
+            endpoint.read(region, dst.data_ptr() - storage.data_ptr(), addr, rkey, nbytes)
+
+        try:
+            endpoint.wait()
+        except RuntimeError as e:
+            # A failed read leaves the queue pair in the error state
+            self._endpoint = None
+            self._endpoint_info = None
+            raise StateClientError(str(e)) from e
+
+        for tensor, dst in staged:
+            tensor.copy_(dst.view(tensor.shape))
+        for info, tensor in over_tcp:
+            super().get_tensor(info.path, None, tensor)
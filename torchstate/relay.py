@@ -0,0 +1,84 @@
+from typing import Optional, Tuple
+import struct
+import time
+from torchstate.client import StateClient, _insert_nested, _parse_path, _pattern_root
+from torchstate.server import StateServer
+from torchstate.ttype_consts import TransferType, RequestType
+
+class RelayStateClient:
+    """Fetch a state dict through the relay tree of an origin server, then re-serve it.
+
+    The origin picks where the prefix is fetched from, either itself or a client that
+    fetched it earlier in the same transfer type and snapshot. Once fetched, the
+    state dict is served from host:port by a StateServer of this client, under the
+    same paths, until close() is called. The relayed tensors are the values at the
+    time they were fetched.
+    """
+
+    def __init__(self, origin_url: str, host: str, port: int, advertised_host: Optional[str] = None):
+        self.origin = StateClient(origin_url)
+        self.host = host
+        self.port = port
+        self.url = f"zbserver://{advertised_host or host}:{port}"
+        self.server: Optional[StateServer] = None
+
+    def get_state_dict(self, prefix: str, transfer_type: Optional[TransferType] = None) -> dict:
+        """Fetch the tensors matching prefix like StateClient.get_state_dict, and start
+        serving them to later clients."""
+        encoded_transfer_type = transfer_type.value if transfer_type else -1
+        while True:
+            source, version = self._acquire_source(prefix, encoded_transfer_type)
+            # The slot taken on the source is given back on every way out, and the
+            # relay only announced once it serves what it fetched
+            url, source_failed = "", False
+            try:
+                client = StateClient(source or self.origin.url)
+                result = client.get_state_dict(prefix, transfer_type=transfer_type)
+                version = client.last_version
+                self._serve(prefix, result)
+                url = self.url
+                return result
+            except (ConnectionError, OSError):
+                if not source:
+                    raise
+                # The relay went away, have the origin drop it and pick another source
+                source_failed = True
+            finally:
+                body = f"{url}\n{source}\n{int(source_failed)}\n{encoded_transfer_type}\n{version}".encode()
+                self._control(RequestType.RELAY_ANNOUNCE, prefix, body)
+
+    def close(self):
+        if self.server is not None:
+            self.server.stop()
+            self.server = None
+
+    def _acquire_source(self, prefix: str, transfer_type: int) -> Tuple[str, int]:
+        """Take a slot on the source the origin picks for prefix, asking again for as
+        long as every source is busy. Returns its URL, empty for the origin, and the
+        snapshot version it serves."""
+        begin = time.monotonic()
+        while True:
+            body = struct.pack('=id', transfer_type, time.monotonic() - begin)
+            response = self._control(RequestType.RELAY_SOURCE, prefix, body)
+            version, retry_after = struct.unpack_from('=qd', response)
+            if retry_after <= 0:
+                return response[struct.calcsize('=qd'):].decode(), version
+            time.sleep(retry_after)
+
+    def _serve(self, prefix: str, result: dict) -> None:
+        """Serve a fetched state dict under the full paths, the result is relative to
+        the literal prefix."""
+        root = _pattern_root(prefix)
+        served = {}
+        if root:
+            _insert_nested(served, _parse_path(root), result)
+        else:
+            served = result
+        if self.server is not None:
+            self.server.stop()
+        self.server = StateServer(served, host=self.host, port=self.port)
+        self.server.start()
+
+    def _control(self, request_type: RequestType, prefix: str, body: bytes) -> bytes:
+        """Send a relay control request to the origin and return the response body."""
+        return self.origin._control_request(request_type, prefix, body)
@@ -1,15 +1,33 @@
 import torch
-from typing import Any, Dict, Union, Optional
+from typing import Any, Dict, Iterable, Iterator, List, NamedTuple, Tuple, Union, Optional
+from collections import OrderedDict
+from contextlib import contextmanager
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+import os
+import re
 import struct
 import socket
 import threading
-from torchstate.C.utils import get_bytes_from_tensor
+import time
+from torchstate.C.utils import (
+    EncodingCache, Metrics, Scheduler, encode_skeleton, send_tensor, DEFAULT_CHUNK_SIZE, WITH_CODECS
+)
 from torchstate.logging import get_logger
-from torchstate.ttype_consts import TransferType, ScalarTransferType
+from torchstate.snapshot import (
+    Snapshot, SnapshotBuffers, LIVE_VERSION, take_snapshot, hash_snapshot, changed_block_runs, delta_block_numel
+)
+from torchstate.ttype_consts import (
+    TransferType, ScalarTransferType, RequestType, Priority, DTYPE_TO_CODE, TRANSFER_TYPE_VALUES, COMPRESSED_TTYPES
+)
 
 class StateServerError(Exception):
     pass
 
+class StalledClientError(StateServerError):
+    """The body of a request didn't arrive in time. Nothing more can be read off the
+    connection, which is closed."""
+    pass
+
 def get_nested_value(d: Dict, path: str) -> Any:
     """Extract nested value from dictionary using path notation.
     
@@ -27,31 +45,438 @@ def get_nested_value(d: Dict, path: str) -> Any:
     except (KeyError, TypeError):
         raise StateServerError(f"Path {path} not found in state dictionary")
 
+def flatten_state_dict(d: Any, prefix: str = "") -> Iterator[Tuple[str, Any]]:
+    """Yield (path, value) for every leaf of a nested state dictionary.
+
+    Paths use the same bracket notation that get_nested_value resolves.
+    """
+    if isinstance(d, dict):
+        items = d.items()
+    elif isinstance(d, (list, tuple)):
+        items = enumerate(d)
+    else:
+        yield prefix, d
+        return
+
+    for key, value in items:
+        yield from flatten_state_dict(value, f"{prefix}[{key}]")
+
+class IndexEntry(NamedTuple):
+    """A tensor of the state dict, with its metadata resolved once at indexing time."""
+    key_id: int
+    path: str
+    tensor: torch.Tensor
+    dtype: torch.dtype
+    shape: Tuple[int, ...]
+    stride: Tuple[int, ...]
+    nbytes: int
+
+def compile_path_pattern(pattern: str) -> "re.Pattern":
+    """Compile a path prefix pattern where '*' matches any run of characters.
+
+    The pattern matches every path that starts with it, so '[model]' selects the
+    whole model and '[model][model.layers.*]' every layer parameter.
+    """
+    return re.compile(re.escape(pattern).replace(r'\*', '.*'))
+
+# Longest a client waits for a relay source with a free slot before being
+# sent to the least loaded one anyway
+RELAY_WAIT_TIMEOUT = 30.0
+# How long a client waits before asking again while every source is busy
+RELAY_RETRY_INTERVAL = 0.25
+# Longest the body of a request may take to arrive by default, in seconds
+DEFAULT_BODY_TIMEOUT = 30.0
+
+class RelayCoordinator:
+    """Decides which source each client fetches a prefix from.
+
+    Clients that finished fetching a prefix announce a server re-serving it, and
+    become sources for the clients after them. A source serves at most fanout
+    clients at a time, and new clients are told to retry while none has a free
+    slot, which is usually soon freed by a relay that has just announced itself.
+    The fetched data so spreads as a tree, and recovering N clients takes about
+    log(N) rounds instead of N transfers out of the origin.
+
+    Relays only serve clients asking for the transfer type they fetched in, and
+    are all dropped when a new snapshot is published, so that nobody gets lossy
+    or stale copies of what the origin would send.
+    """
+
+    ORIGIN = ""
+
+    def __init__(self, fanout: int = 2, timeout: float = RELAY_WAIT_TIMEOUT):
+        self.fanout = fanout
+        self.timeout = timeout
+        # Relays by the prefix, transfer type and snapshot version they serve
+        self._sources: Dict[Tuple[str, int, int], List[str]] = {}
+        self._load: Dict[str, int] = {}
+        self._version = LIVE_VERSION
+        self._lock = threading.Lock()
+
+    @property
+    def version(self) -> int:
+        """The snapshot version relays have to hold to be handed out."""
+        return self._version
+
+    def acquire(self, prefix: str, transfer_type: int, waited: float) -> Optional[str]:
+        """Take a slot on the source for a new client of prefix in transfer_type, which
+        has been waiting for one for waited seconds. ORIGIN means this server, None
+        that every source is busy and the client should ask again later."""
+        with self._lock:
+            # The origin first among equals
+            candidates = [self.ORIGIN] + self._sources.get((prefix, transfer_type, self._version), [])
+            source = min(candidates, key=lambda url: self._load.get(url, 0))
+            if self._load.get(source, 0) >= self.fanout and waited < self.timeout:
+                return None
+            self._load[source] = self._load.get(source, 0) + 1
+            return source
+
+    def announce(self, prefix: str, transfer_type: int, version: int, url: str, source: str) -> None:
+        """Free the slot a client took on source, and record that url serves prefix in
+        transfer_type as of version. An empty url only frees the slot, e.g. after a
+        failed fetch, and so does a version that is no longer current."""
+        with self._lock:
+            if self._load.get(source, 0) > 0:
+                self._load[source] -= 1
+            if url and version == self._version:
+                sources = self._sources.setdefault((prefix, transfer_type, version), [])
+                if url not in sources:
+                    sources.append(url)
+
+    def remove(self, url: str) -> None:
+        """Stop handing out a relay, e.g. one a client failed to fetch from."""
+        with self._lock:
+            for sources in self._sources.values():
+                if url in sources:
+                    sources.remove(url)
+            self._load.pop(url, None)
+
+    def reset(self, version: int) -> None:
+        """Drop every relay once the snapshot at version is published, since they all
+        hold older ones. Slots taken on them are still freed by their clients."""
+        with self._lock:
+            self._version = version
+            self._sources.clear()
+
+def parse_announce_body(body: bytes) -> Tuple[str, str, bool, int, int]:
+    """Split a RELAY_ANNOUNCE body into (url, source, source_failed, transfer_type, version)."""
+    url, source, failed, transfer_type, version = body.decode().split('\n')
+    return url, source, failed == "1", int(transfer_type), int(version)
+
+def _metrics_handler(metrics: Metrics) -> type:
+    """HTTP handler answering every GET with the metrics, for Prometheus to scrape."""
+    class MetricsHandler(BaseHTTPRequestHandler):
+        def do_GET(self):
+            body = metrics.prometheus().encode()
+            self.send_response(200)
+            self.send_header("Content-Type", "text/plain; version=0.0.4")
+            self.send_header("Content-Length", str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+
+        def log_message(self, format, *args):
+            pass
+    return MetricsHandler
+
 class StateServer:
-    def __init__(self, state_dict: dict, host: str = "0.0.0.0", port: int = 12345):
+    def __init__(
+        self,
+        state_dict: dict,
+        host: str = "0.0.0.0",
+        port: int = 12345,
+        native: bool = False,
+        num_workers: int = 8,
+        io_uring: bool = False,
+        chunk_size: int = DEFAULT_CHUNK_SIZE,
+        relay_fanout: int = 2,
+        delta_versions: int = 0,
+        rdma_device: Optional[str] = None,
+        rdma_gid_index: int = -1,
+        shm: bool = False,
+        max_bandwidth: float = 0,
+        max_client_bandwidth: float = 0,
+        metrics_port: Optional[int] = None,
+        encoding_cache_size: int = 0,
+        snapshot_buffers: int = 3,
+        body_timeout: float = DEFAULT_BODY_TIMEOUT,
+    ):
         self.state_dict = state_dict
         self.host = host
         self.port = port
+        self.native = native
+        self.num_workers = num_workers
+        # Serve the connections of the native core from io_uring rings, one per worker
+        self.io_uring = io_uring
+        self.chunk_size = chunk_size
+        # Connections whose request body stalls for longer are closed, so that they
+        # don't hold a worker
+        self.body_timeout = body_timeout
         self._listen_socket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
         self._running = False
         self._server_thread = None
+        self._native_server = None
         self._logger = get_logger("StateServer")
+        self._index: Dict[str, IndexEntry] = {}
+        self._index_by_id: List[Optional[IndexEntry]] = []
+        self._relay = RelayCoordinator(relay_fanout)
+        self._snapshot: Optional[Snapshot] = None
+        self._snapshot_lock = threading.Lock()
+        # Snapshots are copied into snapshot_buffers reusable buffers of each kind:
+        # the current snapshot, the previous one until its last readers let go, and
+        # the one being taken. More are allocated while those are all busy.
+        self._snapshot_buffers = SnapshotBuffers(snapshot_buffers)
+        # Block hashes of the delta_versions latest snapshots, oldest first
+        self.delta_versions = delta_versions
+        self._block_hashes: "OrderedDict[int, Dict[str, torch.Tensor]]" = OrderedDict()
+        # Clients of rdma:// URLs read tensors from memory registered with this device
+        # ('' for the first one). gid_index is needed for RoCE.
+        self._rdma = None
+        if rdma_device is not None:
+            from torchstate.rdma import RdmaServer
+            self._rdma = RdmaServer(rdma_device, gid_index=rdma_gid_index)
+        # Clients of shm:// URLs on this host connect to a Unix socket named after
+        # the port, and map tensors in place. Snapshots are taken in shared memory.
+        self._shm = None
+        self._shm_socket = None
+        if shm:
+            from torchstate.shm import ShmServer
+            self._shm = ShmServer()
+        # Every payload frame, native or not, waits for its turn with the scheduler
+        self._scheduler = Scheduler()
+        self._scheduler.set_bandwidth(max_bandwidth, max_client_bandwidth)
+        # Client host and priority class of the connection served by this thread,
+        # and when its current request was read
+        self._connection = threading.local()
+        # Recorded by the Python handler and the native core alike, served to STATS
+        # requests and, with metrics_port, over HTTP for Prometheus to scrape
+        self._metrics = Metrics()
+        self.metrics_port = metrics_port
+        self._metrics_server = None
+        # Snapshot tensors are cast, quantized or compressed once per transfer type,
+        # by the first response sending them, and the payload is shared by all the
+        # others, native or not. encoding_cache_size bytes of payloads are kept, none by
+        # default.
+        self._encoding_cache = EncodingCache(encoding_cache_size, self._metrics)
+        # Tensors of the current snapshot by id, which are copies that never change,
+        # unlike the live tensors it falls back to. Holding them keeps their ids from
+        # being reused, and lookups compare the tensor itself, see _is_snapshot_copy.
+        self._snapshot_copies: Dict[int, torch.Tensor] = {}
+        # Subscribers wait for new snapshots on the condition
+        self._snapshot_published = threading.Condition(self._snapshot_lock)
+        self._subscribers: set = set()
+        self._closed = False
+        self.refresh_index()
+
+    def snapshot(self, step: int):
+        """Mark a step boundary, e.g. right after optimizer.step().
+
+        From the moment the copy of the state dict taken here is ready, requests are
+        served from it instead of the live tensors, and responses report step as
+        their version. CUDA tensors are copied asynchronously (see take_snapshot),
+        CPU tensors before returning. Tensors indexed after the last snapshot are
+        served live until the next one.
+
+        With delta_versions set, the snapshot is also hashed block by block, so that
+        clients holding one of the delta_versions latest snapshots can fetch only the
+        blocks changed since.
+
+        The copy reuses the memory of an earlier snapshot once no response, export
+        or registration references it any more, and is a fresh allocation while
+        the snapshot_buffers kept for reuse are all busy.
+        """
+        leaves = [(path, entry.tensor) for path, entry in self._index.items()]
+        leaves += [(path, value) for path, value in flatten_state_dict(self.state_dict)
+                   if not isinstance(value, torch.Tensor)]
+        take_snapshot(
+            step, leaves, self._publish_snapshot,
+            share_memory=self._shm is not None, buffers=self._snapshot_buffers,
+        )
+
+    def set_bandwidth(self, max_bandwidth: float = 0, max_client_bandwidth: float = 0):
+        """Cap the bandwidth of all responses together and of those to any one client
+        host, in bytes per second, 0 meaning no cap.
+
+        While the budget is short, responses to RECOVERY clients go before NORMAL
+        ones, which go before BACKGROUND ones, and the connections of one class
+        take turns chunk by chunk.
+        """
+        self._scheduler.set_bandwidth(max_bandwidth, max_client_bandwidth)
+
+    def pause(self):
+        """Hold back the payload of every response until resume(). Chunks already
+        being sent go out, requests are still read and answered afterwards."""
+        self._scheduler.pause()
+
+    def resume(self):
+        self._scheduler.resume()
+
+    @contextmanager
+    def during_step(self):
+        """Pause serving for the duration of the block, e.g. around the forward and
+        backward pass and the optimizer step, so that it doesn't compete with the
+        collectives and memory bandwidth of the step."""
+        self.pause()
+        try:
+            yield
+        finally:
+            self.resume()
+
+    def metrics(self) -> Dict[str, Any]:
+        """Counters and latency histograms of serving so far: requests by handler,
+        open connections, payload bytes by transfer type, send stalls, and the time
+        spent looking up tensors, to the first byte of a response and encoding."""
+        return self._metrics.as_dict()
+
+    def metrics_text(self) -> str:
+        """The metrics in the Prometheus text format, as served to STATS requests."""
+        return self._metrics.prometheus()
+
+    def _publish_snapshot(self, snapshot: Snapshot):
+        hashes = hash_snapshot(snapshot) if self.delta_versions > 0 else None
+        with self._snapshot_lock:
+            # Asynchronous copies may finish out of order, never go back in time
+            if self._snapshot is not None and self._snapshot.version >= snapshot.version:
+                return
+            self._snapshot_copies = {id(tensor): tensor for tensor in snapshot.tensors.values()}
+            self._snapshot = snapshot
+            self._encoding_cache.retire(snapshot.version)
+            self._relay.reset(snapshot.version)
+            if hashes is not None:
+                self._block_hashes[snapshot.version] = hashes
+                while len(self._block_hashes) > self.delta_versions:
+                    self._block_hashes.popitem(last=False)
+            if self._native_server is not None:
+                self._register_native_tensors()
+            self._retire_exports()
+            self._snapshot_published.notify_all()
+
+    def refresh_index(self):
+        """Rebuild the path index from the state dict.
+
+        Tensors are looked up through the index rather than by walking the state dict,
+        so this has to be called after tensors are added, removed or replaced (updating
+        them in place is fine). Paths keep their key ID across refreshes.
+        """
+        index = {}
+        for path, value in flatten_state_dict(self.state_dict):
+            if not isinstance(value, torch.Tensor):
+                continue
+            previous = self._index.get(path)
+            key_id = previous.key_id if previous is not None else len(self._index_by_id)
+            entry = IndexEntry(key_id, path, value, value.dtype, tuple(value.shape), value.stride(),
+                               value.numel() * value.element_size())
+            if key_id == len(self._index_by_id):
+                self._index_by_id.append(entry)
+            else:
+                self._index_by_id[key_id] = entry
+            index[path] = entry
+
+        # IDs of removed paths are never reused
+        for path, entry in self._index.items():
+            if path not in index:
+                self._index_by_id[entry.key_id] = None
+        self._index = index
+
+        if self._native_server is not None:
+            self._register_native_tensors()
+        self._retire_exports()
+
+    def _retire_exports(self):
+        """Let the RDMA regions and shared memory segments of tensors that are no
+        longer served go."""
+        snapshot = self._snapshot
+        served = [self._tensor_of(entry, snapshot) for entry in self._index.values()]
+        if self._rdma is not None:
+            self._rdma.retire(served)
+        if self._shm is not None:
+            self._shm.retire(served)
+
+    def _lookup_entry(self, path: str) -> Optional[IndexEntry]:
+        """Find the index entry of a request path, or of a '#'-prefixed key ID.
+
+        Raises:
+            StateServerError: If the key ID is not in the index.
+        """
+        if not path.startswith('#'):
+            return self._index.get(path)
+        try:
+            entry = self._index_by_id[int(path[1:])]
+        except (ValueError, IndexError):
+            entry = None
+        if entry is None:
+            raise StateServerError(f"Key ID {path[1:]} not found in index")
+        return entry
+
+    def _lookup(self, path: str, snapshot: Optional[Snapshot] = None) -> Any:
+        """Resolve a request path, or a '#'-prefixed key ID, to its value in snapshot
+        (or the live state dict if there is none).
+
+        Raises:
+            StateServerError: If nothing is stored under the path.
+        """
+        entry = self._lookup_entry(path)
+        if entry is not None:
+            return self._tensor_of(entry, snapshot)
+        if snapshot is not None and path in snapshot.scalars:
+            return snapshot.scalars[path]
+        # Scalars aren't indexed since they are usually replaced rather than updated in place
+        return get_nested_value(self.state_dict, path)
+
+    def _tensor_of(self, entry: IndexEntry, snapshot: Optional[Snapshot]) -> torch.Tensor:
+        """The tensor of an index entry as of snapshot."""
+        if snapshot is None:
+            return entry.tensor
+        return snapshot.tensors.get(entry.path, entry.tensor)
 
     def _pack_error_response(self, error_msg: str) -> bytes:
         """Pack an error response to send back to the client."""
         encoded_msg = error_msg.encode()
         return struct.pack('iiq', 1, ScalarTransferType.STR.value, len(encoded_msg)) + encoded_msg
 
-    def _pack_tensor_metadata(self, tensor: torch.Tensor, transfer_type: int) -> bytes:
-        """Pack tensor metadata including shape and stride information."""
-        shape = list(tensor.shape) + [-1] * (6 - len(tensor.shape))
-        stride = list(tensor.stride()) + [-1] * (6 - len(tensor.stride()))
-        return struct.pack('iiqiiiiiiiiiiii',
-                         0,  # success
-                         transfer_type,
-                         tensor.numel(),
-                         *shape,
-                         *stride)
+    def _pack_tensor_metadata(self, tensor: torch.Tensor, transfer_type: int, version: int) -> bytes:
+        """Pack the response header followed by the dtype, shape and stride of the tensor.
+
+        The metadata is the dtype code, number of dimensions and snapshot version
+        ('iiq') followed by the shape and then the stride, one 'q' per dimension.
+        """
+        if tensor.dtype not in DTYPE_TO_CODE:
+            raise StateServerError(f"Unsupported tensor type: {tensor.dtype}")
+        return struct.pack(f'iiqiiq{2 * tensor.dim()}q',
+                           0,  # success
+                           transfer_type,
+                           tensor.numel(),
+                           DTYPE_TO_CODE[tensor.dtype],
+                           tensor.dim(),
+                           version,
+                           *tensor.shape,
+                           *tensor.stride())
+
+    def _pack_manifest_entry(self, path: str, tensor: torch.Tensor, transfer_type: int) -> bytes:
+        """Pack the manifest entry describing one tensor of a batch response.
+
+        Entries carry the key ID of indexed tensors (-1 otherwise), which clients can
+        send as '#<id>' instead of the path.
+        """
+        if tensor.dtype not in DTYPE_TO_CODE:
+            raise StateServerError(f"Unsupported tensor type: {tensor.dtype}")
+        entry = self._index.get(path)
+        encoded_path = path.encode()
+        return struct.pack(f'iiiiqq{2 * tensor.dim()}q',
+                           len(encoded_path),
+                           transfer_type,
+                           DTYPE_TO_CODE[tensor.dtype],
+                           tensor.dim(),
+                           tensor.numel(),
+                           entry.key_id if entry is not None else -1,
+                           *tensor.shape,
+                           *tensor.stride()) + encoded_path
+
+    def _pack_manifest(self, entries: List[Tuple[str, torch.Tensor, int]], version: int) -> bytes:
+        """Pack the snapshot version and entry count ('qq'), followed by the
+        (path, tensor, transfer_type) entries."""
+        return struct.pack('qq', version, len(entries)) + b''.join(
+            self._pack_manifest_entry(path, tensor, transfer_type) for path, tensor, transfer_type in entries
+        )
 
     def _pack_scalar_response(self, value: Union[float, int, bool, str], scalar_type: ScalarTransferType) -> bytes:
         """Pack a scalar response with appropriate format."""
@@ -70,6 +495,12 @@ class StateServer:
     def _get_transfer_type(self, tensor: torch.Tensor, requested_type: Optional[int]) -> int:
         """Determine the appropriate transfer type for a tensor."""
         if requested_type != -1:
+            if requested_type not in TRANSFER_TYPE_VALUES:
+                raise StateServerError(f"Unsupported transfer type: {requested_type}")
+            if requested_type in COMPRESSED_TTYPES and not WITH_CODECS:
+                raise StateServerError(
+                    f"{TransferType(requested_type).name} needs the server to be built with libzstd and liblz4"
+                )
             return requested_type
         
         if tensor.dtype == torch.float32:
@@ -86,7 +517,9 @@ class StateServer:
         client_socket: socket.socket,
         value: torch.Tensor, 
         transfer_type: int,
-        size: int
+        size: int,
+        response_prefix: bytes = b"",
+        version: int = LIVE_VERSION
     ) -> None:
         """Handle a tensor request and send the appropriate response."""
         actual_type = self._get_transfer_type(value, transfer_type)
@@ -96,35 +529,504 @@ class StateServer:
 
         # Send metadata or simple header based on whether size was specified
         if size == -1:
-            client_socket.sendall(self._pack_tensor_metadata(value, actual_type))
+            header = self._pack_tensor_metadata(value, actual_type, version)
         else:
-            client_socket.sendall(struct.pack('iiq', 0, actual_type, value.numel()))
+            header = struct.pack('iiq', 0, actual_type, value.numel())
+
+        self._send_tensor_payload(client_socket, value, actual_type, response_prefix + header, version=version)
+
+    def _send_tensor_payload(
+        self,
+        client_socket: socket.socket,
+        value: torch.Tensor,
+        transfer_type: int,
+        header: bytes = b"",
+        start: int = 0,
+        count: int = -1,
+        version: int = LIVE_VERSION
+    ) -> None:
+        """Send the data of a tensor, or of a range of its elements, preceded by header.
+        Whole tensors of the snapshot at version go through the encoding cache."""
+        # Send header and tensor data straight from the tensor storage, cast or
+        # quantized to the transfer type chunk by chunk. Only the first payload of
+        # a response counts for the time to first byte.
+        received = getattr(self._connection, "received", -1)
+        self._connection.received = -1
+        if not self._is_snapshot_copy(value):
+            version = LIVE_VERSION
+        send_tensor(client_socket.fileno(), value, header, transfer_type, self.chunk_size, start, count,
+                    self._scheduler, getattr(self._connection, "client", ""),
+                    getattr(self._connection, "priority", Priority.NORMAL.value), self._metrics, received,
+                    self._encoding_cache, version)
+
+    def _handle_range_request(
+        self,
+        client_socket: socket.socket,
+        path: str,
+        body: bytes,
+        response_prefix: bytes = b"",
+        snapshot: Optional[Snapshot] = None
+    ) -> None:
+        """Handle a request for a range of elements of a tensor, in row-major order.
+
+        The body is the transfer type, first element and element count ('=iqq'). The
+        response is the usual 'iiq' header with the element count, then the payload.
+        """
+        if len(body) != struct.calcsize('=iqq'):
+            raise StateServerError("Invalid range request body")
+        transfer_type, start, count = struct.unpack('=iqq', body)
+
+        value = self._lookup(path, snapshot)
+        if not isinstance(value, torch.Tensor):
+            raise StateServerError(f"Value at path {path} is not a tensor")
+        if start < 0 or count < 0 or start + count > value.numel():
+            raise StateServerError(f"Range [{start}, {start + count}) out of bounds for {value.numel()} elements")
+
+        actual_type = self._get_transfer_type(value, transfer_type)
+        header = struct.pack('iiq', 0, actual_type, count)
+        self._send_tensor_payload(client_socket, value, actual_type, response_prefix + header, start, count,
+                                  snapshot.version if snapshot is not None else LIVE_VERSION)
+
+    def _handle_delta_request(
+        self,
+        client_socket: socket.socket,
+        path: str,
+        body: bytes,
+        response_prefix: bytes = b"",
+        snapshot: Optional[Snapshot] = None
+    ) -> None:
+        """Handle a request for the blocks of a tensor changed since a snapshot the
+        client holds.
+
+        The body is the transfer type and the version held ('=iq'). The response is
+        the tensor metadata, then the block size in elements and the number of runs
+        of changed blocks ('qq'), then each run as its first block and block count
+        ('qq'), then the payload of every run. A run count of -1 means the version
+        held is unknown and the whole payload follows instead.
+        """
+        if len(body) != struct.calcsize('=iq'):
+            raise StateServerError("Invalid delta request body")
+        transfer_type, base_version = struct.unpack('=iq', body)
+
+        entry = self._lookup_entry(path)
+        if entry is None:
+            raise StateServerError(f"No tensor at path {path}")
+        value = self._tensor_of(entry, snapshot)
+        actual_type = self._get_transfer_type(value, transfer_type)
+        version = snapshot.version if snapshot is not None else LIVE_VERSION
+        block_numel = delta_block_numel(value)
+
+        runs = None
+        with self._snapshot_lock:
+            old = self._block_hashes.get(base_version, {}).get(entry.path)
+            new = self._block_hashes.get(version, {}).get(entry.path)
+        if old is not None and new is not None:
+            runs = changed_block_runs(old, new)
+
+        header = response_prefix + self._pack_tensor_metadata(value, actual_type, version)
+        if runs is None:
+            header += struct.pack('qq', block_numel, -1)
+            self._send_tensor_payload(client_socket, value, actual_type, header, version=version)
+            return
+
+        header += struct.pack(f'qq{2 * len(runs)}q', block_numel, len(runs), *(n for run in runs for n in run))
+        client_socket.sendall(header)
+        for first, num_blocks in runs:
+            start = first * block_numel
+            count = min(num_blocks * block_numel, value.numel() - start)
+            self._send_tensor_payload(client_socket, value, actual_type, b"", start, count)
+
+    def _handle_batch_request(
+        self,
+        client_socket: socket.socket,
+        pattern: str,
+        body: bytes,
+        response_prefix: bytes = b"",
+        snapshot: Optional[Snapshot] = None
+    ) -> None:
+        """Handle a batch request for many tensors in one response.
 
-        # Send codebook if needed (for quantized types)
-        if actual_type == TransferType.UNIFORM_INT8.value:
-            # TODO: Implement codebook generation and sending
-            codebook = bytes([0] * 256)  # Placeholder
-            client_socket.sendall(codebook)
+        The body is the transfer type ('i') followed by newline separated paths.
+        Tensors named in the body come first, followed by every other tensor whose
+        path matches the pattern. The response is a manifest describing every
+        tensor, then each tensor's data in manifest order. All tensors come from the
+        same snapshot.
+        """
+        if len(body) < 4:
+            raise StateServerError("Invalid batch request body")
+        transfer_type, = struct.unpack('i', body[:4])
+        paths = [p for p in body[4:].decode().split('\n') if p]
 
-        # Send tensor data
-        tensor_bytes = get_bytes_from_tensor(value)
-        client_socket.sendall(tensor_bytes)
+        # Resolve everything up front so errors are reported before any data is sent
+        entries = self._resolve_batch(pattern, paths, transfer_type, snapshot)
+        version = snapshot.version if snapshot else LIVE_VERSION
+        manifest = self._pack_manifest(entries, version)
+        header = struct.pack('iiq', 0, RequestType.BATCH.value, len(manifest))
+        client_socket.sendall(response_prefix + header + manifest)
+
+        for _, value, actual_type in entries:
+            self._send_tensor_payload(client_socket, value, actual_type, version=version)
+
+    def _resolve_batch(
+        self,
+        pattern: str,
+        paths: List[str],
+        transfer_type: int,
+        snapshot: Optional[Snapshot]
+    ) -> List[Tuple[str, torch.Tensor, int]]:
+        """Manifest entries of the tensors at paths, then of every other tensor
+        matching pattern, as of snapshot."""
+        begin = time.monotonic_ns()
+        tensors = {}
+        for path in paths:
+            entry = self._lookup_entry(path)
+            if entry is not None:
+                tensors[entry.path] = self._tensor_of(entry, snapshot)
+            else:
+                tensors[path] = self._lookup(path, snapshot)
+        if pattern:
+            regex = compile_path_pattern(pattern)
+            for path, entry in self._index.items():
+                if path not in tensors and regex.match(path):
+                    tensors[path] = self._tensor_of(entry, snapshot)
+        self._metrics.record_lookup(time.monotonic_ns() - begin)
+
+        entries = []
+        for path, value in tensors.items():
+            if not isinstance(value, torch.Tensor):
+                raise StateServerError(f"Value at path {path} is not a tensor")
+            entries.append((path, value, self._get_transfer_type(value, transfer_type)))
+        return entries
+
+    def _handle_subscribe_request(
+        self,
+        client_socket: socket.socket,
+        pattern: str,
+        body: bytes,
+        client_address: tuple,
+        response_prefix: bytes = b""
+    ) -> None:
+        """Handle a subscription to the tensors matching pattern and the paths in
+        the body, which is the transfer type and the snapshot version the client
+        holds ('=iq') followed by newline separated paths.
+
+        The pushes are served by a thread of their own, on a duplicate of the
+        connection, so that the handler (or native worker) is free again.
+        """
+        if response_prefix:
+            raise StateServerError("Subscriptions need a connection of their own")
+        if len(body) < struct.calcsize('=iq'):
+            raise StateServerError("Invalid subscribe request body")
+        transfer_type, version = struct.unpack('=iq', body[:12])
+        paths = [p for p in body[12:].decode().split('\n') if p]
+        # Report unknown paths and unsupported transfer types right away
+        self._resolve_batch(pattern, paths, transfer_type, self._snapshot)
+
+        subscriber_socket = socket.socket(fileno=os.dup(client_socket.fileno()))
+        subscriber_socket.setblocking(True)
+        client_socket.sendall(struct.pack('iiq', 0, RequestType.SUBSCRIBE.value, 0))
+        threading.Thread(
+            target=self._serve_subscription,
+            args=(subscriber_socket, client_address, pattern, paths, transfer_type, version,
+                  getattr(self._connection, "priority", Priority.NORMAL.value)),
+            daemon=True
+        ).start()
+
+    def _serve_subscription(
+        self,
+        subscriber_socket: socket.socket,
+        client_address: tuple,
+        pattern: str,
+        paths: List[str],
+        transfer_type: int,
+        version: int,
+        priority: int
+    ) -> None:
+        """Push a batch response to a subscriber for every snapshot published after
+        version, until it goes away or the server is stopped. A subscriber still
+        receiving a push when more snapshots are published skips to the latest."""
+        self._connection.client = client_address[0]
+        self._connection.priority = priority
+        self._metrics.connection_opened()
+        with self._snapshot_lock:
+            self._subscribers.add(subscriber_socket)
+        try:
+            while True:
+                with self._snapshot_published:
+                    self._snapshot_published.wait_for(
+                        lambda: self._closed or (self._snapshot is not None and self._snapshot.version > version)
+                    )
+                    if self._closed:
+                        return
+                    snapshot = self._snapshot
+                self._push_snapshot(subscriber_socket, pattern, paths, transfer_type, snapshot)
+                version = snapshot.version
+        except OSError:
+            pass  # The subscriber went away
+        except Exception as e:
+            self._metrics.count_error()
+            self._logger.error(f"Error pushing to subscriber {client_address}: {e}")
+            try:
+                subscriber_socket.sendall(self._pack_error_response(str(e)))
+            except OSError:
+                pass
+        finally:
+            with self._snapshot_lock:
+                self._subscribers.discard(subscriber_socket)
+            subscriber_socket.close()
+            self._metrics.connection_closed()
+
+    def _push_snapshot(
+        self,
+        subscriber_socket: socket.socket,
+        pattern: str,
+        paths: List[str],
+        transfer_type: int,
+        snapshot: Snapshot
+    ) -> None:
+        """Push the subscribed tensors of snapshot as a batch response. Their
+        encodings are shared by all subscribers through the encoding cache."""
+        entries = self._resolve_batch(pattern, paths, transfer_type, snapshot)
+        manifest = self._pack_manifest(entries, snapshot.version)
+        subscriber_socket.sendall(struct.pack('iiq', 0, RequestType.BATCH.value, len(manifest)) + manifest)
+        for _, value, actual_type in entries:
+            self._send_tensor_payload(subscriber_socket, value, actual_type, version=snapshot.version)
+
+    def _handle_list_request(
+        self,
+        client_socket: socket.socket,
+        pattern: str,
+        response_prefix: bytes = b"",
+        snapshot: Optional[Snapshot] = None
+    ) -> None:
+        """Handle a request for the manifest of every tensor matching pattern, or of
+        the one tensor of a '#'-prefixed key ID.
+
+        Entries carry the transfer type the tensor would be sent with by default, or
+        -1 if it has to be requested with an explicit one.
+        """
+        index_entries: Iterable[IndexEntry] = self._index.values()
+        if pattern.startswith('#'):
+            entry = self._lookup_entry(pattern)
+            index_entries, pattern = [entry], ""
+        entries = self._list_entries(index_entries, pattern, snapshot)
+        manifest = self._pack_manifest(entries, snapshot.version if snapshot else LIVE_VERSION)
+        header = struct.pack('iiq', 0, RequestType.LIST.value, len(manifest))
+        client_socket.sendall(response_prefix + header + manifest)
+
+    def _handle_skeleton_request(
+        self,
+        client_socket: socket.socket,
+        path: str,
+        response_prefix: bytes = b"",
+        snapshot: Optional[Snapshot] = None
+    ) -> None:
+        """Handle a request for the skeleton of the value at path, the whole state
+        dict if empty: its structure and scalars as of snapshot, with every tensor
+        referenced by its key ID.
+
+        The structure is that of the live state dict, the scalars those captured
+        by the snapshot. The response body is the snapshot version ('q') followed
+        by the skeleton.
+        """
+        value = get_nested_value(self.state_dict, path) if path else self.state_dict
+        scalars = snapshot.scalars if snapshot is not None else {}
+        body = struct.pack('q', snapshot.version if snapshot else LIVE_VERSION) + encode_skeleton(
+            value, path, self._index, scalars
+        )
+        header = struct.pack('iiq', 0, RequestType.SKELETON.value, len(body))
+        client_socket.sendall(response_prefix + header + body)
+
+    def _list_entries(
+        self,
+        index_entries: Iterable[IndexEntry],
+        pattern: str,
+        snapshot: Optional[Snapshot]
+    ) -> List[Tuple[str, torch.Tensor, int]]:
+        """Manifest entries of the indexed tensors matching pattern, with the transfer
+        type each would be sent with by default, or -1."""
+        regex = compile_path_pattern(pattern)
+        entries = []
+        for entry in index_entries:
+            if not regex.match(entry.path) or entry.dtype not in DTYPE_TO_CODE:
+                continue
+            tensor = self._tensor_of(entry, snapshot)
+            try:
+                transfer_type = self._get_transfer_type(tensor, -1)
+            except StateServerError:
+                transfer_type = -1
+            entries.append((entry.path, tensor, transfer_type))
+        return entries
+
+    def _match_entries(self, path: str, snapshot: Optional[Snapshot]) -> List[Tuple[str, torch.Tensor, int]]:
+        """Manifest entries of the tensor at path, or of every tensor matching it as a
+        path prefix pattern if there is none."""
+        entry = self._lookup_entry(path)
+        if entry is not None:
+            return self._list_entries([entry], "", snapshot)
+        return self._list_entries(self._index.values(), path, snapshot)
+
+    def _handle_rdma_request(
+        self,
+        client_socket: socket.socket,
+        path: str,
+        request_type: int,
+        body: bytes,
+        response_prefix: bytes = b"",
+        snapshot: Optional[Snapshot] = None
+    ) -> None:
+        """Handle the RDMA control requests: connecting queue pairs, and looking up the
+        memory regions of the tensor at path, or of every tensor matching it."""
+        if self._rdma is None:
+            raise StateServerError("RDMA is not enabled on this server")
+
+        if request_type == RequestType.RDMA_CONNECT.value:
+            response = self._rdma.connect(body)
+        elif request_type == RequestType.RDMA_DISCONNECT.value:
+            self._rdma.disconnect(body)
+            response = b""
+        else:
+            entries = self._match_entries(path, snapshot)
+            manifest = self._pack_manifest(entries, snapshot.version if snapshot else LIVE_VERSION)
+            regions = b''.join(self._rdma.region(tensor) for _, tensor, _ in entries)
+            response = struct.pack('q', len(manifest)) + manifest + regions
+
+        header = struct.pack('iiq', 0, request_type, len(response))
+        client_socket.sendall(response_prefix + header + response)
+
+    def _handle_shm_request(
+        self,
+        client_socket: socket.socket,
+        path: str,
+        body: bytes,
+        response_prefix: bytes = b"",
+        snapshot: Optional[Snapshot] = None
+    ) -> None:
+        """Describe the tensor at path, or every tensor matching it, with the shared
+        memory segments to map them from. Segments the client doesn't list in body
+        are described in the response, with their file descriptors passed along.
+        The connection keeps a lease on those it lists and those of the response."""
+        if self._shm is None:
+            raise StateServerError("Shared memory is not enabled on this server")
+        if client_socket.family != socket.AF_UNIX:
+            raise StateServerError("Shared memory can only be mapped over the local socket of shm:// URLs")
+
+        from torchstate.shm import MAX_FDS_PER_MESSAGE, send_with_fds
+        known = set(struct.unpack(f'{len(body) // 8}q', body))
+        entries = self._match_entries(path, snapshot)
+        manifest = self._pack_manifest(entries, snapshot.version if snapshot else LIVE_VERSION)
+        regions, segments, fds = self._shm.export(
+            [tensor for _, tensor, _ in entries], known, self._connection.shm_leases
+        )
+        response = (struct.pack('qqq', len(manifest), len(segments), len(fds))
+                    + manifest + regions + b''.join(segments))
+
+        # Descriptors beyond what fits with the header follow in one byte messages
+        header = struct.pack('iiq', 0, RequestType.SHM_MAP.value, len(response))
+        send_with_fds(client_socket, response_prefix + header, fds[:MAX_FDS_PER_MESSAGE])
+        client_socket.sendall(response)
+        for start in range(MAX_FDS_PER_MESSAGE, len(fds), MAX_FDS_PER_MESSAGE):
+            send_with_fds(client_socket, b"\0", fds[start:start + MAX_FDS_PER_MESSAGE])
 
     def _handle_scalar_request(self, client_socket: socket.socket, value: Any, 
-                             scalar_type: ScalarTransferType) -> None:
+                             scalar_type: ScalarTransferType, response_prefix: bytes = b"") -> None:
         """Handle a scalar request and send the appropriate response."""
         try:
             response = self._pack_scalar_response(value, scalar_type)
-            client_socket.sendall(response)
+            client_socket.sendall(response_prefix + response)
         except (ValueError, struct.error) as e:
             error_response = self._pack_error_response(f"Error packing scalar value: {str(e)}")
-            client_socket.sendall(error_response)
+            client_socket.sendall(response_prefix + error_response)
+
+    def _handle_persistent_client(self, client_socket: socket.socket, client_address: tuple):
+        """Serve requests back-to-back on one connection until the client closes it.
+
+        Each request is the usual 256 byte header prefixed by an 8 byte request ID,
+        which is echoed in front of the matching response.
+        """
+        client_socket.sendall(struct.pack('iiq', 0, RequestType.PERSISTENT.value, 0))
+        while True:
+            data = client_socket.recv(264, socket.MSG_WAITALL)
+            if len(data) != 264:
+                return
+            self._handle_request(client_socket, data[8:], client_address, response_prefix=data[:8])
 
     def _handle_client(self, client_socket: socket.socket, client_address: tuple):
         """Handle individual client connections."""
+        self._connection.priority = Priority.NORMAL.value
+        # Segments the shm:// client of this connection keeps mapped (see ShmServer)
+        self._connection.shm_leases = {}
+        self._metrics.connection_opened()
         try:
             # Receive request header (244 bytes path + 4 bytes type + 8 bytes size)
-            data = client_socket.recv(256)
+            data = client_socket.recv(256, socket.MSG_WAITALL)
+            self._handle_request(client_socket, data, client_address)
+        except StalledClientError:
+            pass  # Logged by _handle_request, the connection is closed below
+        finally:
+            client_socket.close()
+            self._connection.shm_leases = {}
+            self._metrics.connection_closed()
+
+    def _handle_native_fallback(
+        self, fd: int, data: bytes, response_prefix: bytes, body: bytes, priority: int
+    ) -> bool:
+        """Handle a request the native server core passed back to Python.
+
+        body is the request body if the core already read it, empty otherwise, and
+        priority the class the core has for the connection. Returns False if the
+        connection can't carry another request.
+        """
+        self._connection.priority = priority
+        client_socket = socket.socket(fileno=os.dup(fd))
+        try:
+            self._handle_request(client_socket, data, client_socket.getpeername(), response_prefix, body or None)
+            return True
+        except StalledClientError:
+            return False
+        finally:
+            client_socket.close()
+
+    def _recv_request_body(self, client_socket: socket.socket, size: int, body: Optional[bytes]) -> bytes:
+        """Receive the size byte body of a control request, unless it was already read.
+
+        Raises StalledClientError if it takes longer than body_timeout to arrive.
+        """
+        if body is None:
+            body = bytearray()
+            deadline = time.monotonic() + self.body_timeout
+            previous_timeout = client_socket.gettimeout()
+            try:
+                while len(body) < size:
+                    client_socket.settimeout(max(deadline - time.monotonic(), 0.001))
+                    received = client_socket.recv(size - len(body))
+                    if not received:
+                        break
+                    body += received
+            except socket.timeout:
+                raise StalledClientError(f"Request body stalled for {self.body_timeout}s")
+            finally:
+                client_socket.settimeout(previous_timeout)
+            body = bytes(body)
+        if len(body) != max(size, 0):
+            raise StateServerError("Invalid request body")
+        return body
+
+    def _handle_request(
+        self,
+        client_socket: socket.socket,
+        data: bytes,
+        client_address: tuple,
+        response_prefix: bytes = b"",
+        body: Optional[bytes] = None
+    ):
+        """Parse a request header and send the response.
+
+        The body of control requests is read from the socket unless already given.
+        """
+        self._connection.received = time.monotonic_ns()
+        self._metrics.count_request(False)
+        try:
             if not data or len(data) != 256:
                 raise StateServerError("Invalid request format")
 
@@ -132,48 +1034,205 @@ class StateServer:
             path, transfer_type, size = struct.unpack('244siq', data)
             path = path.decode().strip('\x00')
             
-            self._logger.info("%s:%d %s %d %d", client_address[0], client_address[1], 
-                            path, transfer_type, size)
+            # Per request logging costs more than the metrics do, so it is off by default
+            self._logger.debug("%s:%d %s %d %d", client_address[0], client_address[1],
+                               path, transfer_type, size)
+            self._connection.client = client_address[0]
+
+            # The whole response is served from the snapshot current at this point
+            snapshot = self._snapshot
+
+            # Handle control requests
+            if transfer_type == RequestType.PERSISTENT.value:
+                if response_prefix:
+                    raise StateServerError("Connection is already persistent")
+                self._handle_persistent_client(client_socket, client_address)
+                return
+            elif transfer_type == RequestType.BATCH.value:
+                body = self._recv_request_body(client_socket, size, body)
+                self._handle_batch_request(client_socket, path, body, response_prefix, snapshot)
+                return
+            elif transfer_type == RequestType.RANGE.value:
+                body = self._recv_request_body(client_socket, size, body)
+                self._handle_range_request(client_socket, path, body, response_prefix, snapshot)
+                return
+            elif transfer_type == RequestType.DELTA.value:
+                body = self._recv_request_body(client_socket, size, body)
+                self._handle_delta_request(client_socket, path, body, response_prefix, snapshot)
+                return
+            elif transfer_type in (RequestType.RDMA_CONNECT.value, RequestType.RDMA_REGIONS.value,
+                                   RequestType.RDMA_DISCONNECT.value):
+                body = self._recv_request_body(client_socket, size, body)
+                self._handle_rdma_request(client_socket, path, transfer_type, body, response_prefix, snapshot)
+                return
+            elif transfer_type == RequestType.SHM_MAP.value:
+                body = self._recv_request_body(client_socket, size, body)
+                self._handle_shm_request(client_socket, path, body, response_prefix, snapshot)
+                return
+            elif transfer_type == RequestType.PRIORITY.value:
+                if size not in {p.value for p in Priority}:
+                    raise StateServerError(f"Invalid priority class: {size}")
+                self._connection.priority = size
+                client_socket.sendall(response_prefix + struct.pack('iiq', 0, RequestType.PRIORITY.value, 0))
+                return
+            elif transfer_type == RequestType.LIST.value:
+                self._handle_list_request(client_socket, path, response_prefix, snapshot)
+                return
+            elif transfer_type == RequestType.SUBSCRIBE.value:
+                body = self._recv_request_body(client_socket, size, body)
+                self._handle_subscribe_request(client_socket, path, body, client_address, response_prefix)
+                return
+            elif transfer_type == RequestType.SKELETON.value:
+                self._handle_skeleton_request(client_socket, path, response_prefix, snapshot)
+                return
+            elif transfer_type == RequestType.STATS.value:
+                stats = self._metrics.prometheus().encode()
+                header = struct.pack('iiq', 0, RequestType.STATS.value, len(stats))
+                client_socket.sendall(response_prefix + header + stats)
+                return
+            elif transfer_type == RequestType.RELAY_SOURCE.value:
+                body = self._recv_request_body(client_socket, size, body)
+                if len(body) != struct.calcsize('=id'):
+                    raise StateServerError("Invalid relay source request body")
+                relay_type, waited = struct.unpack('=id', body)
+                # Answered right away, a client waiting for a slot asks again
+                version = self._relay.version
+                source = self._relay.acquire(path, relay_type, waited)
+                retry_after = RELAY_RETRY_INTERVAL if source is None else 0.0
+                response = struct.pack('=qd', version, retry_after) + (source or "").encode()
+                header = struct.pack('iiq', 0, RequestType.RELAY_SOURCE.value, len(response))
+                client_socket.sendall(response_prefix + header + response)
+                return
+            elif transfer_type == RequestType.RELAY_ANNOUNCE.value:
+                body = self._recv_request_body(client_socket, size, body)
+                try:
+                    url, source, source_failed, relay_type, version = parse_announce_body(body)
+                except (UnicodeDecodeError, ValueError):
+                    raise StateServerError("Invalid relay announcement")
+                if source_failed:
+                    self._relay.remove(source)
+                else:
+                    self._relay.announce(path, relay_type, version, url, source)
+                client_socket.sendall(response_prefix + struct.pack('iiq', 0, RequestType.RELAY_ANNOUNCE.value, 0))
+                return
 
             # Get value from state dictionary
-            value = get_nested_value(self.state_dict, path)
+            begin = time.monotonic_ns()
+            value = self._lookup(path, snapshot)
+            self._metrics.record_lookup(time.monotonic_ns() - begin)
 
             # Handle tensor requests
             if transfer_type == -1 or transfer_type >= TransferType.FLOAT32.value:
                 if not isinstance(value, torch.Tensor):
                     raise StateServerError(f"Value at path {path} is not a tensor")
-                self._handle_tensor_request(client_socket, value, transfer_type, size)
+                version = snapshot.version if snapshot is not None else LIVE_VERSION
+                self._handle_tensor_request(client_socket, value, transfer_type, size, response_prefix, version)
             
             # Handle scalar requests
             elif transfer_type in [t.value for t in ScalarTransferType]:
                 scalar_type = ScalarTransferType(transfer_type)
-                self._handle_scalar_request(client_socket, value, scalar_type)
+                self._handle_scalar_request(client_socket, value, scalar_type, response_prefix)
             
             else:
                 raise StateServerError(f"Unsupported transfer type: {transfer_type}")
 
+        except StalledClientError as e:
+            # What is left of the request is still on the wire, the connection is dropped
+            self._metrics.count_error()
+            self._logger.error(f"Error handling client {client_address}: {e}")
+            raise
         except Exception as e:
+            self._metrics.count_error()
             self._logger.error(f"Error handling client {client_address}: {e}")
             try:
                 error_response = self._pack_error_response(str(e))
-                client_socket.sendall(error_response)
+                client_socket.sendall(response_prefix + error_response)
             except Exception as send_error:
                 self._logger.error(f"Error sending error response: {send_error}")
 
-        finally:
-            client_socket.close()
+    def _is_snapshot_copy(self, tensor: torch.Tensor) -> bool:
+        """Whether tensor is one of the copies of the current snapshot, rather than a
+        live tensor that may change."""
+        return self._snapshot_copies.get(id(tensor)) is tensor
+
+    def _register_native_tensors(self):
+        """Register every indexed tensor with the native server core, by path and by key ID,
+        as of the current snapshot."""
+        snapshot = self._snapshot
+        version = snapshot.version if snapshot is not None else LIVE_VERSION
+        self._native_server.clear()
+        for path, entry in self._index.items():
+            tensor = self._tensor_of(entry, snapshot)
+            try:
+                transfer_type = self._get_transfer_type(tensor, -1)
+            except StateServerError:
+                continue  # Left to the Python fallback, which reports the error
+            cacheable = self._is_snapshot_copy(tensor)
+            self._native_server.register_tensor(path, tensor, transfer_type, version, cacheable)
+            self._native_server.register_tensor(f"#{entry.key_id}", tensor, transfer_type, version, cacheable)
 
     def start(self):
         """Start the server in a separate thread."""
-        if self._server_thread is not None:
+        if self._server_thread is not None or self._native_server is not None:
             raise RuntimeError("Server is already running")
-        
+
+        if self.native:
+            from torchstate.C.engine import NativeServer
+            self._native_server = NativeServer(
+                self.host, self.port, self.num_workers, self.chunk_size, self._handle_native_fallback, self.io_uring
+            )
+            self._native_server.set_scheduler(self._scheduler.capsule())
+            self._native_server.set_metrics(self._metrics.capsule())
+            self._native_server.set_encoding_cache(self._encoding_cache.capsule())
+            self._native_server.set_body_timeout(self.body_timeout)
+            self._register_native_tensors()
+            self._native_server.start()
+            self._start_shm_listener()
+            self._start_metrics_listener()
+            mode = "io_uring" if self._native_server.io_uring else "epoll"
+            self._logger.info(f"Native server started on {self.host}:{self.port} ({mode})")
+            return
+
         self._running = True
         self._server_thread = threading.Thread(target=self._server_loop)
         self._server_thread.daemon = True
         self._server_thread.start()
+        self._start_shm_listener()
+        self._start_metrics_listener()
         self._logger.info(f"Server started on {self.host}:{self.port}")
 
+    def _start_shm_listener(self):
+        """Listen for shm:// clients on the Unix socket of the port, if enabled."""
+        if self._shm is None:
+            return
+        from torchstate.shm import shm_socket_address
+        self._shm_socket = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self._shm_socket.bind(shm_socket_address(self.port))
+        self._shm_socket.listen()
+        threading.Thread(target=self._shm_loop, args=(self._shm_socket,), daemon=True).start()
+
+    def _start_metrics_listener(self):
+        """Serve the metrics over HTTP on metrics_port, if set."""
+        if self.metrics_port is None:
+            return
+        self._metrics_server = ThreadingHTTPServer((self.host, self.metrics_port), _metrics_handler(self._metrics))
+        self._metrics_server.daemon_threads = True
+        threading.Thread(target=self._metrics_server.serve_forever, daemon=True).start()
+
+    def _shm_loop(self, listen_socket: socket.socket):
+        """Accept shm:// clients until the socket is shut down."""
+        while True:
+            try:
+                client_socket, _ = listen_socket.accept()
+            except OSError:
+                return
+            client_thread = threading.Thread(
+                target=self._handle_client,
+                args=(client_socket, ("shm", self.port))
+            )
+            client_thread.daemon = True
+            client_thread.start()
+
     def _server_loop(self):
         """Main server loop running in separate thread."""
         self._listen_socket.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
@@ -195,6 +1254,13 @@ class StateServer:
 
     def stop(self):
         """Stop the server gracefully."""
+        if self._native_server is not None:
+            self._native_server.stop()
+            self._native_server = None
+            self.close()
+            self._logger.info("Server stopped")
+            return
+
         if self._server_thread is None:
             return
 
@@ -218,6 +1284,31 @@ class StateServer:
             self._listen_socket.close()
         except Exception as e:
             self._logger.error(f"Error closing socket: {e}")
+        if self._rdma is not None:
+            self._rdma.close()
+        # Wake up the subscribers waiting for a snapshot, and those blocked sending one
+        with self._snapshot_published:
+            self._closed = True
+            self._snapshot_published.notify_all()
+            for subscriber_socket in self._subscribers:
+                try:
+                    subscriber_socket.shutdown(socket.SHUT_RDWR)
+                except OSError:
+                    pass
+        if self._metrics_server is not None:
+            self._metrics_server.shutdown()
+            self._metrics_server.server_close()
+            self._metrics_server = None
+        if self._shm_socket is not None:
+            # Shutting the socket down wakes up the accept() of _shm_loop
+            try:
+                self._shm_socket.shutdown(socket.SHUT_RDWR)
+            except OSError:
+                pass
+            self._shm_socket.close()
+            self._shm_socket = None
+        if self._shm is not None:
+            self._shm.close()
 
     def __del__(self):
         try:
@@ -0,0 +1,151 @@
+from typing import Callable, Dict, List, Optional, Tuple
+from concurrent.futures import ThreadPoolExecutor
+import math
+import torch
+from torchstate.client import (
+    StateClient, StateClientError, TensorInfo, _insert_nested, _parse_path, _pattern_root
+)
+from torchstate.ttype_consts import Priority, TransferType
+
+def _split_bounds(size: int, rank: int, world_size: int) -> Tuple[int, int]:
+    """Bounds of the rank-th of world_size parts of size, split like torch.tensor_split."""
+    base, extra = divmod(size, world_size)
+    start = rank * base + min(rank, extra)
+    return start, start + base + (1 if rank < extra else 0)
+
+class ShardedStateClient:
+    """Fetch a state dict that is sharded across several servers, one per source rank.
+
+    Each server is asked for its manifest, and a tensor listed by several servers is
+    taken to be split along its shard dimension, in the order of urls. Tensors are
+    reassembled into full tensors, or into this rank's part of them if local_shard
+    is given to get_state_dict. Every server is read from concurrently over its own
+    persistent connection, so the fetch is bounded by the aggregate bandwidth of
+    the sources rather than by one of them.
+    """
+
+    def __init__(self, urls: List[str], priority: Optional[Priority] = None):
+        if not urls:
+            raise ValueError("ShardedStateClient needs at least one server")
+        self.urls = urls
+        self.clients = [StateClient(url, persistent=True, priority=priority) for url in urls]
+
+    def close(self):
+        for client in self.clients:
+            client.close()
+
+    def list_tensors(self, prefix: str = "") -> List[List[TensorInfo]]:
+        """The manifest of every server, in the order of urls."""
+        return list(self._map(lambda client: client.list_tensors(prefix)))
+
+    def get_state_dict(
+        self,
+        prefix: str = "",
+        transfer_type: Optional[TransferType] = None,
+        shard_dim: int = 0,
+        shard_dims: Optional[Dict[str, Optional[int]]] = None,
+        local_shard: Optional[Tuple[int, int]] = None,
+    ) -> dict:
+        """Fetch every tensor matching prefix from all servers and reassemble it.
+
+        Tensors listed by several servers are concatenated along shard_dim, or along
+        the per-path dimension in shard_dims, where None marks a replicated tensor
+        that is fetched from a single server. local_shard=(rank, world_size) keeps
+        only this rank's part of every sharded tensor, split like torch.tensor_split
+        along the same dimension. Where the part of a shard it overlaps is one run of
+        elements, as it always is along dimension 0, only that run is fetched, and
+        otherwise the whole shard.
+
+        The result is a nested dict relative to the literal part of the prefix, like
+        StateClient.get_state_dict.
+        """
+        manifests = self.list_tensors(prefix)
+        holders: Dict[str, List[Tuple[int, TensorInfo]]] = {}
+        for server, infos in enumerate(manifests):
+            for info in infos:
+                holders.setdefault(info.path, []).append((server, info))
+
+        # Work for each server: whole shards to fetch in one pipelined batch, and
+        # partial shards to fetch as element ranges or to copy out of a temporary
+        batches: List[List[Tuple[str, torch.Tensor]]] = [[] for _ in self.clients]
+        partials: List[List[Callable[[StateClient], None]]] = [[] for _ in self.clients]
+        result = {}
+        root = _pattern_root(prefix)
+        for n, (path, shards) in enumerate(holders.items()):
+            dim = (shard_dims or {}).get(path, shard_dim)
+            if len(shards) == 1 or dim is None:
+                # Spread replicated tensors over the servers holding them
+                server, info = shards[n % len(shards)]
+                tensor = torch.empty(info.shape, dtype=info.dtype)
+                batches[server].append((path, tensor))
+            else:
+                tensor = self._plan_sharded(path, shards, dim, transfer_type, local_shard, batches, partials)
+            _insert_nested(result, _parse_path(path[len(root):] if path.startswith(root) else path), tensor)
+
+        def fetch(server: int) -> None:
+            client = self.clients[server]
+            if batches[server]:
+                paths, tensors = zip(*batches[server])
+                client.get_tensors(list(paths), transfer_type, list(tensors))
+            for partial in partials[server]:
+                partial(client)
+
+        list(self._map(fetch, range(len(self.clients))))
+        return result
+
+    def _plan_sharded(
+        self,
+        path: str,
+        shards: List[Tuple[int, TensorInfo]],
+        dim: int,
+        transfer_type: Optional[TransferType],
+        local_shard: Optional[Tuple[int, int]],
+        batches: List[List[Tuple[str, torch.Tensor]]],
+        partials: List[List[Callable[[StateClient], None]]],
+    ) -> torch.Tensor:
+        """Allocate the reassembled tensor of path and plan fetching its shards into it."""
+        first = shards[0][1]
+        if not 0 <= dim < len(first.shape):
+            raise StateClientError(f"{path} has no dimension {dim} to be sharded along")
+        for _, info in shards:
+            if len(info.shape) != len(first.shape) or any(
+                a != b for d, (a, b) in enumerate(zip(info.shape, first.shape)) if d != dim
+            ):
+                raise StateClientError(f"Shards of {path} don't line up along dimension {dim}")
+
+        total = sum(info.shape[dim] for _, info in shards)
+        lo, hi = _split_bounds(total, *local_shard) if local_shard is not None else (0, total)
+        shape = list(first.shape)
+        shape[dim] = hi - lo
+        tensor = torch.empty(shape, dtype=first.dtype)
+
+        begin = 0
+        for server, info in shards:
+            end = begin + info.shape[dim]
+            overlap_lo, overlap_hi = max(begin, lo), min(end, hi)
+            if overlap_lo < overlap_hi:
+                dst = tensor.narrow(dim, overlap_lo - lo, overlap_hi - overlap_lo)
+                if overlap_lo == begin and overlap_hi == end:
+                    batches[server].append((path, dst))
+                elif math.prod(info.shape[:dim]) == 1:
+                    # With nothing but size 1 dimensions before dim, its slices are
+                    # consecutive in the row-major element order of the shard
+                    slice_numel = math.prod(info.shape[dim + 1:])
+                    partials[server].append(
+                        lambda client, dst=dst, start=(overlap_lo - begin) * slice_numel:
+                            client._get_tensor_range(path, transfer_type, dst, start, dst.numel(), 0)
+                    )
+                else:
+                    # The overlap is strided within the shard, which is fetched whole
+                    partials[server].append(
+                        lambda client, dst=dst, slice_lo=overlap_lo - begin:
+                            dst.copy_(client.get_tensor(path, transfer_type).narrow(dim, slice_lo, dst.shape[dim]))
+                    )
+            begin = end
+        return tensor
+
+    def _map(self, fn, items=None):
+        """Run fn on every client (or item) concurrently, returning the results in order."""
+        items = self.clients if items is None else list(items)
+        with ThreadPoolExecutor(max_workers=len(items) or 1) as executor:
+            return list(executor.map(fn, items))
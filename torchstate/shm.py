@@ -0,0 +1,334 @@
+from typing import TYPE_CHECKING, Any, Dict, Iterable, List, NamedTuple, Optional, Set, Tuple, Union
+import os
+import socket
+import struct
+import threading
+import torch
+import torch.multiprocessing
+from torchstate.client import (
+    StateClient, StateClientError, TensorInfo, _encode_path, _insert_nested, _pattern_root, _relative_parts,
+    _unpack_manifest, recv_exact
+)
+from torchstate.C.utils import storage_use_count
+from torchstate.ttype_consts import RequestType, TransferType
+
+if TYPE_CHECKING:
+    from torchstate.arena import TensorArena
+
+# Region of a manifest entry: segment ID and storage offset in elements. Segment -1
+# marks a tensor that can't be mapped and has to be fetched over the socket.
+REGION_FORMAT = '=qq'
+REGION_SIZE = struct.calcsize(REGION_FORMAT)
+
+# Segment descriptor: ID, CUDA device (-1 for host memory) and size in bytes. Host
+# segments come with a file descriptor, passed along with the response.
+SEGMENT_FORMAT = '=qiq'
+SEGMENT_SIZE = struct.calcsize(SEGMENT_FORMAT)
+# CUDA segments are followed by the rest of their IPC handle: the offset in the
+# allocation, the offset of the reference counter, whether an event has to be
+# waited on, and the lengths of the handle, counter handle and event handle,
+# which follow in that order
+CUDA_HANDLE_FORMAT = '=qq?iii'
+CUDA_HANDLE_SIZE = struct.calcsize(CUDA_HANDLE_FORMAT)
+
+# Most file descriptors the kernel passes in one message (SCM_MAX_FD)
+MAX_FDS_PER_MESSAGE = 253
+
+def shm_socket_address(port: int) -> str:
+    """Unix socket of the server on port, in the abstract namespace so nothing is
+    left behind on the filesystem. Only processes sharing the network namespace of
+    the server can connect."""
+    return f"\0torchstate.{port}"
+
+def send_with_fds(sock: socket.socket, data: bytes, fds: List[int]) -> None:
+    """Send data, passing fds along with its first byte."""
+    sent = socket.send_fds(sock, [data], fds) if fds else 0
+    sock.sendall(data[sent:])
+
+class Segment(NamedTuple):
+    id: int
+    storage: torch.UntypedStorage
+    descriptor: bytes
+    fd: Optional[int]
+
+class ShmServer:
+    """The shared memory side of a StateServer: the storages mapped by same-host
+    clients, each exported once as a segment.
+
+    Host storages are exported by file descriptor if they already live in shared
+    memory, like snapshots of a server with shm enabled or state dicts moved there
+    with share_memory(). Other host storages are never moved, since the owner may
+    be writing to them. CUDA storages are exported with an IPC handle.
+
+    Every connection holds a lease on the segments its client still has mapped,
+    which keeps their storages referenced, so that the buffers of older snapshots
+    aren't reused for new ones under the client (see SnapshotBuffers).
+    """
+
+    def __init__(self):
+        self._segments: Dict[int, Segment] = {}
+        self._retired: Dict[int, Segment] = {}
+        self._next_id = 0
+        self._lock = threading.Lock()
+
+    def export(
+        self, tensors: Iterable[torch.Tensor], known: Set[int], leases: Dict[int, Segment]
+    ) -> Tuple[bytes, List[bytes], List[int]]:
+        """Pack the regions of tensors, and the descriptors and file descriptors of
+        the segments they are in that the client doesn't know yet.
+
+        leases holds the segments leased to the connection, and is updated to the
+        ones the client keeps mapped: those it lists in known and those of tensors.
+        """
+        regions = []
+        descriptors = []
+        fds = []
+        sent = set(known)
+        kept = {segment_id: leases[segment_id] for segment_id in known if segment_id in leases}
+        with self._lock:
+            for tensor in tensors:
+                segment = self._segment(tensor.untyped_storage())
+                if segment is None:
+                    regions.append(struct.pack(REGION_FORMAT, -1, 0))
+                    continue
+                regions.append(struct.pack(REGION_FORMAT, segment.id, tensor.storage_offset()))
+                kept[segment.id] = segment
+                if segment.id not in sent:
+                    sent.add(segment.id)
+                    descriptors.append(segment.descriptor)
+                    if segment.fd is not None:
+                        fds.append(segment.fd)
+        leases.clear()
+        leases.update(kept)
+        return b''.join(regions), descriptors, fds
+
+    def _segment(self, storage: torch.UntypedStorage) -> Optional[Segment]:
+        if storage.nbytes() == 0:
+            return None
+        key = storage.data_ptr()
+        segment = self._segments.get(key) or self._retired.pop(key, None)
+        if segment is None:
+            segment = self._share(storage)
+            if segment is None:
+                return None
+        self._segments[key] = segment
+        return segment
+
+    def _share(self, storage: torch.UntypedStorage) -> Optional[Segment]:
+        try:
+            if storage.is_cuda:
+                (device, handle, nbytes, offset, counter_handle, counter_offset,
+                 event_handle, event_sync) = storage._share_cuda_()
+                event_handle = event_handle or b""
+                descriptor = (
+                    struct.pack(SEGMENT_FORMAT, self._next_id, device, nbytes)
+                    + struct.pack(CUDA_HANDLE_FORMAT, offset, counter_offset, event_sync,
+                                  len(handle), len(counter_handle), len(event_handle))
+                    + handle + counter_handle + event_handle
+                )
+                fd = None
+            elif (storage.device.type == "cpu" and storage.is_shared()
+                  and torch.multiprocessing.get_sharing_strategy() == "file_descriptor"):
+                fd, nbytes = storage._share_fd_cpu_()
+                descriptor = struct.pack(SEGMENT_FORMAT, self._next_id, -1, nbytes)
+            else:
+                return None
+        except RuntimeError:
+            return None  # e.g. memory from a CUDA allocator without IPC support
+
+        self._next_id += 1
+        return Segment(self._next_id - 1, storage, descriptor, fd)
+
+    def retire(self, tensors: Iterable[torch.Tensor]) -> None:
+        """Let go of the segments of tensors that are no longer served.
+
+        Segments stay exported for one more retirement after their tensors stop
+        being served, so clients that are mapping them can still find them. Memory
+        already mapped by a client stays as it is for as long as the client keeps a
+        tensor of it and its connection open, through the lease of the connection.
+        """
+        keep = {t.untyped_storage().data_ptr() for t in tensors}
+        with self._lock:
+            self._retired = {key: segment for key, segment in self._segments.items() if key not in keep}
+            self._segments = {key: segment for key, segment in self._segments.items() if key in keep}
+
+    def close(self) -> None:
+        with self._lock:
+            self._segments.clear()
+            self._retired.clear()
+
+def _open_segment(body: bytes, offset: int, fds: List[int]) -> Tuple[int, torch.UntypedStorage, int]:
+    """Map the segment described at offset of body, taking its file descriptor from
+    the front of fds. Returns its ID, its storage and the offset past it."""
+    segment_id, device, nbytes = struct.unpack_from(SEGMENT_FORMAT, body, offset)
+    offset += SEGMENT_SIZE
+    if device < 0:
+        fd = fds.pop(0)
+        try:
+            return segment_id, torch.UntypedStorage._new_shared_fd_cpu(fd, nbytes), offset
+        finally:
+            os.close(fd)
+
+    storage_offset, counter_offset, event_sync, handle_len, counter_len, event_len = struct.unpack_from(
+        CUDA_HANDLE_FORMAT, body, offset)
+    offset += CUDA_HANDLE_SIZE
+    handle = body[offset:offset + handle_len]
+    counter_handle = body[offset + handle_len:offset + handle_len + counter_len]
+    event_handle = body[offset + handle_len + counter_len:offset + handle_len + counter_len + event_len]
+    offset += handle_len + counter_len + event_len
+    torch.cuda._lazy_init()
+    storage = torch.UntypedStorage._new_shared_cuda(
+        device, handle, nbytes, storage_offset, counter_handle, counter_offset, event_handle or None, event_sync)
+    return segment_id, storage, offset
+
+class ShmStateClient(StateClient):
+    """StateClient for shm:// URLs, mapping the tensors of a server on the same host
+    instead of copying them.
+
+    shm://host:port connects to the Unix socket of the server listening on port with
+    shm enabled, the host is ignored. Requests go over that socket, and tensor data
+    is mapped from the server's shared memory segments or CUDA allocations, so a
+    state dict read this way shares its memory with the server. Served from a
+    snapshot, the mapped tensors stay as they were when the snapshot was taken for
+    as long as any of them is referenced and the client is open: every request
+    tells the server which segments are still mapped, and the server doesn't
+    reuse their memory for later snapshots until they aren't. A later read
+    returns the tensors of the current snapshot; live tensors change under the
+    reader. Mapped tensors must not be written to. After close(), tensors still
+    mapped may be overwritten; pass inplace to keep a copy.
+
+    Reads with an explicit transfer_type, and tensors the server can't export, go
+    over the socket like with StateClient.
+    """
+
+    def __init__(self, url: str):
+        super().__init__(url, persistent=True)
+        # Mapped segments by ID, as byte tensors viewing all of them. The server
+        # only sends the ones not listed here, and keeps them leased.
+        self._segments: Dict[int, torch.Tensor] = {}
+        self._fds: List[int] = []
+
+    def _connection_settings(self) -> Dict[str, Any]:
+        return {}
+
+    def _init_socket(self):
+        self.client_socket = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.client_socket.connect(shm_socket_address(self.port))
+
+    def _recv_header(self, size: int) -> bytes:
+        # File descriptors arrive along with the first byte of a response
+        data, fds, _, _ = socket.recv_fds(self.client_socket, size, MAX_FDS_PER_MESSAGE, socket.MSG_WAITALL)
+        self._fds.extend(fds)
+        if not data:
+            raise ConnectionError("Connection closed before receiving all data")
+        return data + recv_exact(self.client_socket, size - len(data))
+
+    def _close_fds(self) -> None:
+        for fd in self._fds:
+            os.close(fd)
+        self._fds = []
+
+    def close(self):
+        super().close()
+        self._segments = {}
+        self._close_fds()
+
+    def get_tensor(
+        self,
+        path: Union[str, int],
+        transfer_type: Optional[TransferType] = None,
+        inplace_tensor: Optional[torch.Tensor] = None,
+        num_connections: int = 1,
+    ) -> torch.Tensor:
+        """Map one tensor, or copy it into inplace_tensor if given."""
+        if transfer_type is not None:
+            return super().get_tensor(path, transfer_type, inplace_tensor, num_connections)
+
+        infos, tensors = self._map(_encode_path(path))
+        matches = [(info, tensor) for info, tensor in zip(infos, tensors) if info.path == path or info.key_id == path]
+        if not matches:
+            raise StateClientError(f"Tensor {path} not found on the server")
+        info, tensor = matches[0]
+        if tensor is None:
+            return super().get_tensor(info.path, None, inplace_tensor)
+        if inplace_tensor is None:
+            return tensor
+        if inplace_tensor.numel() != info.numel:
+            raise StateClientError(f"{info.path} has {info.numel} elements, can't read into {inplace_tensor.numel()}")
+        return inplace_tensor.copy_(tensor.view(inplace_tensor.shape))
+
+    def get_state_dict(
+        self,
+        prefix: str = "",
+        paths: Optional[List[Union[str, int]]] = None,
+        transfer_type: Optional[TransferType] = None,
+        inplace: Optional[dict] = None,
+        arena: Optional["TensorArena"] = None,
+    ) -> dict:
+        """Map every tensor matching prefix, like StateClient.get_state_dict.
+
+        Tensors are copied only when restoring into inplace or an arena.
+        """
+        if paths or transfer_type is not None:
+            return super().get_state_dict(prefix, paths, transfer_type, inplace, arena)
+
+        root = _pattern_root(prefix)
+        infos, mapped = self._map(prefix)
+        if inplace is None and arena is None:
+            parts = [_relative_parts(root, info.path) for info in infos]
+            tensors = [tensor if tensor is not None else super(ShmStateClient, self).get_tensor(info.path)
+                       for info, tensor in zip(infos, mapped)]
+        else:
+            parts, tensors = self._allocate_state_dict(root, infos, inplace, arena)
+            for info, source, tensor in zip(infos, mapped, tensors):
+                if source is None:
+                    super().get_tensor(info.path, None, tensor)
+                else:
+                    tensor.copy_(source.view(tensor.shape))
+
+        result = {}
+        for tensor_parts, tensor in zip(parts, tensors):
+            _insert_nested(result, tensor_parts, tensor)
+        return result
+
+    def _map(self, path: str) -> Tuple[List[TensorInfo], List[Optional[torch.Tensor]]]:
+        """The manifest of the tensors at path and views of them in the server's
+        memory, None for those that have to be fetched over the socket."""
+        self._close_fds()
+        # Segments nothing views any more are unmapped, and their leases given back
+        self._segments = {
+            segment_id: base for segment_id, base in self._segments.items() if storage_use_count(base) > 1
+        }
+        known = struct.pack(f'{len(self._segments)}q', *self._segments)
+        body = self._control_request(RequestType.SHM_MAP, path, known)
+
+        manifest_size, segment_count, fd_count = struct.unpack_from('qqq', body)
+        offset = 24
+        version, infos = _unpack_manifest(body[offset:offset + manifest_size])
+        self.last_version = version
+        self._record_key_ids(infos)
+        offset += manifest_size
+        regions = [struct.unpack_from(REGION_FORMAT, body, offset + i * REGION_SIZE) for i in range(len(infos))]
+        offset += len(infos) * REGION_SIZE
+
+        # File descriptors beyond what fits in one message follow the response
+        while len(self._fds) < fd_count:
+            _, fds, _, _ = socket.recv_fds(self.client_socket, 1, MAX_FDS_PER_MESSAGE)
+            if not fds:
+                self.close()
+                raise StateClientError("Server didn't pass the file descriptors of its segments")
+            self._fds.extend(fds)
+
+        for _ in range(segment_count):
+            segment_id, storage, offset = _open_segment(body, offset, self._fds)
+            self._segments[segment_id] = torch.empty(0, dtype=torch.uint8, device=storage.device).set_(storage)
+
+        tensors = []
+        for info, (segment_id, storage_offset) in zip(infos, regions):
+            if segment_id < 0:
+                tensors.append(None)
+                continue
+            base = self._segments[segment_id]
+            tensors.append(torch.empty(0, dtype=info.dtype, device=base.device).set_(
+                base.untyped_storage(), storage_offset, info.shape, info.stride))
+        return infos, tensors
@@ -0,0 +1,172 @@
+from typing import Any, Callable, Dict, Iterable, List, NamedTuple, Optional, Tuple
+import threading
+import torch
+from torchstate.arena import ARENA_ALIGNMENT, _align
+from torchstate.C.utils import block_hashes, storage_use_count
+
+# Version reported for the live state, when no snapshot has been taken
+LIVE_VERSION = -1
+
+# Granularity of delta transfers. Small enough that sparse updates, e.g. to a few
+# embedding rows, only touch a few blocks, large enough that the hashes are a
+# negligible fraction of the state
+DELTA_BLOCK_SIZE = 64 * 1024
+
+class Snapshot(NamedTuple):
+    """A consistent copy of the state dict, taken at a step boundary."""
+    version: int
+    tensors: Dict[str, torch.Tensor]
+    scalars: Dict[str, Any]
+
+class SnapshotBuffers:
+    """Reusable buffers that snapshots are copied into.
+
+    Every kind of buffer (host, pinned or shared memory) keeps up to sets buffers
+    sized for the latest layout of the state dict. A buffer is reused once nothing
+    but this pool references its storage, i.e. once every tensor of the snapshot
+    it held is gone, along with the responses, exports and registrations that read
+    from it, and the leases of shm:// clients still mapping it (see ShmServer). When every buffer is busy, or the layout changed, a fresh one is
+    allocated, and only pooled if there is room.
+    """
+
+    def __init__(self, sets: int):
+        self.sets = sets
+        self._buffers: Dict[str, List[torch.Tensor]] = {}
+        self._lock = threading.Lock()
+
+    def views(self, kind: str, values: List[torch.Tensor]) -> List[torch.Tensor]:
+        """Contiguous tensors shaped like values, carved out of one buffer of kind."""
+        offsets = []
+        total = 0
+        for value in values:
+            total = _align(total, ARENA_ALIGNMENT)
+            offsets.append(total)
+            total += value.numel() * value.element_size()
+
+        with self._lock:
+            buffer = self._acquire(kind, max(total, 1))
+            return [
+                buffer[offset:offset + value.numel() * value.element_size()].view(value.dtype).view(value.shape)
+                for offset, value in zip(offsets, values)
+            ]
+
+    def _acquire(self, kind: str, nbytes: int) -> torch.Tensor:
+        pooled = [buffer for buffer in self._buffers.get(kind, []) if buffer.numel() == nbytes]
+        self._buffers[kind] = pooled
+        for buffer in pooled:
+            if storage_use_count(buffer) == 1:
+                return buffer
+        buffer = _allocate(kind, nbytes)
+        if len(pooled) < self.sets:
+            pooled.append(buffer)
+        return buffer
+
+def _allocate(kind: str, nbytes: int) -> torch.Tensor:
+    """A byte buffer in host memory, pinned memory, or a shared memory segment that
+    other processes can map through its file descriptor."""
+    if kind == "shared":
+        return torch.empty(0, dtype=torch.uint8).set_(torch.UntypedStorage._new_using_fd_cpu(nbytes))
+    return torch.empty(nbytes, dtype=torch.uint8, pin_memory=kind == "pinned")
+
+def take_snapshot(
+    version: int,
+    leaves: Iterable[Tuple[str, Any]],
+    on_ready: Callable[[Snapshot], None],
+    share_memory: bool = False,
+    buffers: Optional[SnapshotBuffers] = None,
+) -> None:
+    """Copy the (path, value) leaves of a state dict and pass the copy to on_ready.
+
+    CPU tensors are copied before returning, since the caller may modify them as
+    soon as it regains control. CUDA tensors are copied into pinned memory on a side
+    stream, and the current stream of their device waits for those copies before
+    running anything queued after this call, so the host never blocks. on_ready is
+    then called from a helper thread once the copies have landed.
+
+    The copies are carved out of buffers, which hands out a buffer of an earlier
+    snapshot only once nothing references it any more, so nothing a reader still
+    uses is ever overwritten, not even memory mapped by other processes. Without buffers, every snapshot is a fresh allocation.
+
+    With share_memory, every tensor of the snapshot lives in a single shared memory
+    segment, for same-host clients to map. CUDA tensors still land in pinned memory
+    first, and are moved into the segment by the helper thread.
+    """
+    leaves = list(leaves)
+    buffers = buffers if buffers is not None else SnapshotBuffers(0)
+    cuda_values = [value for _, value in leaves if isinstance(value, torch.Tensor) and value.is_cuda]
+    main_values = [
+        value for _, value in leaves
+        if isinstance(value, torch.Tensor) and (share_memory or not value.is_cuda)
+    ]
+    main = iter(buffers.views("shared" if share_memory else "host", main_values))
+    pinned = iter(buffers.views("pinned", cuda_values) if cuda_values else [])
+
+    tensors = {}
+    scalars = {}
+    streams = {}
+    staged = []
+    for path, value in leaves:
+        if not isinstance(value, torch.Tensor):
+            scalars[path] = value
+            continue
+
+        if not value.is_cuda:
+            tensors[path] = next(main).copy_(value.detach())
+            continue
+
+        stream = streams.get(value.device)
+        if stream is None:
+            stream = streams[value.device] = torch.cuda.Stream(value.device)
+            stream.wait_stream(torch.cuda.current_stream(value.device))
+        copy = next(pinned)
+        with torch.cuda.stream(stream):
+            copy.copy_(value, non_blocking=True)
+        tensors[path] = copy
+        if share_memory:
+            staged.append((path, copy, next(main)))
+
+    snapshot = Snapshot(version, tensors, scalars)
+    if not streams:
+        on_ready(snapshot)
+        return
+
+    events = []
+    for device, stream in streams.items():
+        done = torch.cuda.Event()
+        done.record(stream)
+        # Later updates of the live tensors must not overtake the copies
+        torch.cuda.current_stream(device).wait_event(done)
+        events.append(done)
+
+    def wait_and_publish():
+        for done in events:
+            done.synchronize()
+        for path, copy, shared in staged:
+            tensors[path] = shared.copy_(copy)
+        staged.clear()
+        on_ready(snapshot)
+
+    threading.Thread(target=wait_and_publish, daemon=True).start()
+
+def delta_block_numel(tensor: torch.Tensor) -> int:
+    """Elements per delta block of tensor."""
+    return max(DELTA_BLOCK_SIZE // tensor.element_size(), 1)
+
+def hash_snapshot(snapshot: Snapshot) -> Dict[str, torch.Tensor]:
+    """Block hashes of every tensor of a snapshot, keyed by path."""
+    return {path: block_hashes(tensor, delta_block_numel(tensor)) for path, tensor in snapshot.tensors.items()}
+
+def changed_block_runs(old: torch.Tensor, new: torch.Tensor) -> Optional[List[Tuple[int, int]]]:
+    """Runs of blocks whose hashes differ, as (first block, block count).
+
+    Returns None if the hashes don't describe tensors of the same size.
+    """
+    if old.shape != new.shape:
+        return None
+    runs: List[Tuple[int, int]] = []
+    for block in (old != new).nonzero().flatten().tolist():
+        if runs and runs[-1][0] + runs[-1][1] == block:
+            runs[-1] = (runs[-1][0], runs[-1][1] + 1)
+        else:
+            runs.append((block, 1))
+    return runs
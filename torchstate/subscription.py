@@ -0,0 +1,107 @@
+from typing import TYPE_CHECKING, Iterator, List, Optional, Union
+import select
+import socket
+import struct
+from torchstate.client import (
+    StateClient, StateClientError, _encode_path, _insert_nested, _pack_request, _pattern_root, _unpack_manifest,
+    recv_exact
+)
+from torchstate.snapshot import LIVE_VERSION
+from torchstate.ttype_consts import RequestType, TransferType
+
+if TYPE_CHECKING:
+    from torchstate.arena import TensorArena
+
+class Subscription:
+    """Tensors pushed by the server for every snapshot it publishes.
+
+    Subscribes to the tensors matching prefix, and any extra paths, on a connection
+    of its own. Iterating yields the state dict of each push, nested like
+    get_state_dict returns it, until the server goes away; version is the snapshot
+    the last push came from. Snapshots published while a push is still being
+    received are skipped for the latest one.
+
+    Tensors found in inplace are filled in place. Without inplace, the tensors
+    allocated by the first push are reused by the later ones, so every push
+    overwrites the state dict of the previous one.
+    """
+
+    def __init__(
+        self,
+        url: str,
+        prefix: str = "",
+        paths: Optional[List[Union[str, int]]] = None,
+        transfer_type: Optional[TransferType] = None,
+        inplace: Optional[dict] = None,
+        arena: Optional["TensorArena"] = None,
+        version: Optional[int] = None,
+    ):
+        self._client = StateClient(url)
+        self.root = _pattern_root(prefix)
+        # Only snapshots published after this one are pushed
+        self.version = version if version is not None else LIVE_VERSION
+        self._inplace = inplace
+        self._reuse = inplace is None
+        self._arena = arena
+
+        encoded_transfer_type = transfer_type.value if transfer_type else -1
+        body = (struct.pack('=iq', encoded_transfer_type, self.version)
+                + '\n'.join(_encode_path(p) for p in paths or []).encode())
+        try:
+            self._client._send_request(_pack_request(prefix, RequestType.SUBSCRIBE.value, len(body)) + body)
+            self._client._recv_response_header(-1)
+        except Exception:
+            self.close()
+            raise
+
+    @property
+    def closed(self) -> bool:
+        return self._client.client_socket is None
+
+    def close(self):
+        self._client.close()
+
+    def __enter__(self) -> "Subscription":
+        return self
+
+    def __exit__(self, *exc) -> None:
+        self.close()
+
+    def __iter__(self) -> Iterator[dict]:
+        while True:
+            state_dict = self.get()
+            if state_dict is None:
+                return
+            yield state_dict
+
+    def get(self, timeout: Optional[float] = None) -> Optional[dict]:
+        """Wait for the next push and receive it. Returns None if none started
+        within timeout seconds, or if the server ended the subscription, which
+        closes it."""
+        sock = self._client.client_socket
+        if sock is None:
+            raise StateClientError("Subscription is closed")
+        if timeout is not None:
+            readable, _, _ = select.select([sock], [], [], timeout)
+            if not readable:
+                return None
+        if not sock.recv(1, socket.MSG_PEEK):
+            self.close()
+            return None
+
+        try:
+            _, manifest_size = self._client._recv_response_header(-1)
+            self.version, entries = _unpack_manifest(recv_exact(sock, manifest_size))
+            parts, tensors = self._client._allocate_state_dict(self.root, entries, self._inplace, self._arena)
+            result = {}
+            for info, tensor_parts, tensor in zip(entries, parts, tensors):
+                self._client._recv_tensor_payload(info.transfer_type, info.numel, tensor)
+                _insert_nested(result, tensor_parts, tensor)
+        except Exception:
+            # Whatever is left of the push can't be skipped
+            self.close()
+            raise
+
+        if self._reuse:
+            self._inplace = result
+        return result
@@ -1,4 +1,5 @@
 from enum import Enum
+import torch
 
 class ScalarTransferType(Enum):
     STR = 0
@@ -6,11 +7,86 @@ class ScalarTransferType(Enum):
     FLOAT64 = 2
     BOOL8 = 3
 
+class RequestType(Enum):
+    # Switch the connection to persistent mode, where every request and
+    # response is prefixed with an 8 byte request ID ('q')
+    PERSISTENT = -2
+    # Fetch many tensors in one response. The path field holds an optional path
+    # prefix pattern and the size field the length of the request body
+    BATCH = -3
+    # Describe every tensor matching the path prefix pattern in the path field,
+    # in the manifest format of batch responses but without any tensor data
+    LIST = -4
+    # Fetch a range of elements of one tensor. The size field holds the length of
+    # the request body, which is the transfer type, first element and element
+    # count ('=iqq')
+    RANGE = -5
+    # Ask which server to fetch the path prefix pattern from. The body is the
+    # transfer type and the seconds waited for a source so far ('=id'). The
+    # response body is the snapshot version served and how many seconds to wait
+    # before asking again, 0 unless every source is busy ('=qd'), followed by the
+    # URL of a relay, or nothing for the server itself
+    RELAY_SOURCE = -6
+    # Announce a relay serving the path prefix pattern. The body is the relay URL,
+    # the URL it fetched from, whether fetching from that one failed ('1' or '0'),
+    # the transfer type and the snapshot version it fetched, separated by
+    # newlines. An empty relay URL only frees the slot taken on the source.
+    RELAY_ANNOUNCE = -7
+    # Fetch the blocks of one tensor that changed since a snapshot version the
+    # client holds. The size field holds the length of the request body, which is
+    # the transfer type and that version ('=iq')
+    DELTA = -8
+    # Set up an RDMA queue pair. The body is the connection details of the client
+    # end, the response body those of the server end
+    RDMA_CONNECT = -9
+    # Describe the tensor at the path, or every tensor matching the path prefix
+    # pattern, with the memory regions to read them from. The response body is
+    # the manifest length ('q'), a list manifest, then the region of every entry
+    RDMA_REGIONS = -10
+    # Tear down the queue pair set up by RDMA_CONNECT with the client details in
+    # the body
+    RDMA_DISCONNECT = -11
+    # Map the tensor at the path, or every tensor matching the path prefix pattern,
+    # from shared memory. Only served over the Unix socket of shm:// clients. The
+    # body is the IDs of the segments the client has mapped ('q' each). The
+    # response body is the manifest length, the number of new segments and of
+    # file descriptors passed with the response ('qqq'), a list manifest, the
+    # region of every entry, then the descriptors of the new segments
+    SHM_MAP = -12
+    # Set the priority class of the responses on the connection to the size field
+    PRIORITY = -13
+    # Fetch the server metrics. The response body is in the Prometheus text format
+    STATS = -14
+    # Subscribe to the tensors matching the path prefix pattern in the path field.
+    # The size field holds the length of the request body, which is the transfer
+    # type and the snapshot version the client already holds ('=iq'), followed by
+    # newline separated extra paths like in batch requests. After the response,
+    # the server pushes a batch response for every snapshot published after that
+    # version, until either side closes the connection
+    SUBSCRIBE = -15
+    # Fetch everything but the tensors of the value at the path, e.g. the param
+    # groups and step counters of an optimizer state dict. The response body is
+    # the snapshot version ('q'), then the value as a skeleton tree (see
+    # skeleton.h) referencing its tensors by key ID
+    SKELETON = -16
+
+class Priority(Enum):
+    """Classes the server schedules responses in when its bandwidth is short, most
+    urgent first."""
+    # Ranks recovering their state, which the job is usually waiting on
+    RECOVERY = 0
+    NORMAL = 1
+    # Readers that can wait, like eval pollers
+    BACKGROUND = 2
+
 class TransferType(Enum):
     FLOAT32 = 4
     BFLOAT16 = 5
     FLOAT16 = 6
     UNIFORM_INT8 = 7
+    # Lossless, the tensor dtype byte-shuffled and compressed with zstd or lz4
+    SHUFFLE_ZSTD = 8
+    SHUFFLE_LZ4 = 9
 
 TTYPE_TO_ELEMENT_SIZE = {
     TransferType.FLOAT32.value: 4,
@@ -19,6 +95,33 @@ TTYPE_TO_ELEMENT_SIZE = {
     TransferType.UNIFORM_INT8.value: 1,
 }
 
+# Transfer types whose frames are compressed, and vary in size with the data.
+# Every frame starts with the dtype code of its elements and whether they are
+# byte-shuffled ('ii').
+COMPRESSED_TTYPES = {
+    TransferType.SHUFFLE_ZSTD.value,
+    TransferType.SHUFFLE_LZ4.value,
+}
+
+TRANSFER_TYPE_VALUES = {t.value for t in TransferType}
+
+# Bytes of codebook at the start of every payload frame (256 fp32 entries)
 TTYPE_TO_CODEBOOK_SIZE = {
-    TransferType.UNIFORM_INT8.value: 256,
+    TransferType.UNIFORM_INT8.value: 256 * 4,
 }
+
+# Tensor dtypes are sent over the wire as their index in this list
+DTYPE_CODES = [
+    torch.float32,
+    torch.bfloat16,
+    torch.float16,
+    torch.float64,
+    torch.int64,
+    torch.int32,
+    torch.int16,
+    torch.int8,
+    torch.uint8,
+    torch.bool,
+]
+
+DTYPE_TO_CODE = {dtype: code for code, dtype in enumerate(DTYPE_CODES)}